@@ -0,0 +1,32 @@
+--[[-------------------------------------------------------------------------
+	Name:		bench/dispatch.lua
+	Action:	Scheduler benchmark.  Runs JOBS chatty jobs that each print LINES
+					lines (with a short sleep in between), and reports the CPU time
+					presto itself used; the children's time is not included.
+
+					presto -j 128 -f bench/dispatch.lua JOBS=1024 LINES=20 >/dev/null
+
+					The commands use a POSIX shell.
+-------------------------------------------------------------------------]]--
+local jobs = tonumber(make.env.JOBS) or 1024
+local lines = tonumber(make.env.LINES) or 20
+local command = "i=0; while [ $i -lt "..lines.." ]; do echo line $i; sleep 0.01; i=$((i+1)); done"
+
+-- count coroutine resumes; each one is a trip through the scheduler
+local resumes = 0
+local resume = coroutine.resume
+coroutine.resume = function(...) resumes = resumes + 1; return resume(...) end
+
+local all = phony_target("all")
+all.command = function(self)
+	make.message(string.format("%d jobs x %d lines at -j %d: %.3fs scheduler CPU, %d resumes",
+		jobs, lines, make.jobs.slots, os.clock(), resumes))
+end
+
+local deps = {}
+for i = 1,jobs do
+	local name = "bench-job-"..i
+	phony_target(name).command = function(self) make.run(command) end
+	deps[#deps+1] = name
+end
+all:depends_on(deps)
@@ -0,0 +1,40 @@
+--[[-------------------------------------------------------------------------
+	Name:		bench/graph.lua
+	Action:	Scheduling benchmark.  Builds a graph of JOBS targets in LAYERS
+					layers, where each target depends on every target in a window
+					of FANIN in the layer below; every target runs one trivial 
+					process.  Reports the CPU time presto itself used, loading the
+					makefile and then building; the children's time is not 
+					included.
+
+					presto -j 16 -f bench/graph.lua JOBS=5000 LAYERS=10 FANIN=4
+
+					The commands use a POSIX shell.
+-------------------------------------------------------------------------]]--
+local jobs = tonumber(make.env.JOBS) or 5000
+local layers = tonumber(make.env.LAYERS) or 10
+local fanin = tonumber(make.env.FANIN) or 4
+local width = math.ceil(jobs / layers)
+
+local loaded
+local all = phony_target("all")
+all.command = function(self)
+	make.message(string.format("%d targets in %d layers (fan-in %d) at -j %d: %.3fs loading, %.3fs building",
+		width * layers, layers, fanin, make.jobs.slots, loaded, os.clock() - loaded))
+end
+
+local top = {}
+for layer = 1,layers do
+	for i = 1,width do
+		local t = phony_target("graph-"..layer.."-"..i)
+		t.command = function(self) make.run("true") end
+		if layer > 1 then
+			local deps = {}
+			for j = 0,fanin-1 do deps[#deps+1] = "graph-"..(layer-1).."-"..((i + j - 1) % width + 1) end
+			t:depends_on(deps)
+		end
+		if layer == layers then top[#top+1] = t.name end
+	end
+end
+all:depends_on(top)
+loaded = os.clock()
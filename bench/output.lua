@@ -0,0 +1,27 @@
+--[[-------------------------------------------------------------------------
+	Name:		bench/output.lua
+	Action:	Output benchmark.  Runs JOBS jobs that each write LINES lines as
+					fast as they can, and reports the CPU time presto itself spent
+					handling the output; the children's time is not included.
+
+					presto -j 8 -f bench/output.lua JOBS=64 LINES=100000 >/dev/null
+
+					The commands use a POSIX shell.
+-------------------------------------------------------------------------]]--
+local jobs = tonumber(make.env.JOBS) or 64
+local lines = tonumber(make.env.LINES) or 100000
+local command = "seq -f 'warning: line %g of some chatty compiler output' "..lines
+
+local all = phony_target("all")
+all.command = function(self)
+	make.message(string.format("%d jobs x %d lines at -j %d: %.3fs scheduler CPU",
+		jobs, lines, make.jobs.slots, os.clock()))
+end
+
+local deps = {}
+for i = 1,jobs do
+	local name = "bench-job-"..i
+	phony_target(name).command = function(self) make.run(command) end
+	deps[#deps+1] = name
+end
+all:depends_on(deps)
@@ -0,0 +1,36 @@
+--[[-------------------------------------------------------------------------
+	Name:		bench/spawn.lua
+	Action:	Process-launch benchmark.  Runs JOBS jobs that each run a trivial
+					command, and reports the wall-clock time.  ARGV=1 runs the 
+					command from an argv table (no shell) instead of a string.
+					HEAP=N first fills N megabytes of the Lua heap, to stand in for
+					a big build graph.
+
+					presto -j 8 -f bench/spawn.lua JOBS=2000 ARGV=1 HEAP=500
+
+					The commands use POSIX tools.
+-------------------------------------------------------------------------]]--
+local jobs = tonumber(make.env.JOBS) or 2000
+local command = "true"
+if make.env.ARGV == "1" then command = {"true"} end
+
+local ballast = {}
+for i = 1,(tonumber(make.env.HEAP) or 0) * 1024 do
+	ballast[i] = string.rep(string.format("%08d", i), 128) -- 1K each
+end
+local start = make.now()
+
+local all = phony_target("all")
+all.command = function(self)
+	make.message(string.format("%d %s jobs at -j %d, %dM heap: %.3fs",
+		jobs, type(command) == "table" and "argv" or "shell", make.jobs.slots, 
+		collectgarbage("count") / 1024, make.now() - start))
+end
+
+local deps = {}
+for i = 1,jobs do
+	local name = "bench-job-"..i
+	phony_target(name).command = function(self) make.run(command) end
+	deps[#deps+1] = name
+end
+all:depends_on(deps)
@@ -0,0 +1,35 @@
+--[[-------------------------------------------------------------------------
+	Name:		bench/targets.lua
+	Action:	Graph-size benchmark.  Defines TARGETS object-file targets, each
+					of which depends on its source file and DEPS of 1000 generated
+					headers, then reports the memory used per target (the Lua heap,
+					plus the native graph store) and the time it took.  Nothing is
+					built.
+
+					presto -Q -f bench/targets.lua TARGETS=500000 DEPS=4
+-------------------------------------------------------------------------]]--
+local count = tonumber(make.env.TARGETS) or 500000
+local fanin = tonumber(make.env.DEPS) or 4
+
+collectgarbage("collect")
+local heap = collectgarbage("count") * 1024
+local native = make.graph and make.graph.memory() or 0
+local start = os.clock()
+
+local build = function(self) make.run("touch " .. self.name) end
+for i = 1,1000 do
+	target:new{ "gen/header" .. i .. ".h", command = build }
+end
+for i = 1,count do
+	local t = target:new{ "obj/file" .. i .. ".o", command = build }
+	local deps = { "src/file" .. i .. ".c" }
+	for j = 1,fanin do deps[#deps+1] = "gen/header" .. ((i * 7 + j * 13) % 1000 + 1) .. ".h" end
+	t:depends_on(deps)
+end
+
+local elapsed = os.clock() - start
+collectgarbage("collect")
+heap = collectgarbage("count") * 1024 - heap
+native = (make.graph and make.graph.memory() or 0) - native
+make.message(string.format("%d targets, %d deps each: %.0f bytes/target (%.0f Lua, %.0f native), %.2fs",
+	count, fanin + 1, (heap + native) / count, heap / count, native / count, elapsed))
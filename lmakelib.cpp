@@ -40,6 +40,7 @@ const char* lua_converttostring(lua_State* L, int pos, size_t* len) {
 	Returns:	converted path
 
 ***********************************************************************EDOC*/
+#ifdef _WIN32
 inline char* _lua_topath(char* out, const char* in, size_t* len) {
 	memcpy(out, in, (*len)+1);
 	for (size_t i=0; i<(*len); i++)
@@ -85,6 +86,13 @@ inline void lua_pushpath(lua_State* L, const wchar_t* path) {
 	WideCharToMultiByte(CP_UTF8, 0, path, wide_len, buffer, narrow_len, 0, 0);
 	lua_pushpath(L, buffer);
 }
+#else
+// POSIX paths already use forward slashes; no conversion is necessary.
+#define lua_getpath(L, stack_pos, len) luaL_checklstring(L, stack_pos, len)
+inline void lua_pushpath(lua_State* L, const std::string& path) {
+	lua_pushlstring(L, path.data(), path.size());
+}
+#endif
 
 
 /*SDOC***********************************************************************
@@ -130,6 +138,7 @@ inline void lua_pushhex(lua_State* L, const unsigned char* buffer, size_t len) {
 						constructing command-strings to pass to make.run().
 
 ***********************************************************************EDOC*/
+#ifdef _WIN32
 static int make_path_to_os(lua_State* L) {
 	size_t l; char* path_in = lua_getpath(L, 1, &l);	// convert to backslashes
 	lua_pushstring(L,path_in);
@@ -565,6 +574,274 @@ static int make_path_where(lua_State* L) {
 		lua_pushnil(L);
 	return 1;
 }
+#else
+/*SDOC***********************************************************************
+
+	Name:			(POSIX versions of the make.path functions)
+
+	Action:		Same behavior as the Win32 versions above, which lean on
+						shlwapi.  Paths are manipulated purely lexically; nothing
+						here touches the filesystem except full, glob and where.
+
+***********************************************************************EDOC*/
+static size_t path_name_pos(const std::string& path) {
+	size_t slash = path.rfind('/');
+	return slash == std::string::npos ? 0 : slash+1;
+}
+
+static size_t path_ext_pos(const std::string& path) {
+	size_t dot = path.rfind('.');
+	return (dot == std::string::npos || dot < path_name_pos(path)) ? path.size() : dot;
+}
+
+static std::string path_canonicalize(const std::string& path) {
+	bool absolute = !path.empty() && path[0] == '/';
+	bool trailing = path.size() > 1 && path[path.size()-1] == '/';
+	std::vector<std::string> parts;
+	size_t pos = 0;
+	while(pos <= path.size()) {
+		size_t next = path.find('/', pos);
+		if(next == std::string::npos) next = path.size();
+		std::string part = path.substr(pos, next-pos);
+		if(part == "..") {
+			if(!parts.empty() && parts.back() != "..") parts.pop_back();
+			else if(!absolute) parts.push_back(part);
+		} else if(!part.empty() && part != ".") {
+			parts.push_back(part);
+		}
+		pos = next+1;
+	}
+	std::string out = absolute ? "/" : "";
+	for(size_t i=0; i<parts.size(); i++) {
+		if(i) out += '/';
+		out += parts[i];
+	}
+	if(trailing && !parts.empty()) out += '/';
+	return out;
+}
+
+static std::string path_combine(const std::string& dir, const std::string& file) {
+	if(dir.empty() || (!file.empty() && file[0] == '/'))
+		return path_canonicalize(file);
+	if(file.empty())
+		return path_canonicalize(dir);
+	return path_canonicalize(dir + "/" + file);
+}
+
+static std::string path_cwd() {
+	char buffer[4096];
+	return getcwd(buffer, sizeof(buffer)) ? buffer : "";
+}
+
+static int make_path_to_os(lua_State* L) {
+	luaL_checkstring(L, 1);
+	lua_pushvalue(L, 1);
+	return 1;
+}
+
+static int make_path_from_os(lua_State* L) {
+	luaL_checkstring(L, 1);
+	lua_pushvalue(L, 1);
+	return 1;
+}
+
+static int make_path_short(lua_State* L) {
+	return make_path_to_os(L);
+}
+
+static int make_path_long(lua_State* L) {
+	return make_path_to_os(L);
+}
+
+static int make_path_full(lua_State* L) {
+	size_t l; std::string path_in = lua_getpath(L, 1, &l);
+	lua_pushpath(L, path_combine(path_cwd(), path_in));
+	return 1;
+}
+
+static int make_path_canonicalize(lua_State* L) {
+	size_t l; std::string path_in = lua_getpath(L, 1, &l);
+	lua_pushpath(L, path_canonicalize(path_in));
+	return 1;
+}
+
+static int make_path_add_slash(lua_State* L) {
+	size_t l; std::string path_out = lua_getpath(L, 1, &l);
+	if(path_out.empty() || path_out[path_out.size()-1] != '/')
+		path_out += '/';
+	lua_pushpath(L, path_out);
+	return 1;
+}
+
+static int make_path_remove_slash(lua_State* L) {
+	size_t l; std::string path_out = lua_getpath(L, 1, &l);
+	if(path_out.size() > 1 && path_out[path_out.size()-1] == '/')
+		path_out.erase(path_out.size()-1);
+	lua_pushpath(L, path_out);
+	return 1;
+}
+
+static int make_path_remove_ext(lua_State* L) {
+	size_t l; std::string path_out = lua_getpath(L, 1, &l);
+	path_out.erase(path_ext_pos(path_out));
+	lua_pushpath(L, path_out);
+	return 1;
+}
+
+static int make_path_quote(lua_State* L) {
+	size_t l; std::string path_out = lua_getpath(L, 1, &l);
+	if(path_out.find(' ') != std::string::npos && path_out[0] != '"')
+		path_out = "\"" + path_out + "\"";
+	lua_pushpath(L, path_out);
+	return 1;
+}
+
+static int make_path_unquote(lua_State* L) {
+	size_t l; std::string path_out = lua_getpath(L, 1, &l);
+	if(path_out.size() >= 2 && path_out[0] == '"' && path_out[path_out.size()-1] == '"')
+		path_out = path_out.substr(1, path_out.size()-2);
+	lua_pushpath(L, path_out);
+	return 1;
+}
+
+static int make_path_get_ext(lua_State* L) {
+	size_t l; std::string path_in = lua_getpath(L, 1, &l);
+	lua_pushpath(L, path_in.substr(path_ext_pos(path_in)));
+	return 1;
+}
+
+static int make_path_get_name(lua_State* L) {
+	size_t l; std::string path_in = lua_getpath(L, 1, &l);
+	lua_pushpath(L, path_in.substr(path_name_pos(path_in)));
+	return 1;
+}
+
+static int make_path_get_dir(lua_State* L) {
+	size_t l; std::string path_in = lua_getpath(L, 1, &l);
+	lua_pushpath(L, path_in.substr(0, path_name_pos(path_in)));
+	return 1;
+}
+
+static int make_path_is_relative(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	lua_pushboolean(L, path_in[0] != '/');
+	return 1;
+}
+
+static int make_path_add_ext(lua_State* L) {
+	size_t l1; std::string path_out = lua_getpath(L, 1, &l1);
+	size_t l2; const char* ext = lua_getpath(L, 2, &l2);
+	if(path_ext_pos(path_out) == path_out.size()) // only if there isn't one already
+		path_out += ext;
+	lua_pushpath(L, path_out);
+	return 1;
+}
+
+static int make_path_change_ext(lua_State* L) {
+	size_t l1; std::string path_out = lua_getpath(L, 1, &l1);
+	size_t l2; const char* ext = lua_getpath(L, 2, &l2);
+	path_out.erase(path_ext_pos(path_out));
+	path_out += ext;
+	lua_pushpath(L, path_out);
+	return 1;
+}
+
+int make_path_combine(lua_State* L) {
+	std::string path_out;
+	// extract all the path strings
+	int pos = 1;
+	while(!lua_isnoneornil(L,pos)) {
+		size_t lua_path_len;
+		const char* lua_path = lua_converttostring(L, pos++, &lua_path_len);
+		path_out = path_combine(path_out, std::string(lua_path, lua_path_len));
+	}
+	lua_pushpath(L, path_out);
+	return 1;
+}
+
+static int make_path_common(lua_State* L) {
+	size_t l1; const char* path1 = lua_getpath(L, 1, &l1);
+	size_t l2; const char* path2 = lua_getpath(L, 2, &l2);
+	// find the last path separator that both paths share
+	size_t i = 0, common = 0;
+	while(i < l1 && i < l2 && path1[i] == path2[i]) {
+		if(path1[i] == '/') common = i ? i : 1;
+		i++;
+	}
+	if((i == l1 || path1[i] == '/') && (i == l2 || path2[i] == '/'))
+		common = i;
+	if(common)
+		lua_pushlstring(L, path1, common);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static int make_path_glob(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+
+	lua_newtable(L);
+	glob_t g;
+	int pos = 1;
+	if(glob(path_in, 0, NULL, &g) == 0) {
+		for(size_t i=0; i<g.gl_pathc; i++) {
+			const char* name = strrchr(g.gl_pathv[i], '/');
+			name = name ? name+1 : g.gl_pathv[i];
+			if(strcmp(name,".") && strcmp(name,"..")) {
+				lua_pushnumber(L, pos++);							// key
+				lua_pushstring(L, name);							// value
+				lua_settable(L, -3);									// t[key] = value
+			}
+		}
+		globfree(&g);
+	}
+	return 1;
+}
+
+static int make_path_where(lua_State* L) {
+	size_t l; std::string path_in = lua_getpath(L, 1, &l);
+	std::vector<std::string> dirs;
+	std::string search;
+	if(lua_gettop(L) >= 2) {
+		if(lua_isstring(L,2) && !lua_isnumber(L,2)) {
+			// colon separated string
+			search = lua_tostring(L, 2);
+		} else if(lua_istable(L,2)) {
+			// extract all the path strings
+			for(int pos = 1; ; pos++) {
+				lua_rawgeti(L, 2, pos);
+				if(lua_isnil(L,-1))
+					break;
+				dirs.push_back(luaL_checkstring(L, -1));
+				lua_pop(L, 1);
+			}
+		} else {
+			luaL_error(L, "expected string or table for search path");
+		}
+	} else {
+		// use $PATH
+		const char* env_path = getenv("PATH");
+		search = env_path ? env_path : "";
+	}
+	for(size_t pos = 0; pos < search.size(); ) {
+		size_t next = search.find(':', pos);
+		if(next == std::string::npos) next = search.size();
+		dirs.push_back(search.substr(pos, next-pos));
+		pos = next+1;
+	}
+
+	for(size_t i=0; i<dirs.size(); i++) {
+		std::string candidate = path_combine(dirs[i].empty() ? "." : dirs[i], path_in);
+		struct stat st;
+		if(stat(candidate.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+			lua_pushpath(L, candidate);
+			return 1;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+#endif
 
 static const luaL_Reg make_pathlib[] = {
   {"canonicalize", make_path_canonicalize},		// make.path.canonicalize
@@ -607,6 +884,7 @@ static const luaL_Reg make_pathlib[] = {
 	Returns:	[1] bool
 
 ***********************************************************************EDOC*/
+#ifdef _WIN32
 static int make_file_exists(lua_State* L) {
   size_t l; wchar_t* path_in = lua_getpath(L, 1, &l);
 	BOOL result = PathFileExistsW(path_in);
@@ -770,6 +1048,37 @@ static int make_file_time(lua_State* L) {
 }
 
 
+/*SDOC***********************************************************************
+
+	Name:			make_file_stamp
+
+	Action:		Returns a string that changes whenever the file does
+
+	Params:		[1] string - filename
+
+	Returns:	[1] string - the file's size and exact modification time
+						 or: nil - if the file doesn't exist
+
+	Comments:	Unlike make.file.time, the stamp doesn't depend on when presto
+						was launched, so it can be saved and compared on a later run 
+						(e.g., to tell if a tool has been upgraded).
+
+***********************************************************************EDOC*/
+static int make_file_stamp(lua_State* L) {
+  size_t l; wchar_t* path_in = lua_getpath(L, 1, &l);
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if(GetFileAttributesExW(path_in, GetFileExInfoStandard, &data) && !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		char stamp[64];
+		sprintf(stamp, "%lu:%lu:%lu:%lu", data.nFileSizeHigh, data.nFileSizeLow,
+			data.ftLastWriteTime.dwHighDateTime, data.ftLastWriteTime.dwLowDateTime);
+		lua_pushstring(L, stamp);
+	} else {
+		lua_pushnil(L);
+	}
+  return 1;
+}
+
+
 /*SDOC***********************************************************************
 
 	Name:			make_file_md5
@@ -792,7 +1101,7 @@ static int make_file_md5(lua_State* L) {
 	HANDLE hFile = CreateFileW(path_in, GENERIC_READ, FILE_SHARE_READ, NULL, 
 		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 	if( hFile == INVALID_HANDLE_VALUE)
-		luaL_error(L, "error opening file "LUA_QS" for reading", path_in);
+		luaL_error(L, "error opening file " LUA_QS " for reading", path_in);
 	MD5_CTX md5;
 	MD5Init(&md5);
 
@@ -810,6 +1119,151 @@ static int make_file_md5(lua_State* L) {
 	lua_pushhex(L, md5.digest, sizeof(md5.digest));
 	return 1;
 }
+#else
+/*SDOC***********************************************************************
+
+	Name:			(POSIX versions of the make.file functions)
+
+	Action:		Same behavior as the Win32 versions above.
+
+***********************************************************************EDOC*/
+static struct timespec start_time = {};
+static double presto_time(const struct timespec& ts) {
+	return (double)(ts.tv_sec - start_time.tv_sec) + (ts.tv_nsec - start_time.tv_nsec) * 1.0e-9;
+}
+
+static std::string temp_dir() {
+	const char* dir = getenv("TMPDIR");
+	std::string out = (dir && *dir) ? dir : "/tmp";
+	if(out[out.size()-1] != '/') out += '/';
+	return out;
+}
+
+static int make_file_exists(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	struct stat st;
+	lua_pushboolean(L, stat(path_in, &st) == 0);
+	return 1;
+}
+
+static int make_file_temp(lua_State* L) {
+	std::string path_out = temp_dir() + "preXXXXXX";
+	int fd = mkstemp(&path_out[0]);
+	if(fd != -1)
+		close(fd);
+	lua_pushpath(L, path_out);
+	return 1;
+}
+
+static int make_file_touch(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	int fd = open(path_in, O_WRONLY|O_CREAT|O_NOCTTY|O_CLOEXEC, 0666);
+	if(fd == -1 && errno != EISDIR)
+		luaL_error(L, "error touching file " LUA_QS, path_in);
+	if(fd != -1)
+		close(fd);
+	utimensat(AT_FDCWD, path_in, NULL, 0);
+	return 0;
+}
+
+static int make_file_copy(lua_State* L) {
+	size_t l1; const char* path1 = lua_getpath(L, 1, &l1);
+	size_t l2; const char* path2 = lua_getpath(L, 2, &l2);
+	struct stat st;
+	int in = open(path1, O_RDONLY|O_CLOEXEC);
+	if(in == -1 || fstat(in, &st) != 0) {
+		if(in != -1) close(in);
+		luaL_error(L, "error copying file " LUA_QS " to " LUA_QS, path1, path2);
+	}
+	int out = open(path2, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, st.st_mode & 0777);
+	bool ok = out != -1;
+	char buffer[65536];
+	ssize_t n;
+	while(ok && (n = read(in, buffer, sizeof(buffer))) != 0) {
+		if(n < 0) { ok = (errno == EINTR); continue; }
+		for(ssize_t done = 0; ok && done < n; ) {
+			ssize_t w = write(out, buffer+done, n-done);
+			if(w > 0) done += w; else ok = (errno == EINTR);
+		}
+	}
+	if(ok) {
+		// CopyFile() preserves the last-write time; so do we
+		struct timespec times[2] = { st.st_atim, st.st_mtim };
+		futimens(out, times);
+	}
+	close(in);
+	if(out != -1) close(out);
+	if(!ok)
+		luaL_error(L, "error copying file " LUA_QS " to " LUA_QS, path1, path2);
+	return 0;
+}
+
+static int make_file_delete(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	if(unlink(path_in) != 0 && errno != ENOENT)
+		luaL_error(L, "error deleting file " LUA_QS, path_in);
+	return 0;
+}
+
+static int make_file_size(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	struct stat st;
+	if(stat(path_in, &st) == 0 && !S_ISDIR(st.st_mode))
+		lua_pushnumber(L,(double)st.st_size);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static int make_file_time(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	struct stat st;
+	if(stat(path_in, &st) == 0 && !S_ISDIR(st.st_mode))
+		lua_pushnumber(L, presto_time(st.st_mtim));
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static int make_file_stamp(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	struct stat st;
+	if(stat(path_in, &st) == 0 && !S_ISDIR(st.st_mode)) {
+		char stamp[64];
+		snprintf(stamp, sizeof(stamp), "%lld:%lld.%09ld", (long long)st.st_size,
+			(long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+		lua_pushstring(L, stamp);
+	} else {
+		lua_pushnil(L);
+	}
+	return 1;
+}
+
+static int make_file_md5(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+
+	// compute the md5 hash
+	int fd = open(path_in, O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+		luaL_error(L, "error opening file " LUA_QS " for reading", path_in);
+	MD5_CTX md5;
+	MD5Init(&md5);
+
+	// Read & process 4k at a time
+	unsigned char buffer[4096];
+	ssize_t n;
+	while((n = read(fd, buffer, sizeof(buffer))) != 0) {
+		if(n < 0) { if(errno == EINTR) continue; break; }
+		MD5Update(&md5, buffer, (unsigned int)n);
+	}
+	close(fd);
+	MD5Final(&md5);
+
+	// send the result to lua
+	lua_pushhex(L, md5.digest, sizeof(md5.digest));
+	return 1;
+}
+#endif
 
 static const luaL_Reg make_filelib[] = {
 	{"exists", make_file_exists},								// make.file.exists
@@ -819,6 +1273,7 @@ static const luaL_Reg make_filelib[] = {
 	{"delete",make_file_delete},								// make.file.delete
 	{"size",make_file_size},										// make.file.size
 	{"time",make_file_time},										// make.file.time
+	{"stamp",make_file_stamp},									// make.file.stamp
 	{"md5",make_file_md5},											// make.file.md5
   {NULL, NULL}
 };
@@ -839,6 +1294,7 @@ static const luaL_Reg make_filelib[] = {
 	Returns:	[1] bool
 
 ***********************************************************************EDOC*/
+#ifdef _WIN32
 static int make_dir_is_dir(lua_State* L) {
   size_t l; wchar_t* path_in = lua_getpath(L, 1, &l);
 	BOOL result = PathIsDirectoryW(path_in);
@@ -956,324 +1412,4226 @@ static int make_dir_rd(lua_State* L) {
 		luaL_error(L, "error removing directory " LUA_QS, path_in);
 	return 0;
 }
+#else
+/*SDOC***********************************************************************
 
-static const luaL_Reg make_dirlib[] = {
-	{"is_dir", make_dir_is_dir},								// make.dir.is_dir
-	{"is_empty", make_dir_is_empty},						// make.dir.is_empty
-	{"temp",make_dir_temp},											// make.dir.temp
-	{"cd",make_dir_cd},													// make.dir.cd
-	{"md",make_dir_md},													// make.dir.md
-	{"rd",make_dir_rd},													// make.dir.rd
-  {NULL, NULL}
-};
-
+	Name:			(POSIX versions of the make.dir functions)
 
-//***************************************************************************
-//**************************  make.proc functions  **************************
-//***************************************************************************
+	Action:		Same behavior as the Win32 versions above.
 
-// Process USERDATA type
-struct process {
-	OVERLAPPED olp;					// for overlapped I/O on the proc's stdout handle
-	HANDLE hProcess;				// handle to the process
-	HANDLE hOutputRead;			// handle to the proc's stdout
-	DWORD dwExitCode;				// exit code
-	bool bWaiting;					// are we waiting for overlapped I/O?
-	char buffer[1024];			// overlapped I/O buffer
-	char leftovers[1024];		// buffer of data that hasn't been printed yet
-};
+***********************************************************************EDOC*/
+static bool is_dir(const char* path) {
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
 
+static int make_dir_is_dir(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	lua_pushboolean(L, is_dir(path_in));
+	return 1;
+}
 
-/*SDOC***********************************************************************
+static int make_dir_is_empty(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	bool result = false;
+	DIR* dir = opendir(path_in);
+	if(dir) {
+		result = true;
+		while(struct dirent* entry = readdir(dir)) {
+			if(strcmp(entry->d_name,".") && strcmp(entry->d_name,"..")) {
+				result = false;
+				break;
+			}
+		}
+		closedir(dir);
+	}
+	lua_pushboolean(L, result);
+	return 1;
+}
+
+static int make_dir_temp(lua_State* L) {
+	lua_pushpath(L, temp_dir());
+	return 1;
+}
+
+int make_dir_cd(lua_State* L) {
+	if(lua_gettop(L)) {// optional directory
+		size_t l; const char* path_in = lua_getpath(L, 1, &l);
+		if(chdir(path_in) != 0)
+			luaL_error(L, "error changing directory to " LUA_QS ": %s", path_in, strerror(errno));
+	}
+	lua_pushpath(L, path_cwd());
+	return 1;
+}
+
+static int make_dir_md(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	std::string path = path_in;
+	// create each missing component, from the top down
+	for(size_t pos = 1; pos <= path.size(); pos++) {
+		if(pos == path.size() || path[pos] == '/') {
+			std::string partial = path.substr(0, pos);
+			if(mkdir(partial.c_str(), 0777) != 0 && !(errno == EEXIST && is_dir(partial.c_str())))
+				luaL_error(L, "error creating directory " LUA_QS, path_in);
+		}
+	}
+	return 0;
+}
+
+static int make_dir_rd(lua_State* L) {
+	size_t l; const char* path_in = lua_getpath(L, 1, &l);
+	if(rmdir(path_in) != 0)
+		luaL_error(L, "error removing directory " LUA_QS, path_in);
+	return 0;
+}
+#endif
+
+static const luaL_Reg make_dirlib[] = {
+	{"is_dir", make_dir_is_dir},								// make.dir.is_dir
+	{"is_empty", make_dir_is_empty},						// make.dir.is_empty
+	{"temp",make_dir_temp},											// make.dir.temp
+	{"cd",make_dir_cd},													// make.dir.cd
+	{"md",make_dir_md},													// make.dir.md
+	{"rd",make_dir_rd},													// make.dir.rd
+  {NULL, NULL}
+};
+
+
+//***************************************************************************
+//**************************  make.proc functions  **************************
+//***************************************************************************
+
+// Resource usage of a finished process (see make_proc_usage)
+struct proc_usage {
+	double user;						// user-mode CPU time, in seconds
+	double system;					// kernel-mode CPU time, in seconds
+	double wall;						// wall-clock time, in seconds
+	double maxrss;					// peak resident set size, in bytes
+	double read_bytes;			// bytes read from storage
+	double write_bytes;			// bytes written to storage
+};
+
+// A process's output, as it's read from the pipe (see proc_output_read)
+struct proc_output {
+	char* buffer;						// output buffer
+	size_t cbBuffer;				// size of the output buffer
+	size_t cbPending;				// bytes at the start of the buffer that aren't a complete line yet
+	bool bSkipLF;						// the last read ended with a CR; ignore a LF that follows it
+	bool bFramed;						// output is length-prefixed frames, not lines (see make_proc_receive)
+	FILE* tee;							// copy of the output (stdout = {path, tee=true})
+};
+
+// Process USERDATA type
+#ifdef _WIN32
+struct process {
+	OVERLAPPED olp;					// for overlapped I/O on the proc's stdout handle
+	HANDLE hProcess;				// handle to the process
+	HANDLE hOutputRead;			// handle to the proc's stdout
+	HANDLE hInputWrite;			// handle to the proc's stdin (if requested; see make_proc_send)
+	HANDLE hJob;						// job object holding the process and its children ("group" option), or NULL
+	DWORD dwExitCode;				// exit code
+	bool bWaiting;					// are we waiting for overlapped I/O?
+	proc_output out;				// output read so far
+	proc_usage usage;				// resource usage, once the process has finished
+};
+#else
+// The pipe itself belongs to the reactor thread (see proc_stream); we
+// just get the lines it has read, and the exit status.
+struct process {
+	pid_t pid;							// process id; -1 once the process has been reaped (and its output delivered)
+	unsigned id;						// key in the table of running processes (see push_running_procs)
+	int fdInputWrite;				// write end of the proc's stdin pipe (if requested; see make_proc_send)
+	int exitcode;						// exit code (128+N if killed by signal N)
+	bool bGroup;						// leads its own process group ("group" option)
+	proc_output out;				// framed output that make_proc_receive hasn't taken yet
+	std::string* received;	// output from the reactor that hasn't been delivered yet
+	bool bReaped;						// the reactor has reaped the process; exitcode and usage are set
+	proc_usage usage;				// resource usage, once the process has been reaped
+};
+#endif
+
+// Output buffer sizes; the buffer starts small and doubles (up to the
+// maximum) whenever a process fills it in a single read.
+const size_t PROC_BUFFER_MIN = 4096;
+const size_t PROC_BUFFER_MAX = 65536;
+const size_t PROC_READ_MIN = 1024;		// never read less than this at once
+
+// Returns the process USERDATA from the process table at the given index,
+// or NULL if it isn't one.
+static process* lua_toprocess(lua_State* L, int idx) {
+	if(!lua_istable(L, idx))
+		return NULL;
+	lua_getfield(L, idx, "data");
+	process* p = (process*)lua_touserdata(L, -1);
+	if(p != NULL && lua_objlen(L, -1) != sizeof(process))
+		p = NULL;
+	lua_pop(L, 1);
+	return p;
+}
+
+// __gc metamethod for the process USERDATA; releases the output buffer
+static int make_proc_gc(lua_State* L) {
+	process* p = (process*)lua_touserdata(L, 1);
+#ifdef _WIN32
+	// make sure the kernel isn't still reading into the buffer
+	if(p->bWaiting && p->hProcess != INVALID_HANDLE_VALUE) {
+		DWORD dwRead;
+		CancelIo(p->hOutputRead);
+		GetOverlappedResult(p->hOutputRead, &p->olp, &dwRead, TRUE);
+	}
+#endif
+	free(p->out.buffer);
+	if(p->out.tee)
+		fclose(p->out.tee);
+#ifndef _WIN32
+	delete p->received;
+#endif
+	return 0;
+}
+
+// Pushes a new process table, {data = --[[process USERDATA]]--}, and 
+// returns the (zeroed) USERDATA so the caller can fill it in.
+static process* lua_pushprocess(lua_State* L) {
+	lua_newtable(L);
+	process* p = (process*)lua_newuserdata(L, sizeof(process));
+	memset(p, 0, sizeof(*p));
+	if(luaL_newmetatable(L, "make.process")) {
+		lua_pushcfunction(L, make_proc_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	p->out.buffer = (char*)malloc(PROC_BUFFER_MIN);
+	if(p->out.buffer == NULL)
+		luaL_error(L, "out of memory");
+	p->out.cbBuffer = PROC_BUFFER_MIN;
+	lua_setfield(L, -2, "data");
+	return p;
+}
+
+
+// Reads the arguments from an argv table (e.g., {"cc", "-c", "foo.c"});
+// anything with a __tostring metamethod (like a target) is converted.
+static void lua_getargv(lua_State* L, int idx, std::vector<std::string>& args) {
+	int n = (int)lua_objlen(L, idx);
+	if(n == 0)
+		luaL_argerror(L, idx, "empty argv table");
+	for(int i=1; i<=n; i++) {
+		lua_rawgeti(L, idx, i);
+		if(!luaL_callmeta(L, -1, "__tostring"))
+			lua_pushvalue(L, -1);
+		size_t len;
+		const char* arg = lua_tolstring(L, -1, &len);
+		if(arg == NULL)
+			luaL_error(L, "argv[%d]: string expected, got %s", i, luaL_typename(L, -2));
+		args.push_back(std::string(arg, len));
+		lua_pop(L, 2);
+	}
+}
+
+// Quotes a single argument so that it survives the trip through the 
+// command line: CommandLineToArgvW/MSVCRT rules on Windows, and /bin/sh
+// rules elsewhere.  Arguments that don't need quoting are left alone.
+static std::string quote_arg(const std::string& arg) {
+#ifdef _WIN32
+	if(!arg.empty() && arg.find_first_of(" \t\n\v\"") == std::string::npos)
+		return arg;
+	std::string out = "\"";
+	for(size_t i=0; ; i++) {
+		// backslashes are only special when they precede a quote
+		size_t backslashes = 0;
+		while(i < arg.size() && arg[i] == '\\') { backslashes++; i++; }
+		if(i == arg.size()) {
+			out.append(backslashes*2, '\\');
+			break;
+		} else if(arg[i] == '"') {
+			out.append(backslashes*2+1, '\\');
+		} else {
+			out.append(backslashes, '\\');
+		}
+		out += arg[i];
+	}
+	return out + "\"";
+#else
+	if(!arg.empty() && arg.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_@%+=:,./-") == std::string::npos)
+		return arg;
+	std::string out = "'";
+	for(size_t i=0; i<arg.size(); i++) {
+		if(arg[i] == '\'')
+			out += "'\\''";
+		else
+			out += arg[i];
+	}
+	return out + "'";
+#endif
+}
+
+// Joins (and quotes) an argv into a single command line
+static std::string join_argv(const std::vector<std::string>& args) {
+	std::string out;
+	for(size_t i=0; i<args.size(); i++) {
+		if(i)
+			out += ' ';
+		out += quote_arg(args[i]);
+	}
+	return out;
+}
+
+
+// Where one of a process's output streams goes
+enum { DEST_PIPE, DEST_INHERIT, DEST_FILE };
+
+// Options for make.proc.spawn()
+struct spawn_options {
+	bool bStdin;						// give the process a stdin pipe (for make.proc.send)
+	bool bFramed;						// output is read with make.proc.receive
+	int stdoutDest;					// DEST_*
+	int stderrDest;					// DEST_*
+	std::string stdoutPath;	// file for DEST_FILE (or for the tee)
+	std::string stderrPath;
+	bool bStdoutAppend;			// append to the file, rather than truncating it
+	bool bStderrAppend;
+	bool bTee;							// stdout goes to the pipe *and* stdoutPath
+	bool bGroup;						// own process group, so make.proc.kill() gets the children too
+	std::vector<int> cpus;	// the CPUs it may run on ("cpus" option); empty for any
+	spawn_options() : bStdin(false), bFramed(false), stdoutDest(DEST_PIPE), stderrDest(DEST_PIPE),
+		bStdoutAppend(false), bStderrAppend(false), bTee(false), bGroup(false) {}
+};
+
+// Reads a stream destination: "inherit", a path, or {path, append=true, 
+// tee=true}
+static void lua_getdestination(lua_State* L, int idx, const char* name, int& dest, std::string& path, bool& bAppend, bool* pTee) {
+	lua_getfield(L, idx, name);
+	if(lua_isstring(L, -1)) {
+		path = lua_tostring(L, -1);
+		dest = path == "inherit" ? DEST_INHERIT : DEST_FILE;
+	} else if(lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, 1);
+		if(!lua_isstring(L, -1))
+			luaL_error(L, "%s destination has no path", name);
+		path = lua_tostring(L, -1);
+		dest = DEST_FILE;
+		lua_getfield(L, -2, "append");
+		bAppend = lua_toboolean(L, -1) != 0;
+		lua_getfield(L, -3, "tee");
+		if(lua_toboolean(L, -1)) {
+			if(!pTee)
+				luaL_error(L, "%s can't be a tee", name);
+			*pTee = true;
+			dest = DEST_PIPE;
+		}
+		lua_pop(L, 3);
+	} else if(!lua_isnil(L, -1)) {
+		luaL_error(L, "bad %s destination", name);
+	}
+	lua_pop(L, 1);
+}
+
+static void lua_getspawnoptions(lua_State* L, int idx, spawn_options& opts) {
+	if(lua_isnoneornil(L, idx))
+		return;
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lua_getfield(L, idx, "stdin");
+	opts.bStdin = lua_toboolean(L, -1) != 0;
+	lua_getfield(L, idx, "framed");
+	opts.bFramed = lua_toboolean(L, -1) != 0;
+	lua_getfield(L, idx, "group");
+	opts.bGroup = lua_toboolean(L, -1) != 0;
+	lua_pop(L, 3);
+	lua_getfield(L, idx, "cpus");
+	if(lua_istable(L, -1)) {
+		for(int i=1; ; i++) {
+			lua_rawgeti(L, -1, i);
+			if(lua_isnil(L, -1))
+				break;
+			int cpu = (int)lua_tointeger(L, -1);
+			if(!lua_isnumber(L, -1) || cpu < 0)
+				luaL_error(L, "bad cpu number in 'cpus'");
+			opts.cpus.push_back(cpu);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	} else if(!lua_isnil(L, -1)) {
+		luaL_error(L, "'cpus' should be a table");
+	}
+	lua_pop(L, 1);
+	lua_getdestination(L, idx, "stdout", opts.stdoutDest, opts.stdoutPath, opts.bStdoutAppend, &opts.bTee);
+	lua_getdestination(L, idx, "stderr", opts.stderrDest, opts.stderrPath, opts.bStderrAppend, NULL);
+	if(opts.bFramed && opts.stdoutDest != DEST_PIPE)
+		luaL_error(L, "framed output needs stdout");
+}
+
+
+// An environment block (make.env_block); built once, and then handed as-is
+// to every process that's spawned with it
+struct env_block {
+	std::vector<std::string> vars;	// "NAME=value", sorted by name
+	std::string block;							// the same, each one NUL-terminated, then a NUL
+	std::vector<char*> ptrs;				// (POSIX) pointers into 'block', then NULL
+};
+
+// Compares the names of two "NAME=value" strings.  Windows names are
+// case-insensitive, and CreateProcess wants them sorted that way.
+static int env_name_compare(const std::string& a, const std::string& b) {
+	size_t la = a.find('='), lb = b.find('=');
+	if(la == std::string::npos) la = a.size();
+	if(lb == std::string::npos) lb = b.size();
+#ifdef _WIN32
+	int c = _strnicmp(a.c_str(), b.c_str(), la < lb ? la : lb);
+#else
+	int c = strncmp(a.c_str(), b.c_str(), la < lb ? la : lb);
+#endif
+	return c ? c : (int)la - (int)lb;
+}
+
+static bool env_name_less(const std::string& a, const std::string& b) {
+	return env_name_compare(a, b) < 0;
+}
+
+// Sets the variables in the table at 'idx'; a value of false removes one
+static void env_block_apply(lua_State* L, int idx, env_block* e) {
+	lua_pushnil(L);
+	while(lua_next(L, idx)) {
+		if(lua_type(L, -2) != LUA_TSTRING)
+			luaL_error(L, "environment variable names must be strings");
+		std::string var = lua_tostring(L, -2);
+		var += '=';
+		bool bRemove = lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1);
+		if(!bRemove)
+			var += luaL_checkstring(L, -1);
+		std::vector<std::string>::iterator it = std::lower_bound(e->vars.begin(), e->vars.end(), var, env_name_less);
+		bool bFound = it != e->vars.end() && env_name_compare(*it, var) == 0;
+		if(bRemove) {
+			if(bFound)
+				e->vars.erase(it);
+		} else if(bFound) {
+			*it = var;
+		} else {
+			e->vars.insert(it, var);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+// Builds the block itself, once the variables are all set
+static void env_block_finish(env_block* e) {
+	e->block.clear();
+	for(size_t i=0; i<e->vars.size(); i++)
+		e->block.append(e->vars[i].c_str(), e->vars[i].size() + 1);
+	e->block += '\0';
+	if(e->vars.empty())
+		e->block += '\0'; // (Windows wants two, even when it's empty)
+#ifndef _WIN32
+	e->ptrs.clear();
+	for(size_t i=0, pos=0; i<e->vars.size(); pos += e->vars[i++].size() + 1)
+		e->ptrs.push_back(&e->block[pos]);
+	e->ptrs.push_back(NULL);
+#endif
+}
+
+static int make_env_block_gc(lua_State* L) {
+	delete *(env_block**)lua_touserdata(L, 1);
+	return 0;
+}
+
+static int make_env_block(lua_State* L);
+
+/*SDOC***********************************************************************
+
+	Name:			make_env_block_get
+
+	Action:		Looks up a variable in an environment block.
+
+	Params:		[1] USERDATA - block from make.env_block()
+						[2] string - variable name
+
+	Returns:	[1] string - value
+						 or: nil - if the variable isn't set
+
+***********************************************************************EDOC*/
+static int make_env_block_get(lua_State* L) {
+	env_block* e = *(env_block**)luaL_checkudata(L, 1, "make.env_block");
+	std::string name = luaL_checkstring(L, 2);
+	std::vector<std::string>::iterator it = std::lower_bound(e->vars.begin(), e->vars.end(), name, env_name_less);
+	if(it == e->vars.end() || env_name_compare(*it, name) != 0)
+		return 0;
+	lua_pushstring(L, it->c_str() + name.size() + 1);
+	return 1;
+}
+
+static const luaL_Reg make_env_block_methods[] = {
+	{"get", make_env_block_get},								// block:get
+	{"with", make_env_block},										// block:with (same as make.env_block(block, ...))
+	{"__gc", make_env_block_gc},
+  {NULL, NULL}
+};
+
+// Pushes a new, empty environment block, and returns it
+static env_block* lua_pushenvblock(lua_State* L) {
+	env_block** ud = (env_block**)lua_newuserdata(L, sizeof(env_block*));
+	*ud = NULL;
+	if(luaL_newmetatable(L, "make.env_block")) {
+		luaL_register(L, NULL, make_env_block_methods);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	*ud = new env_block;
+	return *ud;
+}
+
+// Reads the environment argument of make.proc.spawn: an environment block,
+// or a table (which is turned into a block in 'temp'), or nil for none.
+static const env_block* lua_toenvblock(lua_State* L, int idx, env_block& temp) {
+	if(lua_isnoneornil(L, idx))
+		return NULL;
+	if(lua_isuserdata(L, idx))
+		return *(env_block**)luaL_checkudata(L, idx, "make.env_block");
+	luaL_checktype(L, idx, LUA_TTABLE);
+	env_block_apply(L, idx, &temp);
+	env_block_finish(&temp);
+	return &temp;
+}
+
+/*SDOC***********************************************************************
+
+	Name:			make_env_block
+
+	Action:		Builds an environment block, for make.proc.spawn (and 
+						make.run, etc.)
+
+	Params:		[1] table - variables (e.g., make.env, or {PATH="/bin"})
+						 or: USERDATA - another block, to start from
+						[2] table - variables to add to (or change in) [1] (optional);
+									a value of false removes that variable
+
+	Returns:	[1] USERDATA - block, with get(name) and with(overrides) 
+									methods; block:with(t) is make.env_block(block, t)
+
+	Comments:	A table passed to make.proc.spawn is converted every time a
+						process is started; a block is converted once, and then it's
+						used as-is by every process it's given to.  Blocks can't be
+						changed; derive a new one instead.  There's no limit on the
+						size of the environment.
+
+***********************************************************************EDOC*/
+static int make_env_block(lua_State* L) {
+	lua_settop(L, 2);
+	if(lua_isuserdata(L, 1)) {
+		env_block* base = *(env_block**)luaL_checkudata(L, 1, "make.env_block");
+		lua_pushenvblock(L)->vars = base->vars;
+	} else {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		env_block_apply(L, 1, lua_pushenvblock(L));
+	}
+	env_block* e = *(env_block**)lua_touserdata(L, -1);
+	if(!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		env_block_apply(L, 2, e);
+	}
+	env_block_finish(e);
+	return 1;
+}
+
+#ifdef _WIN32
+// Converts a destination path to a native one; "/dev/null" works too
+static std::vector<wchar_t> destination_path(const std::string& path) {
+	const char* in = path == "/dev/null" ? "NUL" : path.c_str();
+	size_t l = strlen(in);
+	std::vector<wchar_t> out(l + 1);
+	_lua_topath(&out[0], in, &l);
+	return out;
+}
+#endif
+
+// Opens the file that gets a copy of a process's output; the handle is
+// never inherited by a child.
+static FILE* open_tee_file(const std::string& path, bool bAppend) {
+#ifdef _WIN32
+	return _wfopen(&destination_path(path)[0], bAppend ? L"abN" : L"wbN");
+#else
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (bAppend ? O_APPEND : O_TRUNC), 0666);
+	FILE* f = fd != -1 ? fdopen(fd, "wb") : NULL;
+	if(fd != -1 && !f)
+		close(fd);
+	return f;
+#endif
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_spawn
+
+	Action:		Spawn a new process
+
+	Params:		[1] string - command line (OS-specific)
+						 or: table - argv array (e.g., {"cc", "-c", "foo.c"})
+						[2] table - environment table (e.g., {v1="value1",v2="value2"})
+						 or: USERDATA - environment block, from make.env_block()
+						 or: nil - to inherit presto's environment
+						[3] table - options (optional):
+									stdin = true				-- give the process a stdin pipe; see
+																				-- make.proc.send()
+									stdout = dest				-- where stdout goes (see below)
+									stderr = dest				-- where stderr goes (see below)
+									framed = true				-- stdout is read with make.proc.receive()
+									group = true				-- start a new process group; see 
+																				-- make.proc.kill()
+									cpus = {n,...}			-- CPUs it may run on (numbered as in
+																				-- make.sys.topology()); see below
+
+	Returns:	[1] table - {data = --[[process USERDATA]]--}
+
+	Comments:	The process will execute in the background.  All output is 
+						buffered, and nothing will be dumped to the screen unless/until
+						make.proc.flushio() is called.
+
+						On POSIX systems, a command line is run by /bin/sh, but an argv
+						array is executed directly (searching the PATH), without 
+						starting a shell.  On Windows, an argv array is quoted into a
+						command line for CreateProcess.
+	
+						If an environment table is specified, it will completely 
+						replace the original environment.  (If you need variables from
+						the original environment, they can be copied from make.env.)
+
+						By default, stdout and stderr are both captured by the output
+						pipe.  Either one can go somewhere else instead:
+									"inherit"						-- presto's own stdout/stderr
+									"path"							-- a file (e.g., "/dev/null")
+									{"path", append=true}
+									{"path", tee=true}	-- stdout only; the file gets a copy
+																				-- of everything on the output pipe
+						A file is given to the process directly, so its output never
+						passes through presto at all.  (stderr can go to the same file
+						as stdout; they share it, like "2>&1".)
+
+						With "cpus", the process (and whatever it starts) is pinned to 
+						those CPUs.  On Windows, it's created suspended and pinned 
+						before it runs; CPUs that don't fit in an affinity mask are
+						ignored.  On Linux, posix_spawn() has no 
+						way to do it, so the child is pinned right after posix_spawnp()
+						returns; it may already have run briefly on any CPU by then.
+						Elsewhere, the option is ignored.
+
+***********************************************************************EDOC*/
+#ifdef _WIN32
+static int make_proc_spawn(lua_State* L) {
+	// retrieve the command-line; an argv table is quoted into one
+	std::string command_lineA;
+	if(lua_istable(L, 1)) {
+		std::vector<std::string> args;
+		lua_getargv(L, 1, args);
+		command_lineA = join_argv(args);
+	} else {
+		command_lineA = luaL_checkstring(L, 1);
+	}
+	size_t l = command_lineA.size();
+	wchar_t* command_line = (wchar_t*)alloca((l+1)*sizeof(wchar_t));
+	l = MultiByteToWideChar(CP_UTF8, 0, command_lineA.c_str(), (int)l+1, command_line, (int)l+1);
+
+	// retrieve the environment
+	env_block temp_env;
+	const env_block* env_vars = lua_toenvblock(L, 2, temp_env);
+	const char* env = env_vars ? env_vars->block.data() : NULL;
+	spawn_options opts;
+	lua_getspawnoptions(L, 3, opts);
+
+	// Create the child output pipe (inheritable)
+	HANDLE hOutputReadTmp, hOutputWrite;
+	SECURITY_ATTRIBUTES sa = { sizeof(sa) };
+	sa.bInheritHandle = TRUE;
+	if(!MyCreatePipeEx(&hOutputReadTmp, &hOutputWrite, &sa, 0, FILE_FLAG_OVERLAPPED, 0)) // TODO: should buffer size be bigger?
+		luaL_error(L, "error creating pipe");
+	// Duplicate the pipe for stderr; this way, if the child 
+	// process closes one of stdout/stderr, the other still works.
+	HANDLE hErrorWrite = GetStdHandle(STD_ERROR_HANDLE);
+  if(opts.stderrDest == DEST_PIPE && !DuplicateHandle(GetCurrentProcess(), hOutputWrite, GetCurrentProcess(), &hErrorWrite, 0, TRUE, DUPLICATE_SAME_ACCESS))
+     luaL_error(L, "error duplicating pipe handle");
+
+	// Open any files the output goes to (inheritable).  The child inherits
+	// the pipe even if it isn't connected to anything, so we still see 
+	// EOF when it exits.
+	HANDLE hStdoutWrite = hOutputWrite;
+	if(opts.stdoutDest == DEST_INHERIT)
+		hStdoutWrite = GetStdHandle(STD_OUTPUT_HANDLE);
+	HANDLE hFiles[2] = { INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE };
+	for(int i=0; i<2; i++) {
+		const std::string& path = i ? opts.stderrPath : opts.stdoutPath;
+		if((i ? opts.stderrDest : opts.stdoutDest) != DEST_FILE)
+			continue;
+		if(i && opts.stdoutDest == DEST_FILE && path == opts.stdoutPath) {
+			hFiles[1] = hFiles[0];
+		} else {
+			bool bAppend = i ? opts.bStderrAppend : opts.bStdoutAppend;
+			hFiles[i] = CreateFileW(&destination_path(path)[0], bAppend ? FILE_APPEND_DATA : GENERIC_WRITE, 
+				FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, bAppend ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if(hFiles[i] == INVALID_HANDLE_VALUE)
+				luaL_error(L, "error opening " LUA_QS " (%d)", path.c_str(), (int)GetLastError());
+		}
+		*(i ? &hErrorWrite : &hStdoutWrite) = hFiles[i];
+	}
+	FILE* tee = NULL;
+	if(opts.bTee && (tee = open_tee_file(opts.stdoutPath, opts.bStdoutAppend)) == NULL)
+		luaL_error(L, "error opening " LUA_QS, opts.stdoutPath.c_str());
+  // Duplicate the output read handle as uninheritable; otherwise
+  // the child inherits it and a non-closeable handle to the pipe
+  // is created.
+	HANDLE hOutputRead;
+  if(!DuplicateHandle(GetCurrentProcess(), hOutputReadTmp, GetCurrentProcess(), &hOutputRead, 0, FALSE, DUPLICATE_SAME_ACCESS))
+    luaL_error(L, "error duplicating pipe handle");
+  // Close the inheritable copy
+  if(!CloseHandle(hOutputReadTmp)) 
+		luaL_error(L, "error closing pipe handle");
+
+	// Create the child input pipe, if requested; same deal, but it's the
+	// write end that we keep (uninheritable)
+	HANDLE hInputRead = INVALID_HANDLE_VALUE, hInputWrite = INVALID_HANDLE_VALUE;
+	if(opts.bStdin) {
+		HANDLE hInputWriteTmp;
+		if(!CreatePipe(&hInputRead, &hInputWriteTmp, &sa, 0))
+			luaL_error(L, "error creating pipe");
+		if(!DuplicateHandle(GetCurrentProcess(), hInputWriteTmp, GetCurrentProcess(), &hInputWrite, 0, FALSE, DUPLICATE_SAME_ACCESS))
+			luaL_error(L, "error duplicating pipe handle");
+		if(!CloseHandle(hInputWriteTmp)) 
+			luaL_error(L, "error closing pipe handle");
+	}
+
+	// Launch the child process
+	STARTUPINFOW si = { sizeof(si) };
+	si.dwFlags = STARTF_USESTDHANDLES;
+	si.hStdInput = hInputRead; // no input, unless requested
+	si.hStdOutput = hStdoutWrite;
+	si.hStdError = hErrorWrite;
+	PROCESS_INFORMATION pi = {};
+	DWORD dwFlags = opts.bGroup ? CREATE_NEW_PROCESS_GROUP | CREATE_SUSPENDED : 0;
+	if(!opts.cpus.empty())
+		dwFlags |= CREATE_SUSPENDED;
+	CreateProcessW(NULL, command_line, NULL, NULL, TRUE, dwFlags, (void*)env, NULL, &si, &pi);
+
+	// Pin it to its CPUs (in our processor group) before it runs
+	if(!opts.cpus.empty() && pi.hProcess) {
+		DWORD_PTR mask = 0;
+		for(size_t i=0; i<opts.cpus.size(); i++) {
+			if(opts.cpus[i] < (int)(8 * sizeof(mask)))
+				mask |= (DWORD_PTR)1 << opts.cpus[i];
+		}
+		if(mask)
+			SetProcessAffinityMask(pi.hProcess, mask);
+	}
+
+	// A "group" goes in a job object before it can start any children, so
+	// that make.proc.kill() can take them all down together
+	HANDLE hJob = NULL;
+	if(opts.bGroup && pi.hProcess) {
+		hJob = CreateJobObject(NULL, NULL);
+		if(hJob && !AssignProcessToJobObject(hJob, pi.hProcess)) {
+			CloseHandle(hJob);
+			hJob = NULL;
+		}
+	}
+	if((dwFlags & CREATE_SUSPENDED) && pi.hThread)
+		ResumeThread(pi.hThread);
+	// Close unnecessary thread handle
+	CloseHandle(pi.hThread);
+
+	// Close the pipe handles; we make sure to not maintain any
+	// handles to the write end of the pipes so that the child
+	// can exit properly.
+	if(!CloseHandle(hOutputWrite) || (opts.stderrDest == DEST_PIPE && !CloseHandle(hErrorWrite))) 
+		luaL_error(L, "error closing pipe handle");
+	if(hFiles[0] != INVALID_HANDLE_VALUE)
+		CloseHandle(hFiles[0]);
+	if(hFiles[1] != INVALID_HANDLE_VALUE && hFiles[1] != hFiles[0])
+		CloseHandle(hFiles[1]);
+	if(hInputRead != INVALID_HANDLE_VALUE)
+		CloseHandle(hInputRead);
+
+	// Create a new USERDATA to hold the process information
+	process* proc = lua_pushprocess(L);
+	proc->hOutputRead = hOutputRead;
+	proc->hInputWrite = hInputWrite;
+	proc->hProcess = pi.hProcess;
+	proc->hJob = hJob;
+	proc->out.bFramed = opts.bFramed;
+	proc->out.tee = tee;
+	proc->olp.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_exitcode
+
+	Action:		Returns the exit code for a process.
+
+	Params:		[1] table - process table from make.proc.spawn()
+
+	Returns:	[1] number - exit code
+						 or: nil - if the process is still running.
+
+***********************************************************************EDOC*/
+static int make_proc_exitcode(lua_State* L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "data");
+	process* p = (process*)lua_touserdata(L,-1);
+	luaL_argcheck(L, p != NULL && lua_objlen(L,-1) == sizeof(process), 1, LUA_QL("process") " expected");
+	if(p->hProcess != INVALID_HANDLE_VALUE)
+		lua_pushnil(L);
+	else
+		lua_pushnumber(L, p->dwExitCode);
+	return 1;
+}
+#endif
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_flushio
+
+	Action:		Handles the output of a running process.
+
+	Params:		[1] table - process table from make.proc.spawn()
+											- "print_lines" or "print" function must be specified
+
+	Comments:	Any output the process has written to it's stdout handle is
+						line-buffered.  The complete lines from each read are passed 
+						to the process table's "print_lines" function as one string,
+						with every line terminated by "\n"; if there is no 
+						"print_lines", they are passed to the user-specified "print"
+						function one at a time (without the "\n").
+
+						CR, LF and CRLF are all treated as line endings.
+
+***********************************************************************EDOC*/
+// Handles 'cbRead' new bytes of output that were read into the buffer
+// just after the pending (incomplete) line.  Line endings are normalized 
+// in place, the complete lines are appended to 'lines', and the 
+// incomplete tail is moved to the front of the buffer.  Because the
+// buffer may be reallocated, this must never be called while a read into
+// it is outstanding.  At EOF, the tail is output as a final line and the
+// buffer is released.  Framed output (see make_proc_receive) is only 
+// accumulated.  Returns false if we run out of memory.
+static bool proc_output_read(proc_output* o, size_t cbRead, bool bEOF, std::string& lines) {
+	if(o->tee) {
+		// the file gets the output exactly as the process wrote it
+		if(cbRead)
+			fwrite(o->buffer + o->cbPending, 1, cbRead, o->tee);
+		if(bEOF) {
+			fclose(o->tee);
+			o->tee = NULL;
+		}
+	}
+	if(o->bFramed) {
+		// Worker output; make.proc.receive() takes the frames apart, so we
+		// just keep it all (and make sure there's room for the next read).
+		o->cbPending += cbRead;
+		if(o->cbBuffer - o->cbPending < PROC_READ_MIN) {
+			char* buffer = (char*)realloc(o->buffer, o->cbBuffer * 2);
+			if(buffer == NULL)
+				return false;
+			o->buffer = buffer;
+			o->cbBuffer *= 2;
+		}
+		return true;
+	}
+
+	size_t cbFree = o->cbBuffer - o->cbPending;
+	char* start = o->buffer + o->cbPending;
+	char* in = start;
+	char* end = start + cbRead;
+
+	// Normalize the line endings; CRLF and CR both become LF
+	if(o->bSkipLF && in != end) {
+		if(*in == '\n')
+			in++;
+		o->bSkipLF = false;
+	}
+	char* out = start;
+	while(in != end) {
+		char* cr = (char*)memchr(in, '\r', end - in);
+		size_t len = (cr ? cr : end) - in;
+		if(out != in)
+			memmove(out, in, len);
+		out += len;
+		if(!cr)
+			break;
+		*out++ = '\n';
+		in = cr + 1;
+		if(in == end)
+			o->bSkipLF = true; // the LF may be in the next read
+		else if(*in == '\n')
+			in++;
+	}
+	end = out;
+
+	// Everything up to the last LF is complete lines; the pending part of
+	// the buffer doesn't have a LF in it, so only the new data is searched.
+	char* last = end;
+	while(last != start && last[-1] != '\n')
+		last--;
+	if(last == start)
+		last = o->buffer;
+	size_t cbLines = last - o->buffer;
+	size_t cbTail = end - last;
+
+	// At EOF, or if a single line is too long to keep buffering, the tail
+	// is output as if it were a complete line.
+	bool bTerminate = cbTail && (bEOF || cbTail + PROC_READ_MIN > PROC_BUFFER_MAX);
+	if(bTerminate) {
+		cbLines += cbTail;
+		cbTail = 0;
+	}
+	if(cbLines) {
+		lines.append(o->buffer, cbLines);
+		if(bTerminate)
+			lines += '\n';
+		memmove(o->buffer, o->buffer + cbLines, cbTail);
+	}
+	o->cbPending = cbTail;
+
+	if(bEOF) {
+		free(o->buffer);
+		o->buffer = NULL;
+		o->cbBuffer = 0;
+	} else if(o->cbBuffer < PROC_BUFFER_MAX && (cbRead == cbFree || o->cbBuffer - o->cbPending < PROC_READ_MIN)) {
+		// The process filled the buffer in one go (or a long line has left 
+		// too little room for the next read); use bigger reads from now on.
+		char* buffer = (char*)realloc(o->buffer, o->cbBuffer * 2);
+		if(buffer == NULL)
+			return false;
+		o->buffer = buffer;
+		o->cbBuffer *= 2;
+	}
+	return true;
+}
+
+// Passes complete lines of output to the process table (at index 1); 
+// "print_lines" gets them all in one call, or "print" one at a time.
+static void deliver_lines(lua_State* L, const char* data, size_t size) {
+	lua_pushlstring(L, data, size);
+	int lines = lua_gettop(L);
+	lua_getfield(L, 1, "print_lines");
+	if(!lua_isnil(L, -1)) {
+		lua_pushvalue(L, lines);
+		lua_call(L, 1, 0);
+	} else {
+		// fall back to calling "print" for each line
+		lua_pop(L, 1);
+		lua_getfield(L, 1, "print");
+		luaL_checktype(L, -1, LUA_TFUNCTION);
+		size_t len;
+		const char* line = lua_tolstring(L, lines, &len);
+		const char* lines_end = line + len;
+		while(line != lines_end) {
+			const char* eol = (const char*)memchr(line, '\n', lines_end - line);
+			lua_pushvalue(L, -1);
+			lua_pushlstring(L, line, eol - line);
+			lua_call(L, 1, 0);
+			line = eol + 1;
+		}
+	}
+	lua_settop(L, lines - 1);
+}
+
+#ifdef _WIN32
+// Collects the resource usage of a finished process
+static double filetime_seconds(const FILETIME& ft) {
+	return (double)((__int64)ft.dwLowDateTime | (((__int64)ft.dwHighDateTime)<<32)) * 1.0e-7;
+}
+
+static void get_process_usage(HANDLE hProcess, proc_usage* usage) {
+	FILETIME ftCreate, ftExit, ftKernel, ftUser;
+	if(GetProcessTimes(hProcess, &ftCreate, &ftExit, &ftKernel, &ftUser)) {
+		usage->user = filetime_seconds(ftUser);
+		usage->system = filetime_seconds(ftKernel);
+		usage->wall = filetime_seconds(ftExit) - filetime_seconds(ftCreate);
+	}
+	PROCESS_MEMORY_COUNTERS pmc = { sizeof(pmc) };
+	if(GetProcessMemoryInfo(hProcess, &pmc, sizeof(pmc)))
+		usage->maxrss = (double)pmc.PeakWorkingSetSize;
+	IO_COUNTERS io;
+	if(GetProcessIoCounters(hProcess, &io)) {
+		usage->read_bytes = (double)io.ReadTransferCount;
+		usage->write_bytes = (double)io.WriteTransferCount;
+	}
+}
+
+// Writes to stdout (1) or stderr (2); the console does its own buffering
+static void output_write(int fd, const char* data, size_t len) {
+	if(fd == 2)
+		fflush(stdout); // keep job output in order
+	fwrite(data, 1, len, fd == 2 ? stderr : stdout);
+}
+
+void make_flush_output() {
+	fflush(stdout);
+}
+
+// Handles 'cbRead' new bytes in the process's output buffer (see 
+// proc_output_read), and passes any complete lines to Lua.
+static void make_proc_flushio_helper(lua_State* L, process* p, size_t cbRead, bool bEOF) {
+	std::string lines;
+	if(!proc_output_read(&p->out, cbRead, bEOF, lines))
+		luaL_error(L, "out of memory");
+	if(!lines.empty())
+		deliver_lines(L, lines.data(), lines.size());
+}
+
+static int make_proc_flushio(lua_State* L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "data");
+	process* p = (process*)lua_touserdata(L,-1);
+	luaL_argcheck(L, p != NULL && lua_objlen(L,-1) == sizeof(process), 1, LUA_QL("process") " expected");
+	if(p->hProcess == INVALID_HANDLE_VALUE)
+		return 0; // process is already done!
+
+	DWORD dwRead;
+	if(p->bWaiting) {
+		if(!GetOverlappedResult(p->hOutputRead, &p->olp, &dwRead, FALSE)) {
+			goto error;
+		} else {
+			// yay! we got data
+			make_proc_flushio_helper(L, p, dwRead, false);
+		}
+		p->bWaiting = false;
+	}
+
+	// try to read some more data
+	while(ReadFile(p->hOutputRead, p->out.buffer + p->out.cbPending, (DWORD)(p->out.cbBuffer - p->out.cbPending), &dwRead, &p->olp)) {
+		// we got data right away
+		make_proc_flushio_helper(L, p, dwRead, false);
+		p->bWaiting = false;
+	}
+
+error:
+	DWORD dwError = GetLastError();
+	switch(dwError) {
+		case ERROR_BROKEN_PIPE:	{
+			// this is the normal exit path; close our handles and exit
+			WaitForSingleObject(p->hProcess, INFINITE); // should already be done
+			GetExitCodeProcess(p->hProcess, &p->dwExitCode);
+			get_process_usage(p->hProcess, &p->usage);
+			CloseHandle(p->hOutputRead);
+			CloseHandle(p->hProcess);
+			CloseHandle(p->olp.hEvent);
+			p->olp.hEvent = NULL;
+			if(p->hJob)
+				CloseHandle(p->hJob);
+			p->hJob = NULL;
+			if(p->hInputWrite != INVALID_HANDLE_VALUE)
+				CloseHandle(p->hInputWrite);
+			p->hInputWrite = INVALID_HANDLE_VALUE;
+			p->hProcess = INVALID_HANDLE_VALUE;
+			p->bWaiting = false;
+			// write any leftover data
+			make_proc_flushio_helper(L, p, 0, true);
+			break;
+		}
+		case ERROR_IO_INCOMPLETE:
+		case ERROR_IO_PENDING: {
+			// This is normal; there currently isn't any data to read, so 
+			// we'll come back and try again later
+			p->bWaiting = true;
+			break;
+		}
+		default: {
+			char str[MAX_PATH];
+			FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM,0,dwError,0,str,sizeof(str),NULL);
+			luaL_error(L, "error reading from pipe: %d, %s", dwError, str);
+			break;
+		}
+	}
+	return 0;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_wait
+
+	Action:		Waits for a change in state in one or more processes.
+
+	Params:		[1] table - array of process tables from make.proc.spawn()
+							 or: table - table with process tables as keys (a set)
+						[2] number - timeout in seconds (optional; default forever)
+
+	Returns:	[1] table - array of the process tables that changed state
+							(empty if the timeout expired)
+
+	Comments:	Will not return until one of the specified processes has either
+						finished, or has written more output to stdout, or until the 
+						timeout expires.
+
+						Only processes in the table are returned; a process that has
+						already finished is returned straight away.
+
+						On POSIX systems, the reactor thread watches every running
+						process, so a wait just collects what it has reported, and
+						there is no 64-handle limit.  What it reports on processes 
+						that aren't in the table is kept for a later wait.
+
+***********************************************************************EDOC*/
+static VOID CALLBACK wait_any_callback(PVOID context, BOOLEAN) {
+	SetEvent((HANDLE)context);
+}
+
+// Waits for any of the handles to be signalled; true unless it timed out.
+// WaitForMultipleObjects() takes at most MAXIMUM_WAIT_OBJECTS (64), so 
+// past that, a thread pool wait on each handle signals one shared event.
+static bool wait_any(const std::vector<HANDLE>& handles, DWORD timeout) {
+	if(handles.size() <= MAXIMUM_WAIT_OBJECTS)
+		return WaitForMultipleObjects((DWORD)handles.size(), &handles[0], FALSE, timeout) != WAIT_TIMEOUT;
+	HANDLE hAny = CreateEvent(NULL, TRUE, FALSE, NULL);
+	std::vector<HANDLE> waits;
+	for(size_t i=0; i<handles.size(); i++) {
+		HANDLE hWait;
+		if(RegisterWaitForSingleObject(&hWait, handles[i], wait_any_callback, hAny, INFINITE, WT_EXECUTEONLYONCE))
+			waits.push_back(hWait);
+	}
+	bool bSignalled = WaitForSingleObject(hAny, timeout) == WAIT_OBJECT_0;
+	for(size_t i=0; i<waits.size(); i++)
+		UnregisterWaitEx(waits[i], INVALID_HANDLE_VALUE); // (waits for a running callback)
+	CloseHandle(hAny);
+	return bSignalled;
+}
+
+static int make_proc_wait(lua_State* L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	// loop over the input table and accumulate handles; we remember which
+	// process each handle belongs to, so we can report it.  A process that
+	// has already finished has no handles left; it's reported straight away.
+	std::vector<HANDLE> handles;
+	std::vector<int> owners, finished;
+	lua_newtable(L);
+	int procs = lua_gettop(L), count = 0;
+	lua_pushnil(L);
+	while(lua_next(L, 1)) {
+		// accept an array of processes, or a set with processes as keys
+		lua_pushvalue(L, lua_type(L, -2) == LUA_TNUMBER ? -1 : -2);
+		process* p = lua_toprocess(L, -1);
+		if(p == NULL)
+			luaL_error(L, LUA_QL("process") " expected");
+		lua_rawseti(L, procs, ++count);
+
+		if(p->hProcess == INVALID_HANDLE_VALUE) {
+			finished.push_back(count);
+		} else {
+			handles.push_back(p->hProcess);
+			owners.push_back(count);
+			if(p->olp.hEvent != NULL) {
+				handles.push_back(p->olp.hEvent);
+				owners.push_back(count);
+			}
+		}
+
+		lua_pop(L,1);
+	}
+
+	lua_newtable(L);
+	if(!finished.empty()) {
+		for(size_t i=0; i<finished.size(); i++) {
+			lua_rawgeti(L, procs, finished[i]);
+			lua_rawseti(L, -2, (int)i + 1);
+		}
+		return 1;
+	}
+
+	// Wait for one of the handles to be signalled
+	DWORD timeout = lua_isnoneornil(L, 2) ? INFINITE : (DWORD)(luaL_checknumber(L, 2) * 1000);
+	if(!handles.empty() && wait_any(handles, timeout)) {
+		// report every process with a signalled handle
+		int ready = 0, last = 0;
+		for(size_t i=0; i<handles.size(); i++) {
+			if(owners[i] != last && WaitForSingleObject(handles[i], 0) == WAIT_OBJECT_0) {
+				last = owners[i];
+				lua_rawgeti(L, procs, owners[i]);
+				lua_rawseti(L, -2, ++ready);
+			}
+		}
+	}
+	return 1;
+}
+#else
+/*SDOC***********************************************************************
+
+	Name:			(POSIX versions of the make.proc functions)
+
+	Action:		Same contract as the Win32 versions above, built on 
+						posix_spawn(), non-blocking pipes and waitpid().
+
+	Comments:	posix_spawn() lets the C library use vfork()/CLONE_VM, so
+						we never pay to copy presto's page tables, no matter how big
+						the Lua heap gets.  All of our descriptors are created 
+						close-on-exec, so a child never inherits the pipes of the
+						other jobs that are running concurrently.
+
+						The pipes are read, and the children reaped, by the reactor
+						thread; it also does all of the writing to stdout and stderr.
+						A slow terminal (or log collector) never holds up the Lua
+						thread, and with it, the scheduling of jobs.
+
+						A child usually closes its pipe just before it can be 
+						reaped; on Linux, a pidfd then tells the reactor when it 
+						has exited, so there's no timer between one job and the 
+						next.
+
+***********************************************************************EDOC*/
+static bool make_pipe(int fds[2]) {
+#if defined(__linux__)
+	return pipe2(fds, O_CLOEXEC) == 0;
+#else
+	if(pipe(fds) != 0)
+		return false;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return true;
+#endif
+}
+
+// Collects the resource usage of a reaped process, from wait4()
+static void get_process_usage(const struct rusage& ru, const struct timespec& start, proc_usage* usage) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usage->user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1.0e-6;
+	usage->system = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1.0e-6;
+	usage->wall = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1.0e-9;
+#ifdef __APPLE__
+	usage->maxrss = (double)ru.ru_maxrss;						// bytes
+#else
+	usage->maxrss = (double)ru.ru_maxrss * 1024.0;	// kilobytes
+#endif
+	usage->read_bytes = (double)ru.ru_inblock * 512.0;
+	usage->write_bytes = (double)ru.ru_oublock * 512.0;
+}
+
+// Launches a child with the given stdin (-1 for /dev/null), stdout and
+// stderr (-1 to inherit ours); returns 0 or an errno value.  The child
+// also keeps 'fdKeep' open (under the same number), if it's given, 
+// leads a new process group if 'bGroup' is set, and only runs on the
+// given CPUs, if there are any.
+static int spawn_process(pid_t* pid, char* const* argv, char* const* env, int fdIn, int fdOut, int fdErr, int fdKeep, bool bGroup, const std::vector<int>& cpus) {
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if(fdIn != -1)
+		posix_spawn_file_actions_adddup2(&actions, fdIn, 0);
+	else
+		posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0); // no input!
+	if(fdOut != -1)
+		posix_spawn_file_actions_adddup2(&actions, fdOut, 1);
+	if(fdErr != -1)
+		posix_spawn_file_actions_adddup2(&actions, fdErr, 2);
+	if(fdKeep != -1)
+		fcntl(fdKeep, F_SETFD, 0); // the caller closes it right after
+
+	// The child starts with an empty signal mask and default handlers, 
+	// regardless of what presto is doing with its own signals.
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t mask;
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &mask);
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	if(bGroup) {
+		posix_spawnattr_setpgroup(&attr, 0);
+		flags |= POSIX_SPAWN_SETPGROUP;
+	}
+#ifdef POSIX_SPAWN_USEVFORK
+	flags |= POSIX_SPAWN_USEVFORK;
+#endif
+	posix_spawnattr_setflags(&attr, flags);
+
+	int error = posix_spawnp(pid, argv[0], &actions, &attr, argv, env);
+#ifdef __linux__
+	// posix_spawn has no affinity attribute, so we pin the child as soon as
+	// it exists (rather than pinning ourselves for it to inherit, which 
+	// would move presto's own thread around).  It has already started, but
+	// only just; in practice, well before it starts any children of its own.
+	if(!error && !cpus.empty()) {
+		cpu_set_t new_cpus;
+		CPU_ZERO(&new_cpus);
+		for(size_t i=0; i<cpus.size(); i++) {
+			if(cpus[i] < CPU_SETSIZE)
+				CPU_SET(cpus[i], &new_cpus);
+		}
+		if(CPU_COUNT(&new_cpus) > 0)
+			sched_setaffinity(*pid, sizeof(new_cpus), &new_cpus);
+	}
+#endif
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	return error;
+}
+
+// The zygote ("-Z"); a small helper process, forked before any makefiles
+// are loaded, that launches and reaps processes on presto's behalf.  We 
+// talk to it over a unix socket; each message is a zygote_header and 
+// its payload, and the pipe ends for a new child travel with the header
+// as SCM_RIGHTS.  Both the Lua thread (spawning) and the reactor thread
+// (reaping) talk to it, one request/reply at a time.
+static int zygote_fd = -1;
+static pthread_mutex_t zygote_lock = PTHREAD_MUTEX_INITIALIZER;
+
+enum { ZYGOTE_SPAWN, ZYGOTE_WAIT, ZYGOTE_INHERIT };
+
+struct zygote_header {
+	uint32_t type;					// ZYGOTE_*
+	uint32_t size;					// bytes of payload that follow
+};
+
+struct zygote_reply {
+	int32_t error;					// errno value, or 0
+	int32_t pid;						// ZYGOTE_SPAWN: the new process; ZYGOTE_WAIT: 0 if still running
+	int32_t status;					// ZYGOTE_WAIT: wait status
+	struct rusage ru;				// ZYGOTE_WAIT: resource usage
+};
+
+// Sends or receives exactly 'size' bytes
+static bool zygote_io(int fd, bool bSend, void* data, size_t size) {
+	char* pos = (char*)data;
+	while(size > 0) {
+		ssize_t n = bSend ? send(fd, pos, size, MSG_NOSIGNAL) : recv(fd, pos, size, 0);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		pos += n;
+		size -= n;
+	}
+	return true;
+}
+
+// Descriptors that go with a ZYGOTE_SPAWN, in this order; the flags say 
+// which ones are there.
+enum { ZYGOTE_STDOUT = 1, ZYGOTE_STDERR = 2, ZYGOTE_STDIN = 4, ZYGOTE_KEEP = 8, ZYGOTE_MAX_FDS = 4 };
+const uint32_t ZYGOTE_GROUP = 16;		// (not a descriptor) the "group" option
+
+// Sends a header (with up to ZYGOTE_MAX_FDS descriptors) and its payload
+static bool zygote_send(int fd, uint32_t type, const std::string& payload, const int* fds, int nfds) {
+	zygote_header h = { type, (uint32_t)payload.size() };
+	struct iovec iov = { &h, sizeof(h) };
+	char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(nfds > 0) {
+		memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	ssize_t n;
+	while((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {}
+	if(n != (ssize_t)sizeof(h))
+		return n >= 0 && zygote_io(fd, true, (char*)&h + n, sizeof(h) - n) && zygote_io(fd, true, (void*)payload.data(), payload.size());
+	return zygote_io(fd, true, (void*)payload.data(), payload.size());
+}
+
+// Receives a header (and any descriptors that came with it) and its payload
+static bool zygote_receive(int fd, zygote_header& h, std::string& payload, int* fds, int& nfds) {
+	struct iovec iov = { &h, sizeof(h) };
+	char control[CMSG_SPACE(ZYGOTE_MAX_FDS * sizeof(int))];
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	ssize_t n;
+	while((n = recvmsg(fd, &msg, 0)) == -1 && errno == EINTR) {}
+	if(n <= 0)
+		return false;
+	nfds = 0;
+	for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			nfds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+			if(nfds > ZYGOTE_MAX_FDS)
+				nfds = ZYGOTE_MAX_FDS; // can't happen; we never send more
+			memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+		}
+	}
+	for(int i=0; i<nfds; i++)
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	if(n < (ssize_t)sizeof(h) && !zygote_io(fd, false, (char*)&h + n, sizeof(h) - n))
+		return false;
+	payload.resize(h.size);
+	return h.size == 0 || zygote_io(fd, false, &payload[0], h.size);
+}
+
+// Splits 'count' NUL-terminated strings off the front of 'data'
+static const char* zygote_strings(const char* data, const char* end, uint32_t count, std::vector<char*>& out) {
+	for(uint32_t i=0; i<count && data < end; i++) {
+		out.push_back((char*)data);
+		data += strlen(data) + 1;
+	}
+	out.push_back(NULL);
+	return data;
+}
+
+// The zygote's main loop; serves requests until presto goes away
+static void zygote_main(int fd) {
+	signal(SIGINT, SIG_IGN); // presto decides what happens on ^C
+	std::string cwd;
+	while(1) {
+		zygote_header h;
+		std::string payload;
+		int fds[ZYGOTE_MAX_FDS], nfds = 0;
+		if(!zygote_receive(fd, h, payload, fds, nfds))
+			_exit(0);
+
+		zygote_reply reply = {};
+		const char* data = payload.data();
+		const char* end = data + payload.size();
+		if(h.type == ZYGOTE_SPAWN && payload.size() >= 4 * sizeof(uint32_t)) {
+			// flags, argc, envc, cpu count, then the cwd, argv and environment
+			// strings, then the cpus
+			uint32_t header[4];
+			memcpy(header, data, sizeof(header));
+			data += sizeof(header);
+			if(cwd != data) {
+				cwd = data;
+				if(chdir(data) != 0)
+					reply.error = errno;
+			}
+			data += strlen(data) + 1;
+			std::vector<char*> argv, env;
+			data = zygote_strings(data, end, header[1], argv);
+			data = zygote_strings(data, end, header[2], env);
+			std::vector<int> cpus;
+			for(uint32_t i=0; i<header[3] && data + sizeof(int32_t) <= end; i++) {
+				int32_t cpu;
+				memcpy(&cpu, data, sizeof(cpu));
+				data += sizeof(cpu);
+				cpus.push_back(cpu);
+			}
+			// hand out the descriptors, in order
+			int spawn_fds[ZYGOTE_MAX_FDS], next = 0;
+			for(int i=0; i<ZYGOTE_MAX_FDS; i++)
+				spawn_fds[i] = (header[0] & (1 << i)) && next < nfds ? fds[next++] : -1;
+			pid_t pid = -1;
+			if(!reply.error)
+				reply.error = spawn_process(&pid, &argv[0], &env[0], spawn_fds[2], spawn_fds[0], spawn_fds[1], spawn_fds[3], (header[0] & ZYGOTE_GROUP) != 0, cpus);
+			reply.pid = pid;
+		} else if(h.type == ZYGOTE_WAIT && payload.size() == sizeof(int32_t)) {
+			int32_t pid;
+			memcpy(&pid, data, sizeof(pid));
+			int status = 0;
+			while((reply.pid = wait4(pid, &status, WNOHANG, &reply.ru)) == -1) {
+				if(errno != EINTR) {
+					reply.error = errno;
+					break;
+				}
+			}
+			reply.status = status;
+		} else if(h.type == ZYGOTE_INHERIT && nfds == 1 && payload.size() == sizeof(int32_t)) {
+			// give the descriptor the same number it has in presto, and let
+			// every child inherit it
+			int32_t target;
+			memcpy(&target, data, sizeof(target));
+			if(target == fd) {
+				fd = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+				close(target);
+			}
+			if(fds[0] == target) {
+				fcntl(target, F_SETFD, 0);
+				nfds = 0;
+			} else {
+				dup2(fds[0], target);
+			}
+			for(int i=0; i<nfds; i++)
+				close(fds[i]);
+			continue; // no reply
+		} else {
+			reply.error = EINVAL;
+		}
+		for(int i=0; i<nfds; i++)
+			close(fds[i]);
+		if(!zygote_io(fd, true, &reply, sizeof(reply)))
+			_exit(0);
+	}
+}
+
+// Asks the zygote to launch a process; same contract as spawn_process()
+static int zygote_spawn(pid_t* pid, char* const* argv, char* const* env, int fdIn, int fdOut, int fdErr, int fdKeep, bool bGroup, const std::vector<int>& cpus) {
+	char cwd[PATH_MAX];
+	if(!getcwd(cwd, sizeof(cwd)))
+		return errno;
+	int fds[ZYGOTE_MAX_FDS], nfds = 0;
+	int spawn_fds[ZYGOTE_MAX_FDS] = { fdOut, fdErr, fdIn, fdKeep };
+	uint32_t header[4] = { bGroup ? ZYGOTE_GROUP : 0, 0, 0, (uint32_t)cpus.size() };
+	for(int i=0; i<ZYGOTE_MAX_FDS; i++) {
+		if(spawn_fds[i] != -1) {
+			header[0] |= 1 << i;
+			fds[nfds++] = spawn_fds[i];
+		}
+	}
+	std::string payload(sizeof(header), '\0');
+	payload.append(cwd, strlen(cwd) + 1);
+	for(; argv[header[1]]; header[1]++)
+		payload.append(argv[header[1]], strlen(argv[header[1]]) + 1);
+	for(; env[header[2]]; header[2]++)
+		payload.append(env[header[2]], strlen(env[header[2]]) + 1);
+	for(size_t i=0; i<cpus.size(); i++) {
+		int32_t cpu = cpus[i];
+		payload.append((const char*)&cpu, sizeof(cpu));
+	}
+	memcpy(&payload[0], header, sizeof(header));
+
+	zygote_reply reply;
+	pthread_mutex_lock(&zygote_lock);
+	bool ok = zygote_send(zygote_fd, ZYGOTE_SPAWN, payload, fds, nfds) &&
+		zygote_io(zygote_fd, false, &reply, sizeof(reply));
+	pthread_mutex_unlock(&zygote_lock);
+	if(!ok)
+		return EPIPE;
+	*pid = reply.pid;
+	return reply.error;
+}
+
+// Asks the zygote to reap a process it launched, if it has exited; 
+// returns 1 if it was reaped, 0 if it's still running, or -1 if we've 
+// lost the zygote.
+static int zygote_wait(pid_t pid, int* status, struct rusage* ru) {
+	int32_t pid32 = pid;
+	zygote_reply reply;
+	pthread_mutex_lock(&zygote_lock);
+	bool ok = zygote_send(zygote_fd, ZYGOTE_WAIT, std::string((char*)&pid32, sizeof(pid32)), NULL, 0) &&
+		zygote_io(zygote_fd, false, &reply, sizeof(reply));
+	pthread_mutex_unlock(&zygote_lock);
+	if(!ok || reply.error)
+		return -1;
+	if(reply.pid == 0)
+		return 0;
+	*status = reply.status;
+	*ru = reply.ru;
+	return 1;
+}
+
+// Gives the zygote (and so every child) a copy of one of our descriptors
+static void zygote_inherit(int fd) {
+	if(zygote_fd == -1)
+		return;
+	int32_t fd32 = fd;
+	pthread_mutex_lock(&zygote_lock);
+	zygote_send(zygote_fd, ZYGOTE_INHERIT, std::string((char*)&fd32, sizeof(fd32)), &fd, 1);
+	pthread_mutex_unlock(&zygote_lock);
+}
+
+// A lock-free queue, for one producer thread and one consumer thread.  
+// It's a linked list with a dummy node at the front, so the two ends 
+// only ever share a node's 'next' pointer.
+template<class T> class spsc_queue {
+	struct node {
+		std::atomic<node*> next;
+		T value;
+	};
+	node* head;							// consumer's end (the dummy)
+	node* tail;							// producer's end
+public:
+	spsc_queue() {
+		head = tail = new node;
+		head->next.store(NULL, std::memory_order_relaxed);
+	}
+	void push(const T& value) {
+		node* n = new node;
+		n->next.store(NULL, std::memory_order_relaxed);
+		n->value = value;
+		tail->next.store(n, std::memory_order_release);
+		tail = n;
+	}
+	bool pop(T& value) {
+		node* next = head->next.load(std::memory_order_acquire);
+		if(next == NULL)
+			return false;
+		value = next->value;
+		delete head;
+		head = next;
+		return true;
+	}
+};
+
+// The reactor's side of a running process; the reactor owns it until it
+// has reaped the process.
+struct proc_stream {
+	unsigned id;						// same as process::id
+	int fd;									// non-blocking read end of the proc's stdout/stderr pipe
+	pid_t pid;							// process id
+	bool bZygote;						// started by the zygote, which has to reap it
+	int pidfd;							// (Linux) tells us when it exits, once its pipe has closed; or -1
+	struct timespec start;	// when the process was started (CLOCK_MONOTONIC)
+	proc_output out;				// output that isn't a complete line yet
+};
+
+// Requests from the Lua thread to the reactor: a new process to watch, or
+// data to write to stdout/stderr.
+struct reactor_command {
+	proc_stream* stream;		// new process, or NULL
+	int fd;									// 1 or 2
+	std::string* data;
+};
+
+// Events from the reactor to the Lua thread
+struct reactor_event {
+	unsigned id;						// which process (see push_running_procs)
+	std::string* data;			// complete lines (or raw frames) of output, or NULL
+	bool bExit;							// the process has been reaped
+	int exitcode;						// exit code (128+N if killed by signal N)
+	proc_usage usage;				// resource usage
+};
+
+// The reactor's state.  Each thread has a "wake" descriptor (an eventfd,
+// or a pipe) that the other thread signals after pushing to its queue.
+// The reactor runs until presto exits.
+static bool reactor_running = false;
+static spsc_queue<reactor_command>* reactor_commands;
+static spsc_queue<reactor_event>* reactor_events;
+static int reactor_wake[2] = { -1, -1 };	// wakes the reactor thread
+static int lua_wake[2] = { -1, -1 };			// wakes the Lua thread
+static std::atomic<size_t> output_pending(0);			// bytes queued for stdout/stderr
+const size_t OUTPUT_PENDING_MAX = 64*1024*1024;		// past this, writers wait for the terminal
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_drained = PTHREAD_COND_INITIALIZER;
+static bool output_waiting = false;								// the Lua thread is waiting on output_drained
+#ifdef __linux__
+static int reactor_epoll = -1;
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434	// (Linux 5.3; older C libraries don't know it)
+#endif
+#endif
+
+static bool wake_create(int fds[2]) {
+#ifdef __linux__
+	fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return fds[0] != -1;
+#else
+	if(!make_pipe(fds))
+		return false;
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	return true;
+#endif
+}
+
+static void wake_signal(int fds[2]) {
+	uint64_t one = 1;
+	if(write(fds[1], &one, sizeof(one)) < 0) {} // if it's full, it's already signalled
+}
+
+static void wake_clear(int fds[2]) {
+	uint64_t count;
+	while(read(fds[0], &count, sizeof(count)) > 0) {}
+}
+
+static bool write_all(int fd, const void* data, size_t len) {
+	const char* pos = (const char*)data;
+	while(len) {
+		ssize_t n = write(fd, pos, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			return false;
+		pos += n;
+		len -= n;
+	}
+	return true;
+}
+
+static void reactor_post(const reactor_event& ev) {
+	reactor_events->push(ev);
+	wake_signal(lua_wake);
+}
+
+// Takes a process's descriptor out of the epoll set, and closes it.  (A
+// child that's being spawned can still have a copy of it, which would 
+// keep it in the set, and its events coming, after we've let it go.)
+static void reactor_close(int fd) {
+#ifdef __linux__
+	epoll_ctl(reactor_epoll, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	close(fd);
+}
+
+// Reaps a process whose pipe has closed; returns false if it hasn't 
+// exited yet (e.g., it handed its stdout to a daemon).
+static bool reactor_reap(proc_stream* s) {
+	int status = 0;
+	struct rusage ru = {};
+	if(!s->bZygote) {
+		pid_t pid;
+		while((pid = wait4(s->pid, &status, WNOHANG, &ru)) == -1 && errno == EINTR) {}
+		if(pid == 0)
+			return false;
+		if(pid == -1)
+			status = 255 << 8; // somebody else reaped it; call it a failure
+	} else {
+		int reaped = zygote_wait(s->pid, &status, &ru);
+		if(reaped == 0)
+			return false;
+		if(reaped == -1)
+			status = 255 << 8; // lost the zygote; call it a failure
+	}
+	reactor_event ev = {};
+	ev.id = s->id;
+	ev.bExit = true;
+	ev.exitcode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	get_process_usage(ru, s->start, &ev.usage);
+	reactor_post(ev);
+	if(s->pidfd != -1)
+		reactor_close(s->pidfd);
+	delete s;
+	return true;
+}
+
+// A process has closed its pipe, but we couldn't reap it yet; usually it
+// just hasn't finished exiting.  On Linux, a pidfd in the epoll set tells
+// us when it has; returns false if we have to check on it instead (no
+// pidfd_open(), or its pidfd went off and it still couldn't be reaped).
+static bool reactor_watch_exit(proc_stream* s) {
+#ifdef __linux__
+	if(s->pidfd != -1) {
+		reactor_close(s->pidfd);
+		s->pidfd = -1;
+		return false;
+	}
+	s->pidfd = (int)syscall(SYS_pidfd_open, s->pid, 0);
+	if(s->pidfd == -1)
+		return false;
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	if(epoll_ctl(reactor_epoll, EPOLL_CTL_ADD, s->pidfd, &ev) == 0)
+		return true;
+	close(s->pidfd);
+	s->pidfd = -1;
+#endif
+	return false;
+}
+
+// Reads a process's pipe until it's empty, and posts what it read; 
+// returns false once the pipe has been closed (at EOF).
+static bool reactor_read(proc_stream* s) {
+	proc_output* o = &s->out;
+	std::string* data = new std::string;
+	bool bOpen = true;
+	while(1) {
+		ssize_t n = read(s->fd, o->buffer + o->cbPending, o->cbBuffer - o->cbPending);
+		if(n > 0) {
+			if(!o->bFramed) {
+				if(!proc_output_read(o, (size_t)n, false, *data))
+					n = 0; // out of memory; treat it as EOF
+			} else {
+				// make.proc.receive() takes the frames apart on the Lua thread
+				if(o->tee)
+					fwrite(o->buffer, 1, n, o->tee);
+				data->append(o->buffer, n);
+			}
+		}
+		if(n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			// this is the normal exit path; flush the last line
+			proc_output_read(o, 0, true, *data);
+			free(o->buffer);
+			o->buffer = NULL;
+			reactor_close(s->fd);
+			bOpen = false;
+			break;
+		}
+		if(n < 0 && errno != EINTR)
+			break; // we've emptied the pipe
+	}
+	if(!data->empty()) {
+		reactor_event ev = {};
+		ev.id = s->id;
+		ev.data = data;
+		reactor_post(ev);
+	} else {
+		delete data;
+	}
+	return bOpen;
+}
+
+// Output waiting to be written to stdout/stderr, in order.  Pipes, 
+// sockets and terminals may not be ready for it; we only write to those
+// when poll() says there's room, and then no more than PIPE_BUF at once,
+// so that a stalled reader can't block the reactor.
+struct reactor_output {
+	std::deque<reactor_command> queue;
+	size_t offset;					// bytes of the first command already written
+	bool bMayBlock[3];			// per descriptor (1 and 2)
+	bool bWatched[3];				// registered with epoll
+};
+
+// Takes written bytes off output_pending, and wakes the Lua thread if it's
+// waiting for them (see output_write and make_flush_output).
+static void output_written(size_t n) {
+	pthread_mutex_lock(&output_lock);
+	output_pending -= n;
+	if(output_waiting)
+		pthread_cond_signal(&output_drained);
+	pthread_mutex_unlock(&output_lock);
+}
+
+// Writes as much of the queued output as we can without blocking; 
+// returns the descriptor we're waiting on, or -1 if the queue is empty.
+static int reactor_write(reactor_output* out) {
+	while(!out->queue.empty()) {
+		reactor_command& cmd = out->queue.front();
+		const char* data = cmd.data->data() + out->offset;
+		size_t len = cmd.data->size() - out->offset;
+		if(out->bMayBlock[cmd.fd]) {
+			pollfd pfd = { cmd.fd, POLLOUT, 0 };
+			if(poll(&pfd, 1, 0) == 0)
+				return cmd.fd;
+			if(len > PIPE_BUF)
+				len = PIPE_BUF;
+		}
+		ssize_t n = write(cmd.fd, data, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// someone made it non-blocking, and there's less room than poll() 
+			// promised; wait for POLLOUT rather than spinning
+			out->bMayBlock[cmd.fd] = true;
+			return cmd.fd;
+		}
+		if(n <= 0)
+			n = cmd.data->size() - out->offset; // (e.g., a closed pipe) nowhere for it to go
+		out->offset += n;
+		output_written(n);
+		if(out->offset == cmd.data->size()) {
+			delete cmd.data;
+			out->queue.pop_front();
+			out->offset = 0;
+		}
+	}
+	return -1;
+}
+
+// The reactor thread
+static void* reactor_main(void*) {
+	std::vector<proc_stream*> reaping;	// pipe closed, but the process hasn't exited
+	reactor_output out;
+	out.offset = 0;
+	for(int fd=1; fd<=2; fd++) {
+		struct stat st;
+		out.bMayBlock[fd] = fstat(fd, &st) == 0 && !S_ISREG(st.st_mode);
+		out.bWatched[fd] = false;
+	}
+	int blocked = -1;			// descriptor the output is waiting on
+#ifndef __linux__
+	std::vector<proc_stream*> streams;	// pipes we're reading
+	std::vector<pollfd> fds;
+#endif
+	while(1) {
+		// Wait for output or a request; while any process has closed its 
+		// pipe without exiting (and we have no pidfd for it), we check on 
+		// it every 10ms.
+		int timeout = reaping.empty() ? -1 : 10;
+#ifdef __linux__
+		if(blocked != -1) {
+			epoll_event ev = {};
+			ev.events = EPOLLOUT | EPOLLONESHOT;
+			ev.data.ptr = &out;
+			epoll_ctl(reactor_epoll, out.bWatched[blocked] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, blocked, &ev);
+			out.bWatched[blocked] = true;
+		}
+		epoll_event events[256];
+		int n = epoll_wait(reactor_epoll, events, sizeof(events)/sizeof(events[0]), timeout);
+		for(int i=0; i<n; i++) {
+			proc_stream* s = (proc_stream*)events[i].data.ptr;
+			if(s == NULL || s == (void*)&out || (s->pidfd == -1 && reactor_read(s)))
+				continue;
+			if(!reactor_reap(s) && !reactor_watch_exit(s))
+				reaping.push_back(s);
+		}
+#else
+		fds.resize(streams.size() + 2);
+		fds[0].fd = reactor_wake[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = blocked;		// (ignored if it's -1)
+		fds[1].events = POLLOUT;
+		for(size_t i=0; i<streams.size(); i++) {
+			fds[i+2].fd = streams[i]->fd;
+			fds[i+2].events = POLLIN;
+		}
+		if(poll(&fds[0], fds.size(), timeout) > 0) {
+			size_t kept = 0;
+			for(size_t i=0; i<streams.size(); i++) {
+				proc_stream* s = streams[i];
+				if(!fds[i+2].revents || reactor_read(s))
+					streams[kept++] = s;
+				else if(!reactor_reap(s))
+					reaping.push_back(s);
+			}
+			streams.resize(kept);
+		}
+#endif
+
+		// Handle the Lua thread's requests
+		wake_clear(reactor_wake);
+		reactor_command cmd;
+		while(reactor_commands->pop(cmd)) {
+			if(cmd.stream) {
+#ifdef __linux__
+				// edge-triggered; reactor_read() always empties the pipe
+				epoll_event ev = {};
+				ev.events = EPOLLIN | EPOLLET;
+				ev.data.ptr = cmd.stream;
+				epoll_ctl(reactor_epoll, EPOLL_CTL_ADD, cmd.stream->fd, &ev);
+#else
+				streams.push_back(cmd.stream);
+#endif
+			} else {
+				out.queue.push_back(cmd);
+			}
+		}
+		blocked = reactor_write(&out);
+
+		// Check on the processes that closed their pipes early
+		size_t kept = 0;
+		for(size_t i=0; i<reaping.size(); i++) {
+			if(!reactor_reap(reaping[i]))
+				reaping[kept++] = reaping[i];
+		}
+		reaping.resize(kept);
+	}
+	return NULL;
+}
+
+// Starts the reactor thread; this happens when the first process is 
+// spawned.
+static bool reactor_start() {
+	if(reactor_running)
+		return true;
+	if(!wake_create(reactor_wake) || !wake_create(lua_wake))
+		return false;
+#ifdef __linux__
+	reactor_epoll = epoll_create1(EPOLL_CLOEXEC);
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if(reactor_epoll == -1 || epoll_ctl(reactor_epoll, EPOLL_CTL_ADD, reactor_wake[0], &ev) != 0)
+		return false;
+#endif
+	reactor_commands = new spsc_queue<reactor_command>;
+	reactor_events = new spsc_queue<reactor_event>;
+
+	// Signals (^C, SIGPIPE...) are left to the Lua thread
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_t thread;
+	int error = pthread_create(&thread, NULL, reactor_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(error) {
+		errno = error;
+		return false;
+	}
+	pthread_detach(thread);
+	reactor_running = true;
+	atexit(make_flush_output);
+	return true;
+}
+
+// Writes to stdout (1) or stderr (2).  Once the reactor is running, it
+// does the writing, in order; we only wait if it's *very* far behind 
+// (e.g., the terminal has been paused with ^S).
+static void output_write(int fd, const char* data, size_t len) {
+	if(!reactor_running) {
+		fflush(stdout);
+		write_all(fd, data, len);
+		return;
+	}
+	if(output_pending > OUTPUT_PENDING_MAX) {
+		pthread_mutex_lock(&output_lock);
+		output_waiting = true;
+		while(output_pending > OUTPUT_PENDING_MAX)
+			pthread_cond_wait(&output_drained, &output_lock);
+		output_waiting = false;
+		pthread_mutex_unlock(&output_lock);
+	}
+	reactor_command cmd = { NULL, fd, new std::string(data, len) };
+	output_pending += len;
+	reactor_commands->push(cmd);
+	wake_signal(reactor_wake);
+}
+
+// Waits until everything that's been written has gone out
+void make_flush_output() {
+	if(output_pending > 0) {
+		pthread_mutex_lock(&output_lock);
+		output_waiting = true;
+		while(output_pending > 0)
+			pthread_cond_wait(&output_drained, &output_lock);
+		output_waiting = false;
+		pthread_mutex_unlock(&output_lock);
+	}
+	fflush(stdout);
+}
+
+// Pushes the registry table of processes that the reactor has reported
+// on, and that no make.proc.wait() has returned yet (id -> process table).
+static void push_ready_procs(lua_State* L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, "make.proc.ready");
+	if(lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "make.proc.ready");
+	}
+}
+
+// Pushes the registry table that maps each running process's id to its
+// process table; this is how the reactor's events find their process.
+static void push_running_procs(lua_State* L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, "make.proc.running");
+	if(lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, "make.proc.running");
+	}
+}
+
+// Takes the reactor's events, and files them with their processes
+static void reactor_drain(lua_State* L) {
+	wake_clear(lua_wake);
+	push_running_procs(L);
+	push_ready_procs(L);
+	reactor_event ev;
+	while(reactor_events->pop(ev)) {
+		lua_rawgeti(L, -2, ev.id);
+		process* p = lua_toprocess(L, -1);
+		if(p == NULL) {
+			lua_pop(L, 1);
+			delete ev.data;
+			continue;
+		}
+		if(ev.data) {
+			if(p->received == NULL) {
+				p->received = ev.data;
+			} else {
+				p->received->append(*ev.data);
+				delete ev.data;
+			}
+		}
+		if(ev.bExit) {
+			p->bReaped = true;
+			p->exitcode = ev.exitcode;
+			p->usage = ev.usage;
+		}
+		lua_rawseti(L, -2, ev.id);
+	}
+	lua_pop(L, 2);
+}
+
+// Appends raw output to the buffer (for make.proc.receive)
+static bool proc_output_append(proc_output* o, const char* data, size_t len) {
+	if(o->cbBuffer - o->cbPending < len) {
+		size_t cbBuffer = o->cbBuffer * 2;
+		if(cbBuffer < o->cbPending + len)
+			cbBuffer = o->cbPending + len;
+		char* buffer = (char*)realloc(o->buffer, cbBuffer);
+		if(buffer == NULL)
+			return false;
+		o->buffer = buffer;
+		o->cbBuffer = cbBuffer;
+	}
+	memcpy(o->buffer + o->cbPending, data, len);
+	o->cbPending += len;
+	return true;
+}
+
+static int make_proc_spawn(lua_State* L) {
+	// retrieve the command-line; a string is run by the shell, but an
+	// argv table is exec'd directly
+	std::vector<std::string> args;
+	if(lua_istable(L, 1)) {
+		lua_getargv(L, 1, args);
+	} else {
+		args.push_back("/bin/sh");
+		args.push_back("-c");
+		args.push_back(luaL_checkstring(L, 1));
+	}
+	std::vector<char*> argv;
+	for(size_t i=0; i<args.size(); i++)
+		argv.push_back(&args[i][0]);
+	argv.push_back(NULL);
+
+	// retrieve the environment
+	env_block temp_env;
+	const env_block* env_vars = lua_toenvblock(L, 2, temp_env);
+	char* const* env = env_vars ? &env_vars->ptrs[0] : environ;
+
+	spawn_options opts;
+	lua_getspawnoptions(L, 3, opts);
+	if(!reactor_start())
+		luaL_error(L, "error starting reactor thread: %s", strerror(errno));
+
+	// Create the child output pipe; the read end is non-blocking, and 
+	// the child gets the write end as both stdout and stderr.
+	int fds[2];
+	if(!make_pipe(fds))
+		luaL_error(L, "error creating pipe");
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+	// Create the child input pipe, if requested; we keep the write end
+	int in_fds[2] = { -1, -1 };
+	if(opts.bStdin && !make_pipe(in_fds)) {
+		close(fds[0]);
+		close(fds[1]);
+		luaL_error(L, "error creating pipe");
+	}
+
+	// Open any files the output goes to.  If neither stream is left on the
+	// pipe, the child keeps it open anyway, so we still see EOF when it exits.
+	int out_fd = opts.stdoutDest == DEST_PIPE ? fds[1] : -1;
+	int err_fd = opts.stderrDest == DEST_PIPE ? fds[1] : -1;
+	std::string error_path;
+	int open_error = 0;
+	if(opts.stdoutDest == DEST_FILE) {
+		out_fd = open(opts.stdoutPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (opts.bStdoutAppend ? O_APPEND : O_TRUNC), 0666);
+		if(out_fd == -1) {
+			error_path = opts.stdoutPath;
+			open_error = errno;
+		}
+	}
+	if(opts.stderrDest == DEST_FILE && opts.stdoutDest == DEST_FILE && opts.stderrPath == opts.stdoutPath) {
+		err_fd = out_fd; // like "2>&1"
+	} else if(opts.stderrDest == DEST_FILE) {
+		err_fd = open(opts.stderrPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (opts.bStderrAppend ? O_APPEND : O_TRUNC), 0666);
+		if(err_fd == -1 && error_path.empty()) {
+			error_path = opts.stderrPath;
+			open_error = errno;
+		}
+	}
+	FILE* tee = NULL;
+	if(opts.bTee && error_path.empty() && (tee = open_tee_file(opts.stdoutPath, opts.bStdoutAppend)) == NULL) {
+		error_path = opts.stdoutPath;
+		open_error = errno;
+	}
+	int keep_fd = out_fd != fds[1] && err_fd != fds[1] ? fds[1] : -1;
+
+	// Launch the child process (or have the zygote do it)
+	pid_t pid;
+	int error = 0;
+	if(error_path.empty())
+		error = (zygote_fd != -1 ? zygote_spawn : spawn_process)(&pid, &argv[0], env, in_fds[0], out_fd, err_fd, keep_fd, opts.bGroup, opts.cpus);
+	if(out_fd != -1 && out_fd != fds[1])
+		close(out_fd);
+	if(err_fd != -1 && err_fd != fds[1] && err_fd != out_fd)
+		close(err_fd);
+
+	// Close the write end of the pipe; we make sure to not maintain
+	// any handles to it so that we see EOF when the child exits.
+	close(fds[1]);
+	if(in_fds[0] != -1)
+		close(in_fds[0]);
+	if(error || !error_path.empty()) {
+		close(fds[0]);
+		if(in_fds[1] != -1)
+			close(in_fds[1]);
+		if(tee)
+			fclose(tee);
+		if(!error_path.empty())
+			luaL_error(L, "error opening " LUA_QS ": %s", error_path.c_str(), strerror(open_error));
+		luaL_error(L, "error spawning " LUA_QS ": %s", argv[0], strerror(error));
+	}
+
+	// Hand the pipe over to the reactor
+	static unsigned next_id = 0;
+	proc_stream* stream = new proc_stream();
+	stream->id = ++next_id;
+	stream->fd = fds[0];
+	stream->pid = pid;
+	stream->bZygote = zygote_fd != -1;
+	stream->pidfd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &stream->start);
+	stream->out.buffer = (char*)malloc(PROC_BUFFER_MIN);
+	stream->out.cbBuffer = PROC_BUFFER_MIN;
+	stream->out.bFramed = opts.bFramed;
+	stream->out.tee = tee;
+
+	// Create a new USERDATA to hold the process information
+	process* proc = lua_pushprocess(L);
+	proc->pid = pid;
+	proc->id = stream->id;
+	proc->fdInputWrite = in_fds[1];
+	proc->bGroup = opts.bGroup;
+	proc->out.bFramed = opts.bFramed;
+
+	// remember which process is which, and start reading
+	push_running_procs(L);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, proc->id);
+	lua_pop(L, 1);
+	reactor_command cmd = { stream, -1, NULL };
+	reactor_commands->push(cmd);
+	wake_signal(reactor_wake);
+	return 1;
+}
+
+static int make_proc_exitcode(lua_State* L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "data");
+	process* p = (process*)lua_touserdata(L,-1);
+	luaL_argcheck(L, p != NULL && lua_objlen(L,-1) == sizeof(process), 1, LUA_QL("process") " expected");
+	if(p->pid != -1)
+		lua_pushnil(L);
+	else
+		lua_pushnumber(L, p->exitcode);
+	return 1;
+}
+
+static int make_proc_flushio(lua_State* L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "data");
+	process* p = (process*)lua_touserdata(L,-1);
+	luaL_argcheck(L, p != NULL && lua_objlen(L,-1) == sizeof(process), 1, LUA_QL("process") " expected");
+	if(p->pid == -1)
+		return 0; // process is already done!
+	reactor_drain(L);
+
+	// deliver whatever the reactor has read
+	if(p->received) {
+		std::string data;
+		data.swap(*p->received);
+		delete p->received;
+		p->received = NULL;
+		if(p->out.bFramed) {
+			if(!proc_output_append(&p->out, data.data(), data.size()))
+				luaL_error(L, "out of memory");
+		} else {
+			deliver_lines(L, data.data(), data.size());
+		}
+	}
+
+	// and, once it's been reaped, finish up
+	if(p->bReaped) {
+		push_running_procs(L);
+		push_ready_procs(L);
+		lua_pushnil(L);
+		lua_rawseti(L, -2, p->id);
+		lua_pushnil(L);
+		lua_rawseti(L, -3, p->id);
+		lua_pop(L, 2);
+		if(p->fdInputWrite != -1)
+			close(p->fdInputWrite);
+		p->fdInputWrite = -1;
+		p->pid = -1;
+	}
+	return 0;
+}
+
+// Moves the processes in the table at idx (an array, or a set) that the
+// reactor has reported on, or that have already finished, out of the
+// ready set; pushes an array of them, and returns how many there are.
+// Any other process that's ready stays there for a later wait.
+static int take_ready_procs(lua_State* L, int idx) {
+	push_ready_procs(L);
+	int ready = lua_gettop(L);
+	lua_newtable(L);
+	int count = 0;
+	lua_pushnil(L);
+	while(lua_next(L, idx)) {
+		// accept an array of processes, or a set with processes as keys
+		lua_pushvalue(L, lua_type(L, -2) == LUA_TNUMBER ? -1 : -2);
+		process* p = lua_toprocess(L, -1);
+		if(p == NULL)
+			luaL_error(L, LUA_QL("process") " expected");
+		lua_rawgeti(L, ready, p->id);
+		bool bReady = !lua_isnil(L, -1) || p->pid == -1;
+		lua_pop(L, 1);
+		if(bReady) {
+			lua_pushnil(L);
+			lua_rawseti(L, ready, p->id);
+			lua_rawseti(L, ready + 1, ++count);
+		} else {
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_remove(L, ready);
+	return count;
+}
+
+static int make_proc_wait(lua_State* L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	double timeout = luaL_optnumber(L, 2, -1);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// Report what the reactor has already told us about; if that's nothing,
+	// wait for it to tell us more (events for processes that aren't in the
+	// table wake us up too, and are kept for later).  If we are interrupted
+	// by a signal, we return and let Lua deal with it.
+	while(true) {
+		if(reactor_running)
+			reactor_drain(L);
+		if(take_ready_procs(L, 1) > 0 || !reactor_running)
+			return 1;
+		lua_pop(L, 1);
+
+		int timeout_ms = -1;
+		if(timeout >= 0) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			double remaining = timeout - ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1.0e-9);
+			timeout_ms = remaining <= 0 ? 0 : (int)(remaining * 1000 + 0.999);
+		}
+		pollfd pfd = { lua_wake[0], POLLIN, 0 };
+		if(poll(&pfd, 1, timeout_ms) <= 0) {
+			lua_newtable(L);
+			return 1;
+		}
+	}
+}
+#endif
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_usage
+
+	Action:		Returns the resources used by a finished process.
+
+	Params:		[1] table - process table from make.proc.spawn()
+
+	Returns:	[1] table - {user, system, wall, maxrss, read_bytes, write_bytes}
+						 or: nil - if the process is still running.
+
+	Comments:	CPU and wall-clock times are in seconds, and the rest are in
+						bytes.  On POSIX systems they come from wait4(); on Windows
+						from GetProcessTimes(), GetProcessMemoryInfo() and 
+						GetProcessIoCounters().
+
+***********************************************************************EDOC*/
+static int make_proc_usage(lua_State* L) {
+	process* p = lua_toprocess(L, 1);
+	luaL_argcheck(L, p != NULL, 1, LUA_QL("process") " expected");
+#ifdef _WIN32
+	if(p->hProcess != INVALID_HANDLE_VALUE)
+		return 0;
+#else
+	if(p->pid != -1)
+		return 0;
+#endif
+	lua_createtable(L, 0, 6);
+	lua_pushnumber(L, p->usage.user);					lua_setfield(L, -2, "user");
+	lua_pushnumber(L, p->usage.system);				lua_setfield(L, -2, "system");
+	lua_pushnumber(L, p->usage.wall);					lua_setfield(L, -2, "wall");
+	lua_pushnumber(L, p->usage.maxrss);				lua_setfield(L, -2, "maxrss");
+	lua_pushnumber(L, p->usage.read_bytes);		lua_setfield(L, -2, "read_bytes");
+	lua_pushnumber(L, p->usage.write_bytes);	lua_setfield(L, -2, "write_bytes");
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_kill
+
+	Action:		Signals a running process (and, with the "group" option, all
+						of the processes it has started).
+
+	Params:		[1] table - process table from make.proc.spawn()
+						[2] string - "TERM" (default), "KILL" or "INT"
+
+	Returns:	[1] boolean - true if the process was signalled
+							 or: nil, string - if it couldn't be (e.g., it has exited)
+
+	Comments:	The process still has to be waited for, as usual; its exit code
+						will be 128+N on POSIX systems (if it doesn't catch the signal).
+
+						On Windows, "TERM" and "INT" send a CTRL_BREAK_EVENT to a 
+						process group, and anything else is TerminateProcess (or 
+						TerminateJobObject, for a group).
+
+***********************************************************************EDOC*/
+static int make_proc_kill(lua_State* L) {
+	process* p = lua_toprocess(L, 1);
+	luaL_argcheck(L, p != NULL, 1, LUA_QL("process") " expected");
+	static const char* const names[] = { "TERM", "KILL", "INT", NULL };
+	int which = luaL_checkoption(L, 2, "TERM", names);
+#ifdef _WIN32
+	BOOL ok = FALSE;
+	if(p->hProcess != INVALID_HANDLE_VALUE) {
+		if(which != 1 && p->hJob)
+			ok = GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, GetProcessId(p->hProcess));
+		else if(p->hJob)
+			ok = TerminateJobObject(p->hJob, 1);
+		else
+			ok = TerminateProcess(p->hProcess, 1);
+	}
+	if(!ok) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "process has exited");
+		return 2;
+	}
+#else
+	if(reactor_running)
+		reactor_drain(L);
+	if(p->pid == -1 || (p->bReaped && !p->bGroup)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "process has exited");
+		return 2;
+	}
+	static const int signals[] = { SIGTERM, SIGKILL, SIGINT };
+	if(kill(p->bGroup ? -p->pid : p->pid, signals[which]) != 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+#endif
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_send
+
+	Action:		Sends a request to a worker process.
+
+	Params:		[1] table - process table from make.proc.spawn() ("stdin" option)
+						[2] string - request (optional)
+
+	Returns:	[1] boolean - true if the request was sent
+							 or: nil, string - if it couldn't be (e.g., the process died)
+
+	Comments:	The request is written to the process's stdin as one frame: a
+						4-byte big-endian length, followed by the data.  The write blocks
+						until the whole frame is in the pipe.  If no request is given,
+						the process's stdin is closed instead; that's how a worker is 
+						told to exit.
+
+***********************************************************************EDOC*/
+#ifdef _WIN32
+static bool write_all(HANDLE h, const void* data, size_t len) {
+	const char* pos = (const char*)data;
+	while(len) {
+		DWORD dwWritten;
+		if(!WriteFile(h, pos, (DWORD)len, &dwWritten, NULL))
+			return false;
+		pos += dwWritten;
+		len -= dwWritten;
+	}
+	return true;
+}
+
+static int make_proc_send(lua_State* L) {
+	size_t len = 0;
+	const char* data = luaL_optlstring(L, 2, NULL, &len);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "data");
+	process* p = (process*)lua_touserdata(L,-1);
+	luaL_argcheck(L, p != NULL && lua_objlen(L,-1) == sizeof(process), 1, LUA_QL("process") " expected");
+	if(p->hInputWrite == INVALID_HANDLE_VALUE) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "process has no stdin");
+		return 2;
+	}
+	if(data == NULL) {
+		CloseHandle(p->hInputWrite);
+		p->hInputWrite = INVALID_HANDLE_VALUE;
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	unsigned char header[4] = { (unsigned char)(len >> 24), (unsigned char)(len >> 16), (unsigned char)(len >> 8), (unsigned char)len };
+	if(!write_all(p->hInputWrite, header, sizeof(header)) || !write_all(p->hInputWrite, data, len)) {
+		char str[MAX_PATH];
+		FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM,0,GetLastError(),0,str,sizeof(str),NULL);
+		lua_pushnil(L);
+		lua_pushstring(L, str);
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+#else
+static int make_proc_send(lua_State* L) {
+	size_t len = 0;
+	const char* data = luaL_optlstring(L, 2, NULL, &len);
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "data");
+	process* p = (process*)lua_touserdata(L,-1);
+	luaL_argcheck(L, p != NULL && lua_objlen(L,-1) == sizeof(process), 1, LUA_QL("process") " expected");
+	if(p->fdInputWrite == -1) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "process has no stdin");
+		return 2;
+	}
+	if(data == NULL) {
+		close(p->fdInputWrite);
+		p->fdInputWrite = -1;
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	// Writing to a worker that has died raises SIGPIPE; block it while we 
+	// write (and discard it if it's raised), so that we just get EPIPE.
+	sigset_t pipe_mask, old_mask;
+	sigemptyset(&pipe_mask);
+	sigaddset(&pipe_mask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_mask, &old_mask);
+	unsigned char header[4] = { (unsigned char)(len >> 24), (unsigned char)(len >> 16), (unsigned char)(len >> 8), (unsigned char)len };
+	bool ok = write_all(p->fdInputWrite, header, sizeof(header)) && write_all(p->fdInputWrite, data, len);
+	int error = errno;
+	if(!ok && error == EPIPE) {
+		sigset_t pending;
+		sigpending(&pending);
+		int sig;
+		if(sigismember(&pending, SIGPIPE))
+			sigwait(&pipe_mask, &sig);
+	}
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if(!ok) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(error));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+#endif
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_receive
+
+	Action:		Receives a response from a worker process.
+
+	Params:		[1] table - process table from make.proc.spawn() ("framed" option)
+
+	Returns:	[1] string - the next response
+							 or: nil - if there isn't a complete one yet
+
+	Comments:	Reads whatever the process has written so far (like 
+						make.proc.flushio), and returns the next frame: a 4-byte
+						big-endian length, followed by the data.  If nil is returned
+						and make.proc.exit_code() is still nil, yield the process and
+						try again.
+
+***********************************************************************EDOC*/
+static int make_proc_receive(lua_State* L) {
+	lua_settop(L, 1);
+	process* p = lua_toprocess(L, 1);
+	luaL_argcheck(L, p != NULL, 1, LUA_QL("process") " expected");
+	luaL_argcheck(L, p->out.bFramed, 1, "process output isn't framed");
+	make_proc_flushio(L);
+	lua_settop(L, 1);
+
+	proc_output* o = &p->out;
+	if(o->cbPending >= 4) {
+		const unsigned char* header = (const unsigned char*)o->buffer;
+		size_t len = ((size_t)header[0] << 24) | ((size_t)header[1] << 16) | ((size_t)header[2] << 8) | header[3];
+		if(o->cbPending - 4 >= len) {
+			lua_pushlstring(L, o->buffer + 4, len);
+			o->cbPending -= 4 + len;
+			memmove(o->buffer, o->buffer + 4 + len, o->cbPending);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_command_line
+
+	Action:		Converts an argv array into a command line, quoting the 
+						arguments as necessary.
+
+	Params:		[1] table - argv array (e.g., {"cc", "-c", "foo.c"})
+						 or: string - command line (returned as-is)
+
+	Returns:	[1] string - command line
+
+	Comments:	Used to display argv commands; the quoting matches the native
+						shell (/bin/sh or CreateProcess), so the result can be pasted
+						into a terminal.
+
+***********************************************************************EDOC*/
+static int make_proc_command_line(lua_State* L) {
+	if(!lua_istable(L, 1)) {
+		luaL_checkstring(L, 1);
+		lua_settop(L, 1);
+		return 1;
+	}
+	std::vector<std::string> args;
+	lua_getargv(L, 1, args);
+	std::string command_line = join_argv(args);
+	lua_pushlstring(L, command_line.data(), command_line.size());
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_zygote_start
+
+	Action:		Forks the zygote (see make_proc_zygote), if it isn't running.
+						make.cpp calls this for "-Z" before the Lua state is even 
+						populated, so the zygote is as small as presto ever gets.
+
+	Returns:	true - if the zygote is running (or isn't needed; Windows)
+						false - on error (see errno)
+
+***********************************************************************EDOC*/
+bool make_zygote_start() {
+#ifndef _WIN32
+	if(zygote_fd == -1) {
+		int sv[2];
+#ifdef __linux__
+		if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+#else
+		if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+#endif
+			return false;
+		fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+		fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+		pid_t pid = fork();
+		if(pid == -1) {
+			int error = errno;
+			close(sv[0]);
+			close(sv[1]);
+			errno = error;
+			return false;
+		}
+		if(pid == 0) {
+			close(sv[0]);
+			zygote_main(sv[1]); // never returns
+		}
+		close(sv[1]);
+		zygote_fd = sv[0];
+	}
+#endif
+	return true;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_proc_zygote
+
+	Action:		Starts the zygote; a helper process that launches (and reaps)
+						every process from then on.
+
+	Returns:	[1] true - if the zygote is running
+						 or: nil - if the platform doesn't need one (Windows)
+
+	Comments:	"-Z"; make.cpp starts it before any Lua code runs, while presto
+						is still small.  posix_spawn() usually avoids copying presto's 
+						address space anyway, but a C library that implements it with
+						a plain fork() pays for every page of a big build graph on 
+						every spawn; the zygote keeps that cost flat.
+
+***********************************************************************EDOC*/
+static int make_proc_zygote(lua_State* L) {
+#ifdef _WIN32
+	return 0; // CreateProcess never copies our address space
+#else
+	// the zygote has to be forked before the reactor thread exists
+	if(zygote_fd == -1 && reactor_running)
+		luaL_error(L, "the zygote must be started before any processes");
+	if(!make_zygote_start())
+		luaL_error(L, "error starting zygote: %s", strerror(errno));
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+static const luaL_Reg make_proclib[] = {
+	{"spawn", make_proc_spawn},									// make.proc.spawn
+	{"flushio", make_proc_flushio},							// make.proc.flushio
+	{"wait", make_proc_wait},										// make.proc.wait
+	{"exit_code", make_proc_exitcode},					// make.proc.exit_code
+	{"usage", make_proc_usage},									// make.proc.usage
+	{"kill", make_proc_kill},										// make.proc.kill
+	{"send", make_proc_send},										// make.proc.send
+	{"receive", make_proc_receive},							// make.proc.receive
+	{"command_line", make_proc_command_line},		// make.proc.command_line
+	{"zygote", make_proc_zygote},								// make.proc.zygote
+  {NULL, NULL}
+};
+
+
+//***************************************************************************
+//**************************  make.sys functions  ***************************
+//***************************************************************************
+
+#ifdef __linux__
+// Reads a whole (small) file, like the ones in /proc and /sys
+static bool read_small_file(const char* path, std::string& out) {
+	int fd = open(path, O_RDONLY|O_CLOEXEC);
+	if(fd == -1)
+		return false;
+	char buffer[4096];
+	ssize_t n;
+	out.clear();
+	while((n = read(fd, buffer, sizeof(buffer))) > 0)
+		out.append(buffer, n);
+	close(fd);
+	return n == 0;
+}
+
+// Returns the directory of our cgroup (v2), or an empty string
+static std::string cgroup_dir() {
+	std::string cgroup;
+	if(!read_small_file("/proc/self/cgroup", cgroup))
+		return std::string();
+	size_t pos = cgroup.find("0::");
+	if(pos != 0 && (pos = cgroup.find("\n0::")) != std::string::npos)
+		pos++;
+	if(pos == std::string::npos)
+		return std::string();
+	size_t end = cgroup.find('\n', pos);
+	return "/sys/fs/cgroup" + cgroup.substr(pos+3, end == std::string::npos ? std::string::npos : end-pos-3);
+}
+#endif
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_sys_meminfo
+
+	Action:		Returns information about the memory of the build host.
+
+	Returns:	[1] table - {total = bytes, available = bytes, limit = bytes}
+
+	Comments:	"available" is how much can be used without swapping; on 
+						Linux it's MemAvailable from /proc/meminfo, further limited 
+						by our cgroup's memory.max (if any).  "limit" is only set if
+						there is such a cgroup limit.
+
+***********************************************************************EDOC*/
+static int make_sys_meminfo(lua_State* L) {
+	lua_newtable(L);
+#ifdef _WIN32
+	MEMORYSTATUSEX ms = { sizeof(ms) };
+	if(GlobalMemoryStatusEx(&ms)) {
+		lua_pushnumber(L, (double)ms.ullTotalPhys);	lua_setfield(L, -2, "total");
+		lua_pushnumber(L, (double)ms.ullAvailPhys);	lua_setfield(L, -2, "available");
+	}
+#elif defined(__linux__)
+	double total = 0, available = 0;
+	std::string meminfo;
+	if(read_small_file("/proc/meminfo", meminfo)) {
+		const char* pos;
+		if((pos = strstr(meminfo.c_str(), "MemTotal:")) != NULL)
+			total = strtod(pos + 9, NULL) * 1024.0;
+		if((pos = strstr(meminfo.c_str(), "MemAvailable:")) != NULL)
+			available = strtod(pos + 13, NULL) * 1024.0;
+	}
+
+	// A cgroup limit (e.g., in a container) trumps the host's memory
+	std::string dir = cgroup_dir(), max, current;
+	if(!dir.empty() && read_small_file((dir + "/memory.max").c_str(), max) && isdigit((unsigned char)max[0])) {
+		double limit = strtod(max.c_str(), NULL);
+		double used = read_small_file((dir + "/memory.current").c_str(), current) ? strtod(current.c_str(), NULL) : 0;
+		lua_pushnumber(L, limit); lua_setfield(L, -2, "limit");
+		if(limit < total)
+			total = limit;
+		if(limit - used < available)
+			available = limit > used ? limit - used : 0;
+	}
+	lua_pushnumber(L, total);			lua_setfield(L, -2, "total");
+	lua_pushnumber(L, available);	lua_setfield(L, -2, "available");
+#else
+	double page = (double)sysconf(_SC_PAGESIZE);
+	lua_pushnumber(L, page * sysconf(_SC_PHYS_PAGES));		lua_setfield(L, -2, "total");
+#ifdef _SC_AVPHYS_PAGES
+	lua_pushnumber(L, page * sysconf(_SC_AVPHYS_PAGES));	lua_setfield(L, -2, "available");
+#endif
+#endif
+	return 1;
+}
+
+/*SDOC***********************************************************************
+
+	Name:			make_sys_loadavg
+
+	Action:		Returns the system load averages.
+
+	Returns:	[1] number - 1-minute load average
+						[2] number - 5-minute load average
+						[3] number - 15-minute load average
+						 or: nil - if the system doesn't have load averages (Windows)
+
+***********************************************************************EDOC*/
+static int make_sys_loadavg(lua_State* L) {
+#ifdef _WIN32
+	return 0;
+#else
+	double loadavg[3];
+	if(getloadavg(loadavg, 3) != 3)
+		return 0;
+	lua_pushnumber(L, loadavg[0]);
+	lua_pushnumber(L, loadavg[1]);
+	lua_pushnumber(L, loadavg[2]);
+	return 3;
+#endif
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_sys_pressure
+
+	Action:		Returns the pressure stall information (PSI) for a resource.
+
+	Params:		[1] string - "cpu", "memory" or "io"
+
+	Returns:	[1] table - {some = percent, full = percent}
+						 or: nil - if PSI isn't available
+
+	Comments:	The numbers are the 10-second averages from /proc/pressure;
+						"some" is the share of time at least one task was stalled on
+						the resource, and "full" the share of time all of them were.
+						Linux only.
+
+***********************************************************************EDOC*/
+static int make_sys_pressure(lua_State* L) {
+	const char* resource = luaL_checkstring(L, 1);
+#ifdef __linux__
+	std::string path = std::string("/proc/pressure/") + resource, pressure;
+	if(strchr(resource, '/') || !read_small_file(path.c_str(), pressure))
+		return 0;
+	lua_newtable(L);
+	const char* kinds[] = { "some", "full" };
+	for(int i=0; i<2; i++) {
+		size_t pos = pressure.find(std::string(kinds[i]) + " avg10=");
+		if(pos != std::string::npos) {
+			lua_pushnumber(L, strtod(pressure.c_str() + pos + strlen(kinds[i]) + 7, NULL));
+			lua_setfield(L, -2, kinds[i]);
+		}
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_sys_cpu_count
+
+	Action:		Returns the number of CPUs that presto may run on.
+
+	Returns:	[1] number - CPU count
+
+	Comments:	Respects the CPU affinity mask on Linux (e.g., taskset, or a 
+						container's cpuset).
+
+***********************************************************************EDOC*/
+static int make_sys_cpu_count(lua_State* L) {
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	lua_pushnumber(L, si.dwNumberOfProcessors);
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef __linux__
+	cpu_set_t set;
+	if(sched_getaffinity(0, sizeof(set), &set) == 0)
+		count = CPU_COUNT(&set);
+#endif
+	lua_pushnumber(L, count > 0 ? count : 1);
+#endif
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_sys_cpu_quota
+
+	Action:		Returns our cgroup's CPU quota.
+
+	Returns:	[1] number - CPU quota, in CPUs (e.g., 2.5)
+						 or: nil - if there's no quota
+
+	Comments:	Reads cpu.max (cgroup v2), or cpu.cfs_quota_us and 
+						cpu.cfs_period_us (cgroup v1).  Linux only.
+
+***********************************************************************EDOC*/
+static int make_sys_cpu_quota(lua_State* L) {
+#ifdef __linux__
+	double quota = -1, period = 0;
+	std::string dir = cgroup_dir(), max, v1;
+	if(!dir.empty() && read_small_file((dir + "/cpu.max").c_str(), max)) {
+		if(isdigit((unsigned char)max[0])) {
+			char* end;
+			quota = strtod(max.c_str(), &end);
+			period = strtod(end, NULL);
+		}
+	} else if(read_small_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", v1)) {
+		quota = strtod(v1.c_str(), NULL);
+		if(read_small_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us", v1))
+			period = strtod(v1.c_str(), NULL);
+	}
+	if(quota > 0 && period > 0) {
+		lua_pushnumber(L, quota / period);
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+/*SDOC***********************************************************************
+
+	Name:			make_sys_topology
+
+	Action:		Returns the machine's NUMA nodes, and the CPUs in each one
+						that we're allowed to run on.
+
+	Returns:	[1] table - array of { node = number, cpus = { numbers... } }
+						 or: nil - if the topology isn't available
+
+	Comments:	Reads /sys/devices/system/node on Linux; a machine (or kernel)
+						without NUMA comes back as one node with all of our CPUs.  The
+						CPU numbers are the ones the "cpus" option of make.proc.spawn
+						takes.
+
+***********************************************************************EDOC*/
+// A node number and its CPUs
+typedef std::pair<int, std::vector<int> > numa_node;
+
+static void lua_pushtopology(lua_State* L, std::vector<numa_node>& nodes) {
+	std::sort(nodes.begin(), nodes.end());
+	lua_newtable(L);
+	int n = 0;
+	for(size_t i=0; i<nodes.size(); i++) {
+		if(nodes[i].second.empty())
+			continue; // nothing we can use
+		lua_newtable(L);
+		lua_pushnumber(L, nodes[i].first);
+		lua_setfield(L, -2, "node");
+		lua_newtable(L);
+		for(size_t j=0; j<nodes[i].second.size(); j++) {
+			lua_pushnumber(L, nodes[i].second[j]);
+			lua_rawseti(L, -2, (int)j + 1);
+		}
+		lua_setfield(L, -2, "cpus");
+		lua_rawseti(L, -2, ++n);
+	}
+}
+
+#ifdef __linux__
+// Parses a cpulist, like "0-3,8-11", keeping the CPUs that are in 'allowed'
+static std::vector<int> parse_cpulist(const char* list, const cpu_set_t& allowed) {
+	std::vector<int> cpus;
+	while(isdigit((unsigned char)*list)) {
+		char* end;
+		long first = strtol(list, &end, 10), last = first;
+		if(*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for(long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			if(CPU_ISSET(cpu, &allowed))
+				cpus.push_back((int)cpu);
+		}
+		list = *end == ',' ? end + 1 : end;
+	}
+	return cpus;
+}
+#endif
+
+static int make_sys_topology(lua_State* L) {
+	std::vector<numa_node> nodes;
+#ifdef _WIN32
+	DWORD_PTR allowed, system;
+	ULONG highest;
+	if(!GetProcessAffinityMask(GetCurrentProcess(), &allowed, &system) || !GetNumaHighestNodeNumber(&highest))
+		return 0;
+	for(ULONG node=0; node<=highest; node++) {
+		ULONGLONG mask;
+		if(!GetNumaNodeProcessorMask((UCHAR)node, &mask))
+			continue;
+		mask &= allowed;
+		nodes.push_back(numa_node(node, std::vector<int>()));
+		for(int cpu=0; cpu<(int)(8 * sizeof(mask)); cpu++) {
+			if(mask & ((ULONGLONG)1 << cpu))
+				nodes.back().second.push_back(cpu);
+		}
+	}
+#elif defined(__linux__)
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return 0;
+	DIR* dir = opendir("/sys/devices/system/node");
+	if(dir) {
+		struct dirent* entry;
+		while((entry = readdir(dir)) != NULL) {
+			int node;
+			char extra;
+			std::string cpulist;
+			if(sscanf(entry->d_name, "node%d%c", &node, &extra) == 1 &&
+				read_small_file((std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist").c_str(), cpulist))
+				nodes.push_back(numa_node(node, parse_cpulist(cpulist.c_str(), allowed)));
+		}
+		closedir(dir);
+	}
+	bool bAny = false;
+	for(size_t i=0; i<nodes.size(); i++)
+		bAny = bAny || !nodes[i].second.empty();
+	if(!bAny) {
+		// no NUMA; everything is node 0
+		nodes.clear();
+		nodes.push_back(numa_node(0, std::vector<int>()));
+		for(int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+			if(CPU_ISSET(cpu, &allowed))
+				nodes.back().second.push_back(cpu);
+		}
+	}
+#endif
+	if(nodes.empty())
+		return 0;
+	lua_pushtopology(L, nodes);
+	return 1;
+}
+
+/*SDOC***********************************************************************
+
+	Name:			make_sys_setenv
+
+	Action:		Sets a variable in presto's own environment.
+
+	Params:		[1] string - variable name
+						[2] string - value (or nil, to remove the variable)
+
+	Comments:	Processes spawned without an environment table inherit the
+						change.  make.env is *not* updated; that's up to the caller.
+
+***********************************************************************EDOC*/
+static int make_sys_setenv(lua_State* L) {
+	const char* name = luaL_checkstring(L, 1);
+	const char* value = luaL_optstring(L, 2, NULL);
+#ifdef _WIN32
+	BOOL ok = SetEnvironmentVariableA(name, value);
+#else
+	bool ok = (value ? setenv(name, value, 1) : unsetenv(name)) == 0;
+#endif
+	if(!ok)
+		luaL_error(L, "error setting environment variable " LUA_QS, name);
+	return 0;
+}
+
+static const luaL_Reg make_syslib[] = {
+	{"meminfo", make_sys_meminfo},							// make.sys.meminfo
+	{"loadavg", make_sys_loadavg},							// make.sys.loadavg
+	{"pressure", make_sys_pressure},						// make.sys.pressure
+	{"cpu_count", make_sys_cpu_count},					// make.sys.cpu_count
+	{"cpu_quota", make_sys_cpu_quota},					// make.sys.cpu_quota
+	{"topology", make_sys_topology},						// make.sys.topology
+	{"setenv", make_sys_setenv},								// make.sys.setenv
+  {NULL, NULL}
+};
+
+
+//***************************************************************************
+//**************************  make.sync functions  **************************
+//***************************************************************************
+
+// Output-sync buffer USERDATA type; holds everything a job has printed
+// until the job finishes.  Past the threshold, the output goes to an
+// (already unlinked) temp file instead of memory.
+struct sync_buffer {
+	char* data;							// buffered output (NULL once spilled)
+	size_t size;						// bytes in 'data'
+	size_t capacity;				// size of the 'data' allocation
+	size_t threshold;				// spill to disk past this many bytes
+	FILE* spill;						// temp file, once the threshold is passed
+};
+
+// Opens an anonymous temp file; it's deleted as soon as it's closed.
+static FILE* open_spill_file() {
+#ifdef _WIN32
+	wchar_t dir[MAX_PATH] = {};
+	GetTempPathW(MAX_PATH, dir);
+	wchar_t path[MAX_PATH] = {};
+	if(!GetTempFileNameW(dir, L"pre", 0, path))
+		return NULL;
+	return _wfopen(path, L"w+bD"); // 'D' == delete on close
+#else
+	std::string path = temp_dir() + "preXXXXXX";
+	int fd = mkstemp(&path[0]);
+	if(fd == -1)
+		return NULL;
+	unlink(path.c_str());
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	FILE* file = fdopen(fd, "w+");
+	if(file == NULL)
+		close(fd);
+	return file;
+#endif
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_sync_write
+
+	Action:		Appends a string to an output-sync buffer.
+
+	Params:		[1] USERDATA - buffer from make.sync.new()
+						[2] string - output
+
+***********************************************************************EDOC*/
+static int make_sync_write(lua_State* L) {
+	sync_buffer* b = (sync_buffer*)luaL_checkudata(L, 1, "make.sync");
+	size_t len;
+	const char* str = luaL_checklstring(L, 2, &len);
+
+	// Past the threshold, move everything to a temp file
+	if(b->spill == NULL && b->size + len > b->threshold) {
+		b->spill = open_spill_file();
+		if(b->spill == NULL)
+			luaL_error(L, "error creating temp file");
+		fwrite(b->data, 1, b->size, b->spill);
+		free(b->data);
+		b->data = NULL;
+		b->size = b->capacity = 0;
+	}
+
+	if(b->spill) {
+		if(fwrite(str, 1, len, b->spill) != len)
+			luaL_error(L, "error writing temp file");
+	} else {
+		if(b->size + len > b->capacity) {
+			size_t capacity = b->capacity ? b->capacity : 4096;
+			while(capacity < b->size + len)
+				capacity *= 2;
+			char* data = (char*)realloc(b->data, capacity);
+			if(data == NULL)
+				luaL_error(L, "out of memory");
+			b->data = data;
+			b->capacity = capacity;
+		}
+		memcpy(b->data + b->size, str, len);
+		b->size += len;
+	}
+	return 0;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_sync_flush
+
+	Action:		Writes the contents of an output-sync buffer to stdout, and
+						empties it.
+
+	Params:		[1] USERDATA - buffer from make.sync.new()
+
+***********************************************************************EDOC*/
+static int make_sync_flush(lua_State* L) {
+	sync_buffer* b = (sync_buffer*)luaL_checkudata(L, 1, "make.sync");
+	if(b->spill) {
+		// copy the temp file out; the Lua thread is the only writer, so 
+		// nothing else can be written to stdout in the middle
+		char chunk[65536];
+		size_t n;
+		fflush(b->spill);
+		rewind(b->spill);
+		while((n = fread(chunk, 1, sizeof(chunk), b->spill)) > 0)
+			output_write(1, chunk, n);
+		fclose(b->spill);
+		b->spill = NULL;
+	} else if(b->size) {
+		output_write(1, b->data, b->size);
+		b->size = 0;
+	}
+	return 0;
+}
+
+static int make_sync_gc(lua_State* L) {
+	sync_buffer* b = (sync_buffer*)lua_touserdata(L, 1);
+	free(b->data);
+	if(b->spill)
+		fclose(b->spill);
+	return 0;
+}
+
+static const luaL_Reg make_sync_methods[] = {
+	{"write", make_sync_write},									// buffer:write
+	{"flush", make_sync_flush},									// buffer:flush
+	{"__gc", make_sync_gc},
+  {NULL, NULL}
+};
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_sync_new
+
+	Action:		Creates a new output-sync buffer.
+
+	Params:		[1] number - spill threshold in bytes (optional; default 1MB)
+
+	Returns:	[1] USERDATA - buffer, with write() and flush() methods
+
+	Comments:	Used by "-O" to keep the output of each job together; 
+						everything a job prints is written to its buffer, and the 
+						buffer is flushed to stdout in one piece when the job 
+						finishes.  Output past the threshold is kept in a temp file,
+						so a job with a huge log doesn't bloat presto.
+
+***********************************************************************EDOC*/
+static int make_sync_new(lua_State* L) {
+	size_t threshold = (size_t)luaL_optnumber(L, 1, 1024*1024);
+	sync_buffer* b = (sync_buffer*)lua_newuserdata(L, sizeof(sync_buffer));
+	memset(b, 0, sizeof(*b));
+	b->threshold = threshold;
+	if(luaL_newmetatable(L, "make.sync")) {
+		luaL_register(L, NULL, make_sync_methods);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+
+static const luaL_Reg make_synclib[] = {
+	{"new", make_sync_new},											// make.sync.new
+  {NULL, NULL}
+};
+
+
+//***************************************************************************
+//************************  make.jobserver functions  ***********************
+//***************************************************************************
+
+// There's only ever one jobserver per presto; either the one we created
+// (we're the server), or the one we inherited from a parent make (we're a
+// client).  The pool holds one token (a byte, or a semaphore count) for
+// each job slot but the first; whoever runs a job beyond its first must
+// take a token, and put it back when the job finishes.
+#ifdef _WIN32
+static HANDLE jobserver_sem = NULL;
+#else
+static int jobserver_read = -1, jobserver_write = -1;
+static std::string jobserver_tokens;		// the bytes we've taken; put back as-is
+static char jobserver_fifo[PATH_MAX];	// our FIFO, if we're the server
+static bool jobserver_poll = false;		// read end is blocking; poll before reading
+
+static void jobserver_cleanup() {
+	if(jobserver_fifo[0])
+		unlink(jobserver_fifo);
+}
+
+// Uses a pipe that we share with other processes as the pool.  Making it
+// non-blocking would change it for everyone, so on Linux we open our own
+// non-blocking view of it; otherwise we poll before each read.
+static void jobserver_use_pipe(int rfd, int wfd) {
+#ifdef __linux__
+	char fdpath[64];
+	snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", rfd);
+	int fd = open(fdpath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd != -1)
+		rfd = fd;
+	else
+#endif
+		jobserver_poll = !(fcntl(rfd, F_GETFL) & O_NONBLOCK);
+	jobserver_read = rfd;
+	jobserver_write = wfd;
+}
+#endif
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_jobserver_create
+
+	Action:		Creates a jobserver token pool, for presto's children to share.
+
+	Params:		[1] number - number of tokens (i.e., job slots - 1)
+						[2] string - "pipe" (default) or "fifo"; ignored on Windows
+
+	Returns:	[1] string - the --jobserver-auth value for MAKEFLAGS
+						 or: nil, string - error message
+
+	Comments:	On POSIX, the pool is either a pipe whose descriptors are 
+						inherited by every child ("R,W"; understood by any GNU make
+						since 4.2, and cargo), or a named FIFO in $TMPDIR ("fifo:PATH";
+						GNU make 4.4 and ninja), which is removed when presto exits.
+						On Windows, it's a named semaphore (the same as GNU make's).
+
+***********************************************************************EDOC*/
+static int make_jobserver_create(lua_State* L) {
+	int tokens = (int)luaL_checknumber(L, 1);
+	luaL_argcheck(L, tokens >= 0, 1, "negative token count");
+#ifdef _WIN32
+	char name[64];
+	sprintf(name, "presto_semaphore_%lu", GetCurrentProcessId());
+	HANDLE sem = CreateSemaphoreA(NULL, tokens, tokens > 0 ? tokens : 1, name);
+	if(sem == NULL) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "error creating jobserver semaphore (%d)", (int)GetLastError());
+		return 2;
+	}
+	jobserver_sem = sem;
+	lua_pushstring(L, name);
+#else
+	const char* style = luaL_optstring(L, 2, "pipe");
+	std::string pool(tokens, '+');
+	if(strcmp(style, "fifo") != 0) {
+		// deliberately *not* close-on-exec, so our children inherit it
+		int fds[2];
+		if(pipe(fds) != 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "error creating jobserver pipe: %s", strerror(errno));
+			return 2;
+		}
+		if(tokens > 0 && write(fds[1], pool.data(), pool.size()) != (ssize_t)pool.size()) {
+			close(fds[0]);
+			close(fds[1]);
+			lua_pushnil(L);
+			lua_pushfstring(L, "error filling jobserver pipe: %s", strerror(errno));
+			return 2;
+		}
+		jobserver_use_pipe(fds[0], fds[1]);
+		zygote_inherit(fds[0]);
+		zygote_inherit(fds[1]);
+		lua_pushfstring(L, "%d,%d", fds[0], fds[1]);
+		return 1;
+	}
+
+	const char* tmpdir = getenv("TMPDIR");
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/presto-jobserver-%d", tmpdir && *tmpdir ? tmpdir : "/tmp", (int)getpid());
+	unlink(path); // left behind by a crashed presto with our pid
+	if(mkfifo(path, 0600) != 0) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "error creating jobserver FIFO " LUA_QS ": %s", path, strerror(errno));
+		return 2;
+	}
+	strcpy(jobserver_fifo, path);
+	atexit(jobserver_cleanup);
+
+	// we open it read/write, so it never reports EOF
+	int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if(fd == -1) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "error opening jobserver FIFO " LUA_QS ": %s", path, strerror(errno));
+		return 2;
+	}
+	if(tokens > 0 && write(fd, pool.data(), pool.size()) != (ssize_t)pool.size()) {
+		close(fd);
+		lua_pushnil(L);
+		lua_pushfstring(L, "error filling jobserver FIFO: %s", strerror(errno));
+		return 2;
+	}
+	jobserver_read = jobserver_write = fd;
+	lua_pushfstring(L, "fifo:%s", path);
+#endif
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_jobserver_attach
+
+	Action:		Joins the jobserver of a parent make.
+
+	Params:		[1] string - the --jobserver-auth (or --jobserver-fds) value 
+						from MAKEFLAGS
+
+	Returns:	[1] true
+						 or: nil, string - error message
+
+	Comments:	Understands "fifo:PATH" and "R,W" (inherited pipe descriptors)
+						on POSIX, and a semaphore name on Windows.  GNU make only hands
+						the pipe to commands it thinks are recursive makes, so closed
+						descriptors are an error rather than something to read from.
+
+***********************************************************************EDOC*/
+static int make_jobserver_attach(lua_State* L) {
+	const char* auth = luaL_checkstring(L, 1);
+#ifdef _WIN32
+	HANDLE sem = OpenSemaphoreA(SEMAPHORE_MODIFY_STATE | SYNCHRONIZE, FALSE, auth);
+	if(sem == NULL) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "error opening jobserver semaphore " LUA_QS " (%d)", auth, (int)GetLastError());
+		return 2;
+	}
+	jobserver_sem = sem;
+#else
+	int rfd, wfd;
+	if(strncmp(auth, "fifo:", 5) == 0) {
+		rfd = wfd = open(auth + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if(rfd == -1) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "error opening jobserver FIFO " LUA_QS ": %s", auth + 5, strerror(errno));
+			return 2;
+		}
+		jobserver_read = jobserver_write = rfd;
+	} else if(sscanf(auth, "%d,%d", &rfd, &wfd) == 2) {
+		if(rfd < 0 || wfd < 0 || fcntl(rfd, F_GETFD) == -1 || fcntl(wfd, F_GETFD) == -1) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "jobserver pipe %d,%d is not open (is the command marked as a recursive make?)", rfd, wfd);
+			return 2;
+		}
+		jobserver_use_pipe(rfd, wfd);
+	} else {
+		lua_pushnil(L);
+		lua_pushfstring(L, "unknown jobserver " LUA_QS, auth);
+		return 2;
+	}
+#endif
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_jobserver_acquire
+
+	Action:		Takes a token from the jobserver, if one is available.
+
+	Returns:	[1] boolean - true if we got a token; false if not (or if there
+						is no jobserver)
+
+	Comments:	Never blocks.
+
+***********************************************************************EDOC*/
+static int make_jobserver_acquire(lua_State* L) {
+	bool ok = false;
+#ifdef _WIN32
+	ok = jobserver_sem != NULL && WaitForSingleObject(jobserver_sem, 0) == WAIT_OBJECT_0;
+#else
+	if(jobserver_read != -1) {
+		struct pollfd pfd = { jobserver_read, POLLIN, 0 };
+		char token;
+		if((!jobserver_poll || poll(&pfd, 1, 0) == 1) && read(jobserver_read, &token, 1) == 1) {
+			jobserver_tokens += token;
+			ok = true;
+		}
+	}
+#endif
+	lua_pushboolean(L, ok);
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_jobserver_release
+
+	Action:		Puts a token back into the jobserver.
+
+***********************************************************************EDOC*/
+static int make_jobserver_release(lua_State* /*L*/) {
+#ifdef _WIN32
+	if(jobserver_sem != NULL)
+		ReleaseSemaphore(jobserver_sem, 1, NULL);
+#else
+	if(jobserver_write != -1) {
+		char token = '+';
+		if(!jobserver_tokens.empty()) {
+			token = jobserver_tokens[jobserver_tokens.size()-1];
+			jobserver_tokens.erase(jobserver_tokens.size()-1);
+		}
+		while(write(jobserver_write, &token, 1) == -1 && errno == EINTR)
+			;
+	}
+#endif
+	return 0;
+}
+
+
+static const luaL_Reg make_jobserverlib[] = {
+	{"create", make_jobserver_create},					// make.jobserver.create
+	{"attach", make_jobserver_attach},					// make.jobserver.attach
+	{"acquire", make_jobserver_acquire},				// make.jobserver.acquire
+	{"release", make_jobserver_release},				// make.jobserver.release
+  {NULL, NULL}
+};
+
+
+//***************************************************************************
+//**************************  make.graph functions  *************************
+//***************************************************************************
+
+// The graph store holds the name of every target that's been mentioned, 
+// whether it's defined or only named as a dependency, and the edges 
+// between them; a target's Lua table only holds what's particular to it
+// (its command, and so on).  Each name is interned: it's stored once, in
+// one block of characters, and given a small integer id (starting at 1),
+// which is what the edges (and make.sched) use.
+//
+// The edges are in compressed sparse row form: one array holding every
+// node's dependencies, one node after another, sorted and without 
+// duplicates, and each node's offset into it.  Edges added since that 
+// array was built are linked to their node instead; they're merged in 
+// once there are as many of them as there are in the array, so building
+// the graph one edge at a time stays linear.
+struct graph_link {
+	unsigned dep;												// the dependency's id
+	unsigned next;											// the node's next link (index + 1), or 0
+};
+
+static std::vector<char> graph_chars;				// every name, each followed by a NUL
+static std::vector<unsigned> graph_names;		// node id - 1 -> its name in graph_chars
+static std::vector<unsigned> graph_index;		// hash table of node ids; 0 is empty
+static std::vector<unsigned> graph_start;		// node id - 1 -> its first edge in graph_edges
+static std::vector<unsigned> graph_edges;		// each node's dependencies
+static std::vector<unsigned> graph_added;		// node id - 1 -> its newest link, or 0
+static std::vector<graph_link> graph_links;	// edges that aren't in graph_edges yet
+
+static unsigned graph_hash(const char* name, size_t l) {
+	unsigned h = 2166136261u; // (FNV-1a)
+	for(size_t i=0; i<l; i++)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return h;
+}
+
+static const char* graph_name(unsigned id, size_t* l) {
+	size_t start = graph_names[id - 1];
+	size_t end = id < graph_names.size() ? graph_names[id] : graph_chars.size();
+	*l = end - start - 1;
+	return &graph_chars[start];
+}
+
+// Finds a name's id; if it isn't there, adds it (if 'bAdd'), or returns 0
+static unsigned graph_find(const char* name, size_t l, bool bAdd) {
+	if(graph_index.size() < (graph_names.size() + 1) * 2) {
+		if(!bAdd && graph_index.empty())
+			return 0;
+		// grow the hash table, and put every id back in it
+		std::vector<unsigned> index(graph_index.empty() ? 1024 : graph_index.size() * 2, 0);
+		for(unsigned id=1; id<=graph_names.size(); id++) {
+			size_t nl;
+			const char* n = graph_name(id, &nl);
+			size_t slot = graph_hash(n, nl) & (index.size() - 1);
+			while(index[slot])
+				slot = (slot + 1) & (index.size() - 1);
+			index[slot] = id;
+		}
+		graph_index.swap(index);
+	}
+	size_t slot = graph_hash(name, l) & (graph_index.size() - 1);
+	while(graph_index[slot]) {
+		size_t nl;
+		const char* n = graph_name(graph_index[slot], &nl);
+		if(nl == l && memcmp(n, name, l) == 0)
+			return graph_index[slot];
+		slot = (slot + 1) & (graph_index.size() - 1);
+	}
+	if(!bAdd)
+		return 0;
+	graph_names.push_back((unsigned)graph_chars.size());
+	graph_chars.insert(graph_chars.end(), name, name + l);
+	graph_chars.push_back('\0');
+	graph_added.push_back(0);
+	graph_index[slot] = (unsigned)graph_names.size();
+	return graph_index[slot];
+}
+
+// Appends a node's dependencies to 'deps'; one can come up more than once,
+// if its edge was added more than once since the last graph_compact
+static void graph_deps(unsigned id, std::vector<unsigned>& deps) {
+	if(id < graph_start.size())
+		deps.insert(deps.end(), graph_edges.begin() + graph_start[id - 1], graph_edges.begin() + graph_start[id]);
+	for(unsigned link=graph_added[id - 1]; link; link=graph_links[link - 1].next)
+		deps.push_back(graph_links[link - 1].dep);
+}
+
+// Merges the added edges into graph_edges
+static void graph_compact() {
+	if(graph_links.empty() && graph_start.size() == graph_names.size() + 1)
+		return;
+	std::vector<unsigned> start, edges, deps;
+	start.reserve(graph_names.size() + 1);
+	edges.reserve(graph_edges.size() + graph_links.size());
+	for(unsigned id=1; id<=graph_names.size(); id++) {
+		start.push_back((unsigned)edges.size());
+		deps.clear();
+		graph_deps(id, deps);
+		std::sort(deps.begin(), deps.end());
+		deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+		edges.insert(edges.end(), deps.begin(), deps.end());
+		graph_added[id - 1] = 0;
+	}
+	start.push_back((unsigned)edges.size());
+	graph_start.swap(start);
+	graph_edges.swap(edges);
+	std::vector<graph_link>().swap(graph_links);
+}
+
+static void graph_depend(unsigned id, unsigned dep) {
+	graph_link link = { dep, graph_added[id - 1] };
+	graph_links.push_back(link);
+	graph_added[id - 1] = (unsigned)graph_links.size();
+	if(graph_links.size() >= 1024 && graph_links.size() > graph_edges.size())
+		graph_compact();
+}
+
+// A node, by name or id; 0 if it's a name that isn't in the graph (and 
+// 'bAdd' is false)
+static unsigned lua_checkgraphnode(lua_State* L, int idx, bool bAdd) {
+	if(lua_type(L, idx) == LUA_TNUMBER) {
+		lua_Number id = lua_tonumber(L, idx);
+		if(id < 1 || id > graph_names.size())
+			luaL_argerror(L, idx, "bad node id");
+		return (unsigned)id;
+	}
+	size_t l;
+	const char* name = luaL_checklstring(L, idx, &l);
+	return graph_find(name, l, bAdd);
+}
+
+static void lua_pushgraphname(lua_State* L, unsigned id) {
+	size_t l;
+	const char* name = graph_name(id, &l);
+	lua_pushlstring(L, name, l);
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_graph_id
+
+	Action:		Returns a target name's id, adding it to the graph if needed.
+
+	Params:		[1] string - target name
+
+	Returns:	[1] number - node id
+
+***********************************************************************EDOC*/
+static int make_graph_id(lua_State* L) {
+	lua_pushnumber(L, lua_checkgraphnode(L, 1, true));
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_graph_name
+
+	Action:		Returns the target name of a node.
+
+	Params:		[1] number - node id
+
+	Returns:	[1] string - target name
+
+***********************************************************************EDOC*/
+static int make_graph_name(lua_State* L) {
+	lua_pushgraphname(L, lua_checkgraphnode(L, 1, false));
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_graph_depend
+
+	Action:		Records that a target depends on another one.
+
+	Params:		[1] string|number - target name (or node id)
+						[2] string|number - name (or id) of the target it depends on
+
+	Comments:	Names are added to the graph as needed.  Adding the same edge
+						again does nothing.
+
+***********************************************************************EDOC*/
+static int make_graph_depend(lua_State* L) {
+	unsigned id = lua_checkgraphnode(L, 1, true);
+	graph_depend(id, lua_checkgraphnode(L, 2, true));
+	return 0;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_graph_deps
+
+	Action:		Returns the names of the targets a target depends on.
+
+	Params:		[1] string|number - target name (or node id)
+
+	Returns:	[1] table - array of names, in the order the names were first
+										added to the graph
+
+***********************************************************************EDOC*/
+static int make_graph_deps(lua_State* L) {
+	unsigned id = lua_checkgraphnode(L, 1, false);
+	std::vector<unsigned> deps;
+	if(id)
+		graph_deps(id, deps);
+	std::sort(deps.begin(), deps.end());
+	deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+	lua_createtable(L, (int)deps.size(), 0);
+	for(size_t i=0; i<deps.size(); i++) {
+		lua_pushgraphname(L, deps[i]);
+		lua_rawseti(L, -2, (int)i + 1);
+	}
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_graph_cycle
+
+	Action:		Looks for a dependency cycle below the given targets.
+
+	Params:		[1..n] string|number - target names (or node ids); if none 
+										are given, the whole graph is checked
+
+	Returns:	[1] table - array of the names on the first cycle found, each 
+										depending on the next, with the first name repeated
+										at the end
+							 or: nil - if there are no cycles
+
+	Comments:	This is one depth-first pass over the graph, which visits each
+						node and edge once, however many targets share them.
+
+***********************************************************************EDOC*/
+static int make_graph_cycle(lua_State* L) {
+	std::vector<unsigned> roots;
+	for(int i=1; i<=lua_gettop(L); i++) {
+		unsigned id = lua_checkgraphnode(L, i, false);
+		if(id)
+			roots.push_back(id);
+	}
+	if(lua_gettop(L) == 0) {
+		for(unsigned id=1; id<=graph_names.size(); id++)
+			roots.push_back(id);
+	}
+	graph_compact();
+
+	// a node is on the path while its dependencies are being visited; 
+	// reaching one that's still on the path closes a cycle
+	enum { UNSEEN, ON_PATH, FINISHED };
+	std::vector<char> color(graph_names.size(), UNSEEN);
+	std::vector<std::pair<unsigned, unsigned> > path; // node, and its next edge
+	for(size_t r=0; r<roots.size(); r++) {
+		if(color[roots[r] - 1] != UNSEEN)
+			continue;
+		color[roots[r] - 1] = ON_PATH;
+		path.push_back(std::make_pair(roots[r], graph_start[roots[r] - 1]));
+		while(!path.empty()) {
+			unsigned id = path.back().first;
+			unsigned& next = path.back().second;
+			if(next == graph_start[id]) {
+				color[id - 1] = FINISHED;
+				path.pop_back();
+				continue;
+			}
+			unsigned dep = graph_edges[next++];
+			if(color[dep - 1] == UNSEEN) {
+				color[dep - 1] = ON_PATH;
+				path.push_back(std::make_pair(dep, graph_start[dep - 1]));
+			} else if(color[dep - 1] == ON_PATH) {
+				// the cycle is the part of the path from 'dep' on
+				size_t first = path.size() - 1;
+				while(path[first].first != dep)
+					first--;
+				lua_createtable(L, (int)(path.size() - first + 1), 0);
+				int n = 0;
+				for(size_t i=first; i<path.size(); i++) {
+					lua_pushgraphname(L, path[i].first);
+					lua_rawseti(L, -2, ++n);
+				}
+				lua_pushgraphname(L, dep);
+				lua_rawseti(L, -2, ++n);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_graph_count
+
+	Action:		Returns the number of names in the graph.
+
+	Returns:	[1] number
+
+***********************************************************************EDOC*/
+static int make_graph_count(lua_State* L) {
+	lua_pushnumber(L, (lua_Number)graph_names.size());
+	return 1;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_graph_memory
+
+	Action:		Returns the memory the graph store is using.
+
+	Returns:	[1] number - bytes
+
+***********************************************************************EDOC*/
+static int make_graph_memory(lua_State* L) {
+	size_t bytes = graph_chars.capacity() + 
+		(graph_names.capacity() + graph_index.capacity() + graph_start.capacity() + 
+		 graph_edges.capacity() + graph_added.capacity()) * sizeof(unsigned) + 
+		graph_links.capacity() * sizeof(graph_link);
+	lua_pushnumber(L, (lua_Number)bytes);
+	return 1;
+}
+
+
+static const luaL_Reg make_graphlib[] = {
+	{"id", make_graph_id},											// make.graph.id
+	{"name", make_graph_name},									// make.graph.name
+	{"depend", make_graph_depend},							// make.graph.depend
+	{"deps", make_graph_deps},									// make.graph.deps
+	{"cycle", make_graph_cycle},								// make.graph.cycle
+	{"count", make_graph_count},								// make.graph.count
+	{"memory", make_graph_memory},							// make.graph.memory
+  {NULL, NULL}
+};
+
+
+//***************************************************************************
+//**************************  make.sched functions  *************************
+//***************************************************************************
+
+// The scheduler holds the targets a build has to visit, each with the 
+// targets that depend on it (the reverse edges), and a count of the 
+// dependencies it's still waiting for.  Its node ids are the graph 
+// store's (see make.graph).  When a target's last dependency 
+// is done, the target goes on the ready queue; so finding the next thing
+// to build never means walking the graph again.  Whether a ready target
+// needs building, and how, is still up to its Lua code.
+//
+// The ready queue is a heap, ordered by priority: the expected time from
+// the start of a target to the end of the build, along the longest path
+// of its dependents (see make.sched.prioritize).  Equal priorities come 
+// out in the order they went in.
+enum { SCHED_NEW, SCHED_WAITING, SCHED_READY, SCHED_STARTED, SCHED_DONE };
+static const char* const sched_states[] = { "new", "waiting", "ready", "started", "done" };
+
+struct sched_node {
+	std::vector<unsigned> dependents;	// nodes waiting on this one
+	unsigned pending;									// dependencies that aren't done yet
+	int state;												// SCHED_*
+	double cost;											// expected time to build it, in seconds
+	double priority;									// cost, plus the longest path to the goals
+	unsigned seq;											// when it became ready
+};
+
+static std::vector<sched_node> sched_nodes;		// node id - 1 -> its state
+static std::vector<unsigned> sched_ready;			// a heap (see sched_before)
+static unsigned sched_seq = 0;
+
+// Makes room for every node in the graph store
+static void sched_grow() {
+	sched_node n;
+	n.pending = 0;
+	n.state = SCHED_NEW;
+	n.cost = n.priority = 0;
+	n.seq = 0;
+	sched_nodes.resize(graph_names.size(), n);
+}
+
+static sched_node& lua_checknode(lua_State* L, int idx) {
+	lua_Number id = luaL_checknumber(L, idx);
+	if(id < 1 || id > graph_names.size())
+		luaL_argerror(L, idx, "bad node id");
+	sched_grow();
+	return sched_nodes[(size_t)id - 1];
+}
 
-	Name:			make_proc_spawn
+// Records that node 'id' depends on node 'dep'
+static void sched_depend(unsigned id, unsigned dep) {
+	if(sched_nodes[dep - 1].state != SCHED_DONE) {
+		sched_nodes[dep - 1].dependents.push_back(id);
+		sched_nodes[id - 1].pending++;
+	}
+}
 
-	Action:		Spawn a new process
+// Heap order; true if 'a' comes out after 'b'
+static bool sched_before(unsigned a, unsigned b) {
+	const sched_node& x = sched_nodes[a - 1];
+	const sched_node& y = sched_nodes[b - 1];
+	if(x.priority != y.priority)
+		return x.priority < y.priority;
+	return x.seq > y.seq;
+}
 
-	Params:		[1] string - command line (OS-specific)
-						[2] table - environment table (e.g., {v1="value1",v2="value2"})
-						 or: nil - to inherit presto's environment
+// A node's priority, from its dependents' (which must be up to date)
+static double sched_priority(const sched_node& n) {
+	double longest = 0;
+	for(size_t i=0; i<n.dependents.size(); i++) {
+		double p = sched_nodes[n.dependents[i] - 1].priority;
+		if(p > longest)
+			longest = p;
+	}
+	return n.cost + longest;
+}
 
-	Returns:	[1] table - {data = --[[process USERDATA]]--}
+// Puts a node on the ready queue; 'seq' keeps its place in line, if it had one
+static void sched_push(unsigned id, unsigned seq = 0) {
+	sched_node& n = sched_nodes[id - 1];
+	n.state = SCHED_READY;
+	n.seq = seq ? seq : ++sched_seq;
+	n.priority = sched_priority(n);
+	sched_ready.push_back(id);
+	std::push_heap(sched_ready.begin(), sched_ready.end(), sched_before);
+}
 
-	Comments:	The process will execute in the background.  All output is 
-						buffered, and nothing will be dumped to the screen unless/until
-						make.proc.flushio() is called.
-	
-						If an environment table is specified, it will completely 
-						replace the original environment.  (If you need variables from
-						the original environment, they can be copied from make.env.)
+
+/*SDOC***********************************************************************
+
+	Name:			make_sched_node
+
+	Action:		Looks up a target's node, or adds a new one.
+
+	Params:		[1] string - target name
+
+	Returns:	[1] number - node id
+						[2] string - node state: "new" (not yet added), "waiting", 
+									"ready", "started" or "done"
 
 ***********************************************************************EDOC*/
-static int make_proc_spawn(lua_State* L) {
-	// retrieve the command-line
-	size_t l; 
-	const char* command_lineA = lua_tolstring(L, 1, &l);
-	wchar_t* command_line = (wchar_t*)alloca((l+1)*sizeof(wchar_t));
-	l = MultiByteToWideChar(CP_UTF8, 0, command_lineA, (int)l+1, command_line, (int)l+1);
+static int make_sched_node(lua_State* L) {
+	size_t l;
+	const char* name = luaL_checklstring(L, 1, &l);
+	unsigned id = graph_find(name, l, true);
+	sched_grow();
+	lua_pushnumber(L, id);
+	lua_pushstring(L, sched_states[sched_nodes[id - 1].state]);
+	return 2;
+}
 
-	// retrieve the environment
-	char* env = NULL;
-	char env_buffer[32768];
-	if(!lua_isnil(L, 2)) {
-		luaL_checktype(L, 2, LUA_TTABLE);
-		env = env_buffer;
 
-		// loop over the table
-		lua_pushnil(L);
-		while(lua_next(L,2)) {
-			// get the environment variable name
-			const char* name = luaL_checkstring(L,-2);
-			while(*name) *env++ = *name++;
-			*env++ = '=';
-			const char* value = luaL_checkstring(L,-1);
-			while(*value) *env++ = *value++;
-			*env++ = 0;
-			lua_pop(L,1);
-		}
-		*env++ = 0; // double-null terminated
-		env = env_buffer;
-	}
+/*SDOC***********************************************************************
 
-	// Create the child output pipe (inheritable)
-	HANDLE hOutputReadTmp, hOutputWrite;
-	SECURITY_ATTRIBUTES sa = { sizeof(sa) };
-	sa.bInheritHandle = TRUE;
-	if(!MyCreatePipeEx(&hOutputReadTmp, &hOutputWrite, &sa, 0, FILE_FLAG_OVERLAPPED, 0)) // TODO: should buffer size be bigger?
-		luaL_error(L, "error creating pipe");
-	// Duplicate the pipe for stderr; this way, if the child 
-	// process closes one of stdout/stderr, the other still works.
-	HANDLE hErrorWrite;
-  if(!DuplicateHandle(GetCurrentProcess(), hOutputWrite, GetCurrentProcess(), &hErrorWrite, 0, TRUE, DUPLICATE_SAME_ACCESS))
-     luaL_error(L, "error duplicating pipe handle");
-  // Duplicate the output read handle as uninheritable; otherwise
-  // the child inherits it and a non-closeable handle to the pipe
-  // is created.
-	HANDLE hOutputRead;
-  if(!DuplicateHandle(GetCurrentProcess(), hOutputReadTmp, GetCurrentProcess(), &hOutputRead, 0, FALSE, DUPLICATE_SAME_ACCESS))
-    luaL_error(L, "error duplicating pipe handle");
-  // Close the inheritable copy
-  if(!CloseHandle(hOutputReadTmp)) 
-		luaL_error(L, "error closing pipe handle");
+	Name:			make_sched_name
 
-	// Launch the child process
-	STARTUPINFOW si = { sizeof(si) };
-	si.dwFlags = STARTF_USESTDHANDLES;
-	si.hStdInput = INVALID_HANDLE_VALUE; // no input!
-	si.hStdOutput = hOutputWrite;
-	si.hStdError = hErrorWrite;
-	PROCESS_INFORMATION pi = {};
-	CreateProcessW(NULL, command_line, NULL, NULL, TRUE, 0, (void*)env, NULL, &si, &pi);
-	// Close unnecessary thread handle
-	CloseHandle(pi.hThread);
+	Action:		Returns the target name of a node.
 
-	// Close the pipe handles; we make sure to not maintain any
-	// handles to the write end of the pipes so that the child
-	// can exit properly.
-	if(!CloseHandle(hOutputWrite) || !CloseHandle(hErrorWrite)) 
-		luaL_error(L, "error closing pipe handle");
+	Params:		[1] number - node id
 
-	// Create a new USERDATA to hold the process information
-	lua_newtable(L);
-	process* proc = (process*)lua_newuserdata(L, sizeof(process));
-	memset(proc, 0, sizeof(*proc));
-	proc->hOutputRead = hOutputRead;
-	proc->hProcess = pi.hProcess;
-	proc->olp.hEvent = CreateEvent(NULL, TRUE, TRUE, NULL);
-	lua_setfield(L, -2, "data");
-	return 1;
+	Returns:	[1] string - target name
+						[2] string - node state (see make.sched.node)
+
+***********************************************************************EDOC*/
+static int make_sched_name(lua_State* L) {
+	sched_node& n = lua_checknode(L, 1);
+	lua_pushgraphname(L, (unsigned)lua_tonumber(L, 1));
+	lua_pushstring(L, sched_states[n.state]);
+	return 2;
 }
 
 
 /*SDOC***********************************************************************
 
-	Name:			make_proc_exitcode
+	Name:			make_sched_depend
 
-	Action:		Returns the exit code for a process.
+	Action:		Records that a node depends on another one.
 
-	Params:		[1] table - process table from make.proc.spawn()
+	Params:		[1] number - node id
+						[2] number - id of the node it depends on
 
-	Returns:	[1] number - exit code
-						 or: nil - if the process is still running.
+	Comments:	The node won't be ready until the other one is done.  Edges
+						can only be added to a node until it's ready.  This edge is 
+						only for the schedule; see make.graph.depend for the target's
+						own dependencies.
 
 ***********************************************************************EDOC*/
-static int make_proc_exitcode(lua_State* L) {
-	luaL_checktype(L, 1, LUA_TTABLE);
-	lua_getfield(L, 1, "data");
-	process* p = (process*)lua_touserdata(L,-1);
-	luaL_argcheck(L, p != NULL && lua_objlen(L,-1) == sizeof(process), 1, LUA_QL("process") " expected");
-	if(p->hProcess != INVALID_HANDLE_VALUE)
-		lua_pushnil(L);
-	else
-		lua_pushnumber(L, p->dwExitCode);
-	return 1;
+static int make_sched_depend(lua_State* L) {
+	sched_node& n = lua_checknode(L, 1);
+	lua_checknode(L, 2);
+	if(n.state != SCHED_NEW && n.state != SCHED_WAITING) {
+		size_t l;
+		luaL_error(L, "target '%s' has already been scheduled", graph_name((unsigned)lua_tonumber(L, 1), &l));
+	}
+	sched_depend((unsigned)lua_tonumber(L, 1), (unsigned)lua_tonumber(L, 2));
+	return 0;
 }
 
 
 /*SDOC***********************************************************************
 
-	Name:			make_proc_flushio
+	Name:			make_sched_add
 
-	Action:		Handles the output of a running process.
+	Action:		Adds a new node to the schedule, once its dependencies have 
+						been recorded; it's ready straight away if it has none left.
 
-	Params:		[1] table - process table from make.proc.spawn()
-											- "print" function must be specified
+	Params:		[1] number - node id
 
-	Comments:	Any output the process has written to it's stdout handle is
-						line-buffered, and output via the user-specified "print" 
-						function.
-
-***********************************************************************EDOC*/
-static int make_proc_flushio_helper(lua_State* L, process* p, DWORD dwRead) {
-	p->buffer[dwRead] = 0;
-	char *pos = p->buffer, *line_start = p->buffer;
-	while(dwRead && *pos) {
-		if(*pos == '\r') {
-			// hit the end of a line
-			*pos = 0;
-
-			// get the "print" function from the process table
-			lua_getfield(L, 1, "print");
-			luaL_checktype(L, -1, LUA_TFUNCTION);
-
-			// build a string; use the remaining portion from the 
-			// last read, plus everything up to the CR/LF this time...
-			luaL_Buffer b;
-			luaL_buffinit(L, &b);
-			luaL_addstring(&b, p->leftovers);
-			luaL_addstring(&b, line_start);
-			luaL_pushresult(&b);
-			lua_call(L, 1, 0);
-			// erase the leftovers
-			p->leftovers[0] = 0;
+***********************************************************************EDOC*/
+static int make_sched_add(lua_State* L) {
+	sched_node& n = lua_checknode(L, 1);
+	if(n.state == SCHED_NEW) {
+		n.state = SCHED_WAITING;
+		if(n.pending == 0)
+			sched_push((unsigned)lua_tonumber(L, 1));
+	}
+	return 0;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_sched_add_all
 
-			// Increment our pointers
-			if(pos[1] == '\n') { dwRead--; pos++; }
-			line_start = pos + 1;
+	Action:		Adds a target's node to the schedule, along with the nodes of 
+						everything it depends on (see make.graph.depend) that aren't 
+						there yet.
+
+	Params:		[1] string|number - target name (or node id)
+
+	Returns:	[1] table - array of the ids of the nodes that were added
+
+***********************************************************************EDOC*/
+static int make_sched_add_all(lua_State* L) {
+	unsigned goal = lua_checkgraphnode(L, 1, true);
+	graph_compact();
+	sched_grow();
+	lua_newtable(L);
+	int added = 0;
+	std::vector<unsigned> stack(1, goal);
+	while(!stack.empty()) {
+		unsigned id = stack.back();
+		stack.pop_back();
+		if(sched_nodes[id - 1].state != SCHED_NEW)
+			continue;
+		for(unsigned i=graph_start[id - 1]; i<graph_start[id]; i++) {
+			unsigned dep = graph_edges[i];
+			sched_depend(id, dep);
+			if(sched_nodes[dep - 1].state == SCHED_NEW)
+				stack.push_back(dep);
 		}
-		dwRead--; pos++;
+		sched_nodes[id - 1].state = SCHED_WAITING;
+		if(sched_nodes[id - 1].pending == 0)
+			sched_push(id);
+		lua_pushnumber(L, id);
+		lua_rawseti(L, -2, ++added);
 	}
+	return 1;
+}
+
 
-	// we have some leftover data; copy it to the process buffer
-	// to be written next time
-	if(line_start != pos)
-		strcat(p->leftovers, line_start); // bug waiting to happen
+/*SDOC***********************************************************************
+
+	Name:			make_sched_next
+
+	Action:		Takes the next node off the ready queue.
+
+	Returns:	[1] number - node id
+						 or: nil - if nothing is ready
+
+***********************************************************************EDOC*/
+static int make_sched_next(lua_State* L) {
+	if(sched_ready.empty())
+		return 0;
+	std::pop_heap(sched_ready.begin(), sched_ready.end(), sched_before);
+	unsigned id = sched_ready.back();
+	sched_ready.pop_back();
+	sched_nodes[id - 1].state = SCHED_STARTED;
+	lua_pushnumber(L, id);
+	return 1;
+}
 
+
+/*SDOC***********************************************************************
+
+	Name:			make_sched_requeue
+
+	Action:		Puts a node that couldn't be started yet back on the ready 
+						queue, in the same place.
+
+	Params:		[1] number - node id (from make.sched.next)
+
+***********************************************************************EDOC*/
+static int make_sched_requeue(lua_State* L) {
+	sched_node& n = lua_checknode(L, 1);
+	if(n.state == SCHED_STARTED)
+		sched_push((unsigned)lua_tonumber(L, 1), n.seq);
 	return 0;
 }
 
-static int make_proc_flushio(lua_State* L) {
-	luaL_checktype(L, 1, LUA_TTABLE);
-	lua_getfield(L, 1, "data");
-	process* p = (process*)lua_touserdata(L,-1);
-	luaL_argcheck(L, p != NULL && lua_objlen(L,-1) == sizeof(process), 1, LUA_QL("process") " expected");
-	if(p->hProcess == INVALID_HANDLE_VALUE)
-		return 0; // process is already done!
 
-	DWORD dwRead;
-	if(p->bWaiting) {
-		if(!GetOverlappedResult(p->hOutputRead, &p->olp, &dwRead, FALSE)) {
-			goto error;
-		} else {
-			// yay! we got data
-			make_proc_flushio_helper(L, p, dwRead);
-		}
-		p->bWaiting = false;
-	}
+/*SDOC***********************************************************************
 
-	// try to read some more data
-	while(ReadFile(p->hOutputRead, p->buffer, sizeof(p->buffer)-1, &dwRead, &p->olp)) {
-		// we got data right away
-		make_proc_flushio_helper(L, p, dwRead);
-		p->bWaiting = false;
+	Name:			make_sched_done
+
+	Action:		Marks a node as done (whether it succeeded or not); any node
+						that was only waiting on it becomes ready.
+
+	Params:		[1] number - node id
+
+***********************************************************************EDOC*/
+static int make_sched_done(lua_State* L) {
+	sched_node& n = lua_checknode(L, 1);
+	if(n.state == SCHED_DONE)
+		return 0;
+	n.state = SCHED_DONE;
+	std::vector<unsigned> dependents;
+	dependents.swap(n.dependents); // (we're done with them)
+	for(size_t i=0; i<dependents.size(); i++) {
+		sched_node& d = sched_nodes[dependents[i] - 1];
+		if(--d.pending == 0 && d.state == SCHED_WAITING)
+			sched_push(dependents[i]);
 	}
+	return 0;
+}
 
-error:
-	DWORD dwError = GetLastError();
-	switch(dwError) {
-		case ERROR_BROKEN_PIPE:	{
-			// this is the normal exit path; close our handles and exit
-			WaitForSingleObject(p->hProcess, INFINITE); // should already be done
-			GetExitCodeProcess(p->hProcess, &p->dwExitCode);
-			CloseHandle(p->hOutputRead);
-			CloseHandle(p->hProcess);
-			CloseHandle(p->olp.hEvent);
-			p->hProcess = INVALID_HANDLE_VALUE;
-			p->bWaiting = false;
-			// write any leftover data
-			if(p->leftovers[0]) {
-				p->buffer[0] = '\r';
-				p->buffer[1] = 0;
-				make_proc_flushio_helper(L, p, 1);
+
+/*SDOC***********************************************************************
+
+	Name:			make_sched_cost
+
+	Action:		Sets (or gets) the time a node is expected to take.
+
+	Params:		[1] number - node id
+						[2] number - seconds (optional)
+
+	Returns:	[1] number - the node's cost
+						[2] number - its priority (see make.sched.prioritize)
+
+***********************************************************************EDOC*/
+static int make_sched_cost(lua_State* L) {
+	sched_node& n = lua_checknode(L, 1);
+	if(!lua_isnoneornil(L, 2))
+		n.cost = luaL_checknumber(L, 2);
+	lua_pushnumber(L, n.cost);
+	lua_pushnumber(L, n.priority);
+	return 2;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_sched_prioritize
+
+	Action:		Works out every node's priority, from the costs, and reorders
+						the ready queue to match.
+
+	Returns:	[1] number - the length of the longest (critical) path, in 
+									seconds
+						[2] table - the names of the nodes on it, in build order
+
+	Comments:	A node's priority is its own cost, plus the largest priority
+						of the nodes that depend on it; i.e., the length of the 
+						longest path from it to the end of the build.  Call this once
+						the goals have been added; nodes added later get a priority
+						from the dependents they have when they're ready.
+
+***********************************************************************EDOC*/
+static int make_sched_prioritize(lua_State* L) {
+	// visit each node after all its dependents (depth-first, without 
+	// recursion, since the graph can be deep)
+	sched_grow();
+	std::vector<char> visited(sched_nodes.size(), 0);
+	std::vector<std::pair<unsigned, size_t> > stack;
+	for(unsigned root=1; root<=sched_nodes.size(); root++) {
+		if(visited[root - 1])
+			continue;
+		visited[root - 1] = 1;
+		stack.push_back(std::make_pair(root, (size_t)0));
+		while(!stack.empty()) {
+			sched_node& n = sched_nodes[stack.back().first - 1];
+			size_t& next = stack.back().second;
+			if(next < n.dependents.size()) {
+				unsigned d = n.dependents[next++];
+				if(!visited[d - 1]) {
+					visited[d - 1] = 1; // (a cycle just ends the path)
+					stack.push_back(std::make_pair(d, (size_t)0));
+				}
+				continue;
 			}
-			break;
-		}
-		case ERROR_IO_INCOMPLETE:
-		case ERROR_IO_PENDING: {
-			// This is normal; there currently isn't any data to read, so 
-			// we'll come back and try again later
-			p->bWaiting = true;
-			break;
+			n.priority = n.state == SCHED_DONE ? 0 : sched_priority(n);
+			stack.pop_back();
 		}
-		default: {
-			char str[MAX_PATH];
-			FormatMessageA(FORMAT_MESSAGE_FROM_SYSTEM,0,dwError,0,str,sizeof(str),NULL);
-			luaL_error(L, "error reading from pipe: %d, %s", dwError, str);
-			break;
+	}
+	std::make_heap(sched_ready.begin(), sched_ready.end(), sched_before);
+
+	// the critical path starts with the highest priority, and follows the
+	// dependent with the highest priority from there
+	lua_newtable(L);
+	unsigned id = 0;
+	for(unsigned i=1; i<=sched_nodes.size(); i++) {
+		int state = sched_nodes[i - 1].state;
+		if(state != SCHED_NEW && state != SCHED_DONE && (!id || sched_nodes[i - 1].priority > sched_nodes[id - 1].priority))
+			id = i;
+	}
+	double length = id ? sched_nodes[id - 1].priority : 0;
+	for(int i=1; id && i<=(int)sched_nodes.size(); i++) {
+		sched_node& n = sched_nodes[id - 1];
+		lua_pushgraphname(L, id);
+		lua_rawseti(L, -2, i);
+		id = 0;
+		for(size_t j=0; j<n.dependents.size(); j++) {
+			unsigned d = n.dependents[j];
+			if(!id || sched_nodes[d - 1].priority > sched_nodes[id - 1].priority)
+				id = d;
 		}
 	}
-	return 0;
+	lua_pushnumber(L, length);
+	lua_insert(L, -2);
+	return 2;
 }
 
 
 /*SDOC***********************************************************************
 
-	Name:			make_proc_wait
-
-	Action:		Waits for a change in state in one or more processes.
+	Name:			make_sched_queued
 
-	Params:		[1] table - array of process tables from make.proc.spawn()
+	Action:		Returns the number of nodes on the ready queue.
 
-	Comments:	Will not return until one of the specified processes has either
-						finished, or has written more output to stdout.
+	Returns:	[1] number
 
 ***********************************************************************EDOC*/
-static int make_proc_wait(lua_State* L) {
-	luaL_checktype(L, 1, LUA_TTABLE);
+static int make_sched_queued(lua_State* L) {
+	lua_pushnumber(L, (lua_Number)sched_ready.size());
+	return 1;
+}
 
-	// loop over the input array and accumulate handles
-	std::vector<HANDLE> handles;
-	int pos = 1;
-	while(1) {
-		lua_pushnumber(L,pos++);
-		lua_gettable(L,1);
-		if(lua_isnil(L,-1)) 
-			break;
-		luaL_checktype(L, -1, LUA_TTABLE);
 
-		// Get the process data
-		lua_getfield(L, -1, "data");
-		process* p = (process*)lua_touserdata(L,-1);
-		if(p == NULL || lua_objlen(L,-1) != sizeof(process))
-			luaL_error(L, LUA_QL("process") " expected");
+/*SDOC***********************************************************************
 
-		handles.push_back(p->hProcess);
-		if(p->olp.hEvent != INVALID_HANDLE_VALUE)
-			handles.push_back(p->olp.hEvent);
+	Name:			make_sched_reset
 
-		lua_pop(L,1);
-	}
+	Action:		Takes every node off the schedule (the graph store keeps them).
 
-	// Wait for one of the handles to be signalled
-	WaitForMultipleObjects(handles.size(), &handles[0], FALSE, INFINITE);
+***********************************************************************EDOC*/
+static int make_sched_reset(lua_State* /*L*/) {
+	sched_nodes.clear();
+	sched_ready.clear();
+	sched_seq = 0;
 	return 0;
 }
 
-static const luaL_Reg make_proclib[] = {
-	{"spawn", make_proc_spawn},									// make.proc.spawn
-	{"flushio", make_proc_flushio},							// make.proc.flushio
-	{"wait", make_proc_wait},										// make.proc.wait
-	{"exit_code", make_proc_exitcode},					// make.proc.exit_code
+static const luaL_Reg make_schedlib[] = {
+	{"node", make_sched_node},									// make.sched.node
+	{"name", make_sched_name},									// make.sched.name
+	{"depend", make_sched_depend},							// make.sched.depend
+	{"add", make_sched_add},										// make.sched.add
+	{"add_all", make_sched_add_all},						// make.sched.add_all
+	{"next", make_sched_next},									// make.sched.next
+	{"requeue", make_sched_requeue},						// make.sched.requeue
+	{"done", make_sched_done},									// make.sched.done
+	{"cost", make_sched_cost},									// make.sched.cost
+	{"prioritize", make_sched_prioritize},			// make.sched.prioritize
+	{"queued", make_sched_queued},							// make.sched.queued
+	{"reset", make_sched_reset},								// make.sched.reset
   {NULL, NULL}
 };
 
@@ -1295,12 +5653,18 @@ static const luaL_Reg make_proclib[] = {
 
 ***********************************************************************EDOC*/
 static int make_now(lua_State* L) {
+#ifdef _WIN32
 	SYSTEMTIME st;
 	GetSystemTime(&st);
 	FILETIME ft;
 	SystemTimeToFileTime(&st,&ft);
 	__int64 time = ((__int64)ft.dwLowDateTime | (((__int64)ft.dwHighDateTime)<<32)) - start_time;
 	lua_pushnumber(L,(double)time * 1.0e-7);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	lua_pushnumber(L, presto_time(ts));
+#endif
 	return 1;
 }
 
@@ -1351,6 +5715,7 @@ static int make_md5(lua_State* L) {
 ***********************************************************************EDOC*/
 static int make_message_helper(lua_State* L, int color) {
 	const char* string = luaL_checkstring(L, 1);
+#ifdef _WIN32
 	HANDLE hstdout = GetStdHandle(STD_OUTPUT_HANDLE);
   CONSOLE_SCREEN_BUFFER_INFO sbi = {};
   GetConsoleScreenBufferInfo(hstdout, &sbi);												// Get original color
@@ -1359,6 +5724,22 @@ static int make_message_helper(lua_State* L, int color) {
   SetConsoleTextAttribute(hstdout, sbi.wAttributes);								// Restore original color
 	fputs(string, stderr);																						// Echo the string
 	fputs("\n", stderr);
+#else
+	// One write, so the message stays in order with the job output
+	std::string message;
+	if(isatty(fileno(stderr))) {
+		// Map the console attribute to the equivalent ANSI color
+		char header[32];
+		sprintf(header, "\033[1;%dmpresto: *** \033[0m", 
+			color == 0x0a ? 32 : color == 0x0b ? 36 : color == 0x0c ? 31 : 33);
+		message = header;
+	} else {
+		message = "presto: *** ";
+	}
+	message += string;
+	message += '\n';
+	output_write(2, message.data(), message.size());
+#endif
 	return 0;
 }
 static int make_message(lua_State* L) { 
@@ -1374,6 +5755,32 @@ static int make_success(lua_State* L) {
 	return make_message_helper(L, 0x0a); // green
 }
 
+
+
+/*SDOC***********************************************************************
+
+	Name:			make_write
+
+	Action:		Writes a string to stdout (or stderr)
+
+	Params:		[1] string - string to write
+						[2] string - "stderr" (optional)
+
+	Comments:	On POSIX systems the writing is done by the reactor thread, so
+						a slow terminal doesn't hold up the build; everything written
+						this way (and by make.message() etc.) comes out in order.
+
+***********************************************************************EDOC*/
+static int make_write(lua_State* L) {
+	size_t len;
+	const char* data = luaL_checklstring(L, 1, &len);
+	const char* stream = luaL_optstring(L, 2, "stdout");
+	if(strcmp(stream, "stdout") != 0 && strcmp(stream, "stderr") != 0)
+		luaL_argerror(L, 2, "expected " LUA_QL("stdout") " or " LUA_QL("stderr"));
+	output_write(stream[3] == 'e' ? 2 : 1, data, len);
+	return 0;
+}
+
 static const luaL_Reg make_rootlib[] = {
 	{"now", make_now},							// make.now
 	{"md5", make_md5},							// make.md5
@@ -1381,6 +5788,8 @@ static const luaL_Reg make_rootlib[] = {
 	{"error", make_error},					// make.error
 	{"warning", make_warning},			// make.warning
 	{"success", make_success},			// make.success
+	{"write", make_write},					// make.write
+	{"env_block", make_env_block},	// make.env_block
   {NULL, NULL}
 };
 
@@ -1389,15 +5798,38 @@ static const luaL_Reg make_rootlib[] = {
 //****************************  misc functions  *****************************
 //***************************************************************************
 
+/*SDOC***********************************************************************
+
+	Name:			make_dofile
+
+	Action:		Replaces the standard "dofile"; runs the file, then lets a 
+						pipelined build start whatever the file completed (see 
+						make.seal in mkinit.lua).
+
+	Params:		[1] string - file name
+
+	Returns:	whatever the file returned
+
+***********************************************************************EDOC*/
 LUALIB_API int make_dofile(lua_State* L) {
-	fprintf(stderr, "1\n");
+	lua_settop(L, 1);
 	lua_pushvalue(L, lua_upvalueindex(1));	// original "dofile"
 	lua_pushvalue(L, 1);										// filename
-	int n = lua_gettop(L);
 	lua_call(L, 1, LUA_MULTRET);
-	int n2 = lua_gettop(L);
-
-	return 0;
+	int results = lua_gettop(L) - 1;
+
+	// call: make.pipeline.pump()
+	lua_getglobal(L, LUA_MAKELIBNAME);
+	lua_getfield(L, -1, "pipeline");
+	if(lua_istable(L, -1)) {
+		lua_getfield(L, -1, "pump");
+		if(lua_isfunction(L, -1))
+			lua_call(L, 0, 0);
+		else
+			lua_pop(L, 1);
+	}
+	lua_pop(L, 2); // "make", "pipeline"
+	return results;
 }
 
 
@@ -1414,6 +5846,7 @@ LUALIB_API int make_dofile(lua_State* L) {
 ***********************************************************************EDOC*/
 LUALIB_API int luaopen_make(lua_State* L) {
 
+#ifdef _WIN32
 	// FILETIME is a 64-bit int, representing 100-nanosecond increments since 1/1/1601.
 	// We want our numbers to fit nicely into a double without losing any precision, so
 	// we subtract out the start-time.
@@ -1422,6 +5855,26 @@ LUALIB_API int luaopen_make(lua_State* L) {
 	static FILETIME ft2;
 	SystemTimeToFileTime(&st, &ft2);
 	start_time = (__int64)ft2.dwLowDateTime | (((__int64)ft2.dwHighDateTime)<<32);
+#else
+	// Same idea as the FILETIME case; timestamps are relative to our start-time.
+	// The file system stamps files with the kernel's coarse clock, which can
+	// be a tick behind CLOCK_REALTIME; we start from the same clock, so that
+	// a file written after we started never looks older than that.
+#ifdef CLOCK_REALTIME_COARSE
+	if(clock_gettime(CLOCK_REALTIME_COARSE, &start_time) != 0)
+#endif
+		clock_gettime(CLOCK_REALTIME, &start_time);
+#endif
+
+#ifndef _WIN32
+	// Every running job holds a pipe open; make sure "-j" can go well past
+	// the default soft limit on descriptors.
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+#endif
 
 	// Replace the 'dofile' method with out own version
 	lua_getfield(L, LUA_GLOBALSINDEX, "dofile");
@@ -1433,6 +5886,7 @@ LUALIB_API int luaopen_make(lua_State* L) {
 
 	// Set up environment table (make.env)
 	lua_newtable(L);
+#ifdef _WIN32
 	char keyb[32768], valueb[32768];
 	#undef GetEnvironmentStrings
 	const char* env = GetEnvironmentStrings();
@@ -1449,14 +5903,38 @@ LUALIB_API int luaopen_make(lua_State* L) {
 			lua_settable(L, -3); // make.env[key] = value
 		}
 	}
+#else
+	// POSIX variable names are case-sensitive, so we keep them as-is
+	for(char** env = environ; *env; env++) {
+		const char* equals = strchr(*env, '=');
+		if(equals && equals != *env) {
+			lua_pushlstring(L, *env, equals - *env);
+			lua_pushstring(L, equals+1);
+			lua_settable(L, -3); // make.env[key] = value
+		}
+	}
+#endif
 	lua_setfield(L, -2, "env"); // make.env
 
+	// make.os; lets Lua code make the occasional platform-specific decision
+#ifdef _WIN32
+	lua_pushstring(L, "windows");
+#else
+	lua_pushstring(L, "posix");
+#endif
+	lua_setfield(L, -2, "os");
+
 	// Set up the jobs table (make.jobs)
 	lua_newtable(L);
 	lua_pushnumber(L, 0);	lua_setfield(L, -2, "pos");		// current job number; used for output messages; starts at 0
 	lua_pushnumber(L, 1);	lua_setfield(L, -2, "slots");	// total number of available job slots (-j N); default 1
 	lua_pushnumber(L, 0);	lua_setfield(L, -2, "count");	// current count of running jobs; starts at 0
+	lua_pushnumber(L, 0);	lua_setfield(L, -2, "extra");	// slots taken by jobs' additional processes (see make.run_many)
+	lua_pushnumber(L, 0);	lua_setfield(L, -2, "memory");	// projected memory use of the running jobs, in bytes
 	lua_newtable(L); lua_setfield(L, -2, "running");		// table of running jobs; starts empty
+	lua_newtable(L); lua_setfield(L, -2, "blocked");		// running jobs, keyed by the process they're waiting on
+	lua_newtable(L); lua_setfield(L, -2, "ready");			// running jobs that need to be resumed
+	lua_newtable(L); lua_setfield(L, -2, "usage");			// finished jobs that ran processes (see make.proc.usage)
 	lua_setfield(L, -2, "jobs");
 
 	// Set up make.flags (empty table, all flags default false)
@@ -1475,6 +5953,11 @@ LUALIB_API int luaopen_make(lua_State* L) {
 	luaL_register(L, LUA_MAKELIBNAME ".file", make_filelib);
 	luaL_register(L, LUA_MAKELIBNAME ".dir", make_dirlib);
 	luaL_register(L, LUA_MAKELIBNAME ".proc", make_proclib);
+	luaL_register(L, LUA_MAKELIBNAME ".sync", make_synclib);
+	luaL_register(L, LUA_MAKELIBNAME ".sys", make_syslib);
+	luaL_register(L, LUA_MAKELIBNAME ".jobserver", make_jobserverlib);
+	luaL_register(L, LUA_MAKELIBNAME ".graph", make_graphlib);
+	luaL_register(L, LUA_MAKELIBNAME ".sched", make_schedlib);
 	luaL_register(L, LUA_MAKELIBNAME, make_rootlib);
 
   return 1;
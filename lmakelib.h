@@ -17,5 +17,7 @@
 LUALIB_API int (luaopen_make) (lua_State *L);
 
 extern int make_dir_cd(lua_State *L);
+extern void make_flush_output();
+extern bool make_zygote_start();
 
 #endif // lmakelib_h
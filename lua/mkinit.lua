@@ -3,11 +3,13 @@ if make.flags.warn_on_unused then
 	setmetatable(_G, { __index = function(self,key) error("undefined global variable '"..key.."'",2) end } )
 end
 
--- Handle case-insensitive environment
-setmetatable(make.env, {
-	__index = function(self, key) return rawget(self, string.upper(key)); end,
-	__newindex = function(self, key, value) return rawset(self, string.upper(key), value); end,
-})
+-- Handle case-insensitive environment (POSIX environments are case-sensitive)
+if make.os == "windows" then
+	setmetatable(make.env, {
+		__index = function(self, key) return rawget(self, string.upper(key)); end,
+		__newindex = function(self, key, value) return rawset(self, string.upper(key), value); end,
+	})
+end
 
 -- Status error codes
 make.status = { none = 0, updated = 1, running = 2, error = 3 }
@@ -37,6 +39,33 @@ end
 make.util = {}
 make.util.nil_command = function() end
 
+--[[-------------------------------------------------------------------------
+	Name:		make.util.print_lines
+	Action:	Default output function for processes; writes a chunk of 
+					complete lines (each one terminated with "\n") to stdout.
+-------------------------------------------------------------------------]]--
+make.util.print_lines = make.write
+
+--[[-------------------------------------------------------------------------
+	Name:		print()
+					io.write()
+	Action:	Go through make.write(), so that they stay in order with the
+					job output (which is written by the reactor thread).
+-------------------------------------------------------------------------]]--
+print = function(...)
+	local n = select("#", ...)
+	local t = {...}
+	for i = 1,n do t[i] = tostring(t[i]) end
+	make.write(table.concat(t, "\t", 1, n) .. "\n")
+end
+
+local io_write = io.write
+io.write = function(...)
+	if io.output() ~= io.stdout then return io_write(...); end
+	make.write(table.concat({...}))
+	return io.stdout
+end
+
 
 --[[-------------------------------------------------------------------------
 	Name:		make.util.target_list "class"
@@ -84,30 +113,86 @@ end
 
 --[[-------------------------------------------------------------------------
 	Name:		__target
-	Action:	The "__target" table is the backing-store for "target".
+	Action:	The "__target" table holds the methods of "target" objects; the
+					targets themselves are in "__targets", by name.  Dependencies 
+					are kept in the native graph store (see make.graph), not in the
+					targets; a target's "deps" is a target_list built from the graph
+					each time it's read.  Adding a name to it adds the dependency 
+					(like depends_on), but taking one out only changes that copy;
+					the graph never drops an edge.
 -------------------------------------------------------------------------]]--
 local __target = {}
+local __targets = {}
 local __is_target = {}
 __target[__is_target] = true
+
+-- the metatable of "deps"; it remembers (weakly) whose deps they are, so
+-- that adding to them can add to the graph
+local __deps_owner = setmetatable({}, { __mode = "k" })
+local __deps_mt = {
+	__index = make.util.target_list,
+	__tostring = make.util.target_list_mt.__tostring,
+	__newindex = function(deps, dep_name, value)
+		if value then
+			if type(dep_name) ~= "string" then error("Dependency '"..tostring(dep_name).."' is not a target name.",2) end
+			if string.find(dep_name,"\\",1,true) then error("target name should not contain backslashes",2) end
+			make.graph.depend(__deps_owner[deps], dep_name)
+		end
+		rawset(deps, dep_name, value)
+	end,
+}
+
+-- properties worked out on first use; "deps" is a fresh view each time
 local __target_props = {
-	timestamp = function(self) return self.get_timestamp(self); end,
-	exists = function(self) return self.get_exists(self); end,
+	timestamp = function(self)
+		local value = self.get_timestamp(self)
+		rawset(self, "timestamp", value)
+		return value
+	end,
+	exists = function(self)
+		local value = self.get_exists(self)
+		rawset(self, "exists", value)
+		return value
+	end,
+	deps = function(self)
+		if not self.name then return make.util.target_list:new{}; end
+		local deps = {}
+		for _,dep_name in ipairs(make.graph.deps(self.name)) do deps[dep_name] = true end
+		__deps_owner[deps] = self.name
+		return setmetatable(deps, __deps_mt)
+	end,
 }
-__target.mt = { 
-	__index = function(self,key)
-		if key == "timestamp" then
-			local value = self.get_timestamp(self)
-			rawset(self, key, value)
-			return value
-		elseif key == "exists" then
-			local value = self.get_exists(self)
-			rawset(self, key, value)
-			return value
-		end
-		return rawget(__target, key)
+
+-- Looks a key up in a target's class, and the classes it derives from; the
+-- classes are targets too, but their properties aren't worked out
+local function __target_lookup(self, key, class)
+	while class do
+		local value = rawget(class, key)
+		if value ~= nil then return value; end
+		class = getmetatable(class).class
+	end
+	local value = rawget(__target, key)
+	if value == nil and __target_props[key] then
+		value = __target_props[key](self)
 	end
+	return value
+end
+
+__target.mt = { 
+	__index = function(self,key) return __target_lookup(self, key, nil); end
 }
 
+-- the metatable for instances of each derived class
+local __class_mts = {}
+local function __class_mt(class)
+	local mt = __class_mts[class]
+	if not mt then
+		mt = { class = class, __index = function(self,key) return __target_lookup(self, key, class); end }
+		__class_mts[class] = mt
+	end
+	return mt
+end
+
 
 --[[-------------------------------------------------------------------------
 	Name: 	__target:new()
@@ -115,14 +200,13 @@ __target.mt = {
 -------------------------------------------------------------------------]]--
 function __target:new(t)
 	t = t or {}
-	t.deps = make.util.target_list:new{}
+	t.deps = nil -- (see make.graph)
 	if self == target then
 		-- Base class is a special case
 		setmetatable(t, __target.mt)
 	else
 		-- this forms the basis of all our inheritance
-		self.__index = self
-		setmetatable(t, self)
+		setmetatable(t, __class_mt(self))
 	end
 	if t[1] then target[t[1]] = t; t[1] = nil; end
 	return t
@@ -137,38 +221,35 @@ function __target:depends_on(deps_list)
 		target[self.name] = self; 
 	end
 	for k,v in ipairs(deps_list or {}) do
+		local dep_name
 		-- string is assumed to be the name of a dependency
 		if type(v) == "string" then
-			self:depends_on{target[v]}
+			if string.find(v,"\\",1,true) then error("target name should not contain backslashes",2) end
+			dep_name = v
 
 		-- a target directly used as a dependency
 		elseif type(v) == "table" and v[__is_target] then
 			if not(v.name) then error("Dependency '"..k.."' is unnamed.",2) end
-			if __target[v.name] then __target[v.name]:check_for_cycle(self.name,v.name,1) end
-			self.deps[v.name] = true
+			dep_name = v.name
 
 		-- don't understand this target type
 		else
 			error("Dependency "..k.." is not a valid dependency target.",2)
 		end
+		make.graph.depend(self.name, dep_name)
 	end
 end
 
---[[-------------------------------------------------------------------------
-	Name: 	__target:check_for_cycle()
-	Action:	Traverse the dependency hierarchy and ensure there are no cycles
--------------------------------------------------------------------------]]--
-function __target:check_for_cycle(t, d, i)
-	if self.name == t then error("Cyclical dependency on target '"..t.."' . '"..d.."' . '"..t.."'.",i+2) end
-	for k,v in pairs(self.deps) do target[k]:check_for_cycle(t,d,i+1) end
-end
-
 --[[-------------------------------------------------------------------------
 	Name: 	__target:bring_up_to_date()
-	Action:	Brings a target (and all its dependencies) up to date
+	Action:	Brings a target (and all its dependencies) up to date.  The 
+					scheduler (see make.sched) only calls this once every dependency
+					is done; called directly, it brings the dependencies up to date
+					first.
 -------------------------------------------------------------------------]]--
 function __target:bring_up_to_date()
 	if self.status == make.status.updated or -- already done!
+		 self.status == make.status.none or -- already up to date!
 		 self.status == make.status.running or -- still running!
 		 self.status == make.status.error then -- failed!
 		return self.status
@@ -180,9 +261,9 @@ function __target:bring_up_to_date()
 	local must_wait = false
 
 	-- loop over all dependencies
-	for dep_name in pairs(self.deps) do
-		-- update the dependency
-		local dep = target[dep_name]
+	for _,dep_name in ipairs(make.graph.deps(self.name)) do
+		-- update the dependency (if the scheduler hasn't already)
+		local dep = make.sched.targets[dep_name] or target[dep_name]
 		local ok, dep_status = pcall(dep.bring_up_to_date,dep)
 		if not ok then dep_status = make.status.error; end
 
@@ -198,21 +279,24 @@ function __target:bring_up_to_date()
 				must_build = true; self.deps_newer[dep_name] = true
 			end
 		elseif dep_status == make.status.error then
-			-- ummm...
-			make.error("Error updating target '".. dep.name .."':")
-			if dep.errmsg then make.error(dep.errmsg) end
+			-- ummm... (we can come back here, e.g., after make.jobs.admit 
+			-- turns us away, but each failed dep is only reported once)
+			if not(self.deps_failed) then self.deps_failed = make.util.target_list:new{}; end
+			if not self.deps_failed[dep_name] then
+				make.error("Error updating target '".. dep.name .."':")
+				if dep.errmsg then make.error(dep.errmsg) end
+				self.deps_failed[dep_name] = true
+			end
 			if not make.flags.keep_going then
 				self.status = make.status.error
 				return self.status
 			end
-			-- prune the dep so we don't keep trying (and printing errors)
-			self.deps[dep_name] = nil
 			self.dep_status = make.status.error
 		elseif dep_status == make.status.running then
 			-- dependency is being built
 			must_wait = true
 			-- if job slots are full then break
-			if make.jobs.count >= make.jobs.slots then break; end
+			if make.jobs.full() then break; end
 		else
 			error("Unknown make.status value '".. dep_status .."'.")
 		end
@@ -239,7 +323,8 @@ function __target:bring_up_to_date()
 		end
 
 		if self.command then
-			-- run the update command
+			-- run the update command, once there's enough memory for it
+			if not make.jobs.admit(self) then return make.status.running; end
 			return make.jobs.start(self)
 		elseif not(make.flags.always_make) or not(self.exists) then
 			-- don't know how to build; error
@@ -250,7 +335,8 @@ function __target:bring_up_to_date()
 	end
 
 	-- no update was necessary
-	return make.status.none
+	self.status = make.status.none
+	return self.status
 end
 
 --[[-------------------------------------------------------------------------
@@ -273,8 +359,11 @@ end
 -------------------------------------------------------------------------]]--
 target = {
 	defined = function(self,key)
-		return rawget(__target,key) ~= nil
-	end
+		return key ~= nil and __targets[key] ~= nil
+	end,
+	new = function(self,t)
+		return __target.new(self,t)
+	end,
 }
 setmetatable(target, {
 --[[-------------------------------------------------------------------------
@@ -282,11 +371,13 @@ setmetatable(target, {
 	Action:		Read access to "target" table
 -------------------------------------------------------------------------]]--
 __index = function(self, key)
+	local t = __targets[key]
+	if t then return t; end
 	-- enforce backslash policy
-	if string.match(key,"\\") then error("target name should not contain backslashes",2) end
-	-- if the target doesn't exist yet, return the key; this allows
-	-- undefined targets to be named as dependencies
-	return __target[key] or target:new{name=key}
+	if string.find(key,"\\",1,true) then error("target name should not contain backslashes",2) end
+	-- if the target doesn't exist yet, return a new (unregistered) one; 
+	-- this allows undefined targets to be named as dependencies
+	return target:new{name=key}
 end,
 
 --[[-------------------------------------------------------------------------
@@ -297,8 +388,8 @@ __newindex = function(self, key, value)
 	if type(key) ~= "string" then error("target name '"..tostring(key).."' must be a string",2) end
 	-- enforce backslash policy
 	if string.match(key,"\\") then error("target name '"..tostring(key).."' should not contain backslashes",2) end
-	-- prevent redefining protected members (e.g., "target.new")
-	if __target[key] ~= nil then error("cannot modify protected value (or existing target) '"..tostring(key).."'",2) end
+	-- prevent redefining existing targets
+	if __targets[key] ~= nil then error("cannot modify existing target '"..tostring(key).."'",2) end
 	-- if a function is added as a target, that function is assumed to be the command
 	if type(value) == "function" then self[key] = self:new{ command = value }; return; end
 	-- ensure that everything added to the table is actually a "target" object
@@ -307,69 +398,433 @@ __newindex = function(self, key, value)
 	if __target.__default == nil then __target.__default = value end
 
 	value.name = key
-	__target[key] = value
+	__targets[key] = value
 end,
 })
 
 
 --[[-------------------------------------------------------------------------
-	Name: 	make.jobs.dispatch()
-	Action:	Cycle through and resume all running jobs.
+	Name: 	make.jobs.resume()
+	Action:	Resume one running job, and file it according to what it yielded:
+					a process handle means it is blocked on that process (see
+					make.jobs.blocked); nothing means it has more work to do right
+					away (see make.jobs.ready).
 -------------------------------------------------------------------------]]--
-make.jobs.dispatch = function()
-	while true do
-		local shouldwait = true
-		local waiting = {}
-		local job_count = make.jobs.count
-
-		-- iterate over all the jobs
-		for jobid,job in pairs(make.jobs.running) do
-			-- restart the thread and let it do some work
-			make.jobs.current = job
-			local ok, handle = coroutine.resume(job.co)
-			make.jobs.current = nil
-
-			-- check the job's status
-			if not ok or coroutine.status(job.co) == "dead" then
-				-- job finished (or error); remove from list
-				make.jobs.running[jobid] = nil
-				make.jobs.count = make.jobs.count - 1
-
-				-- update the target's status
-				for target_name in pairs(job.targets) do
-					target[target_name].status = make.status.updated
-					if not ok then
-						target[target_name].status = make.status.error
-						target[target_name].errmsg = handle -- is actually an error message
-					end
-				end
+make.jobs.resume = function(job)
+	-- restart the thread and let it do some work
+	make.jobs.current = job
+	local ok, handle = coroutine.resume(job.co)
+	make.jobs.current = nil
 
-				-- if the job failed, print error message
-				if not ok then
-					local errmsg = ""
-					for target_name in pairs(job.targets) do errmsg = errmsg .. " '" .. target_name .. "'"; end
-					make.error("Error updating target"..errmsg..".")
-					if handle then make.error(handle); end
-					make.exit()
-				end
+	-- check the job's status
+	if not ok or coroutine.status(job.co) == "dead" then
+		-- job finished (or error); remove from list
+		make.jobs.running[job.id] = nil
+		make.jobs.count = make.jobs.count - 1
+		make.jobs.memory = make.jobs.memory - job.memory
+		make.jobs.unplace(job)
+		make.jobs.unpool(job)
+		make.jobserver.balance()
+		if job.output then job.output:flush(); end -- "-O"; the job's output, all at once
+		if job.usage then table.insert(make.jobs.usage, job); end
+
+		-- update the target's status
+		local now = make.now()
+		for target_name in pairs(job.targets) do
+			target[target_name].usage = job.usage
+			target[target_name].finished = now
+			if ok then
+				-- remember what it cost, for next time
+				make.db.learn(target_name, { maxrss = job.usage and job.usage.maxrss, wall = now - job.started })
+			end
+			target[target_name].status = make.status.updated
+			if not ok then
+				target[target_name].status = make.status.error
+				target[target_name].errmsg = handle -- is actually an error message
+			end
+			make.sched.done(make.sched.node(target_name)) -- its dependents may be ready now
+		end
 
-			elseif handle ~= nil then
-				-- job still running, but waiting on an external process
-				job.handle = handle
-				table.insert(waiting, handle)
+		-- if the job failed, print error message
+		if not ok then
+			local errmsg = ""
+			for target_name in pairs(job.targets) do errmsg = errmsg .. " '" .. target_name .. "'"; end
+			make.error("Error updating target"..errmsg..".")
+			if handle then make.error(handle); end
+			make.exit()
+		end
 
-			else
-				-- job has real work to do (i.e., it yielded to us directly)
-				shouldwait = false
-			end
+	elseif handle == make.jobs.waiting then
+		-- job still running; it has filed its own processes (see make.run_many)
+		job.handle = nil
+
+	elseif handle ~= nil then
+		-- job still running, but waiting on an external process
+		job.handle = handle
+		make.jobs.blocked[handle] = job
+
+	else
+		-- job has real work to do (i.e., it yielded to us directly)
+		table.insert(make.jobs.ready, job)
+	end
+end
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.jobs.add_usage()
+	Action:	Adds the resources used by a process (see make.proc.usage) to a 
+					job's totals; the peak RSS is the largest of any of its processes.
+-------------------------------------------------------------------------]]--
+make.jobs.add_usage = function(job, usage)
+	if not job or not usage then return; end
+	local total = job.usage
+	if not total then
+		job.usage = usage
+		return
+	end
+	for _,k in ipairs{"user", "system", "wall", "read_bytes", "write_bytes"} do
+		total[k] = total[k] + usage[k]
+	end
+	total.maxrss = math.max(total.maxrss, usage.maxrss)
+end
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.jobs.memory_cost()
+					make.jobs.admit()
+	Action:	Memory-aware admission control.  A target can declare how much 
+					memory its command needs (e.g., target.mem = "2G", or a number
+					of bytes); otherwise we use the peak RSS from the last time it
+					was built (see make.db), or nothing if it's never been built.
+
+					A job is only started if the projected total for the running
+					jobs fits in the budget: "-M N" megabytes, or by default the 
+					memory that was available when the build started (see 
+					make.sys.meminfo).  When nothing is running, a job is always
+					started, no matter how big it is.  With "-P", a job also has to
+					have somewhere to go (see make.jobs.placeable).  A target in a 
+					pool (see make.pool) also has to wait for room in the pool.
+-------------------------------------------------------------------------]]--
+make.jobs.memory_cost = function(target)
+	local mem = target.mem
+	if type(mem) == "string" then
+		local n, unit = string.match(mem, "^%s*([%d%.]+)%s*([KkMmGg]?)")
+		local scale = { [""] = 1, k = 2^10, m = 2^20, g = 2^30 }
+		mem = n and tonumber(n) * scale[string.lower(unit)]
+	elseif type(mem) ~= "number" then
+		local learned = make.db.targets[target.name]
+		mem = learned and learned.maxrss
+	end
+	return mem or 0
+end
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.jobs.used()
+					make.jobs.full()
+					make.jobs.take_extra()
+					make.jobs.release_extra()
+	Action:	Job slot accounting.  Each running job has a slot; a job that
+					runs several processes at once (see make.run_many) takes an 
+					"extra" slot, and a jobserver token, for each one beyond its 
+					first.
+-------------------------------------------------------------------------]]--
+make.jobs.used = function()
+	return make.jobs.count + make.jobs.extra
+end
+
+make.jobs.full = function()
+	return make.jobs.used() >= make.jobs.slots
+end
+
+make.jobs.take_extra = function(job)
+	-- (a job that hasn't yielded yet isn't counted in make.jobs.count)
+	local used = make.jobs.used() + (make.jobs.running[job.id] and 0 or 1)
+	if used >= make.jobs.slots then return false; end
+	if make.jobserver.mode then
+		if not make.jobserver.acquire() then
+			make.jobserver.starved = true
+			return false
+		end
+		make.jobserver.held = make.jobserver.held + 1
+	end
+	make.jobs.extra = make.jobs.extra + 1
+	return true
+end
+
+make.jobs.release_extra = function()
+	make.jobs.extra = make.jobs.extra - 1
+	make.jobserver.balance()
+end
+
+make.jobs.admit = function(target)
+	if make.jobs.count == 0 then return true; end
+	local pool = make.jobs.pool(target)
+	if pool and pool.count >= pool.depth then
+		make.jobs.pooled = pool -- see make.sched.start_ready
+		return false
+	end
+	if not make.jobs.memory_budget then
+		local meminfo = make.sys.meminfo()
+		make.jobs.memory_budget = make.flags.memory and make.flags.memory * 2^20 or meminfo.available or math.huge
+	end
+	if make.jobs.memory + make.jobs.memory_cost(target) > make.jobs.memory_budget then return false; end
+	if make.flags.pin and not make.jobs.placeable(target) then return false; end
+	return make.jobserver.take()
+end
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.pool()
+					make.jobs.pool()
+					make.jobs.pool_next()
+					make.jobs.unpool()
+	Action:	Job pools, with their own limits on how many of their jobs run at
+					once, within the overall job slots; e.g., for link steps, which
+					need a lot of memory, or test suites that can't share a machine:
+
+						make.pool("link", 2)
+						target["app"].pool = "link"
+
+					A target whose pool is full waits in the pool's line, and the
+					ready targets behind it (in other pools, or none) go ahead of 
+					it.  When one of the pool's jobs finishes, the first in line 
+					goes back to the front of the ready queue.
+-------------------------------------------------------------------------]]--
+make.jobs.pools = {} -- name -> { depth = N, count = running jobs, waiting = node ids }
+
+make.pool = function(name, depth)
+	if type(name) ~= "string" then error("pool name must be a string",2); end
+	if type(depth) ~= "number" or depth < 1 then error("pool '"..name.."' needs a depth of at least 1",2); end
+	local pool = make.jobs.pools[name]
+	if not pool then
+		pool = { name = name, count = 0, waiting = {} }
+		make.jobs.pools[name] = pool
+	end
+	pool.depth = math.floor(depth)
+	return pool
+end
+
+make.jobs.pool = function(target)
+	local name = target.pool
+	if name == nil then return nil; end
+	local pool = make.jobs.pools[name]
+	if not pool then error("target '"..tostring(target.name).."' uses undefined pool '"..tostring(name).."'",0); end
+	return pool
+end
+
+-- hands a pool's room to the next in line (it's still admitted as usual)
+make.jobs.pool_next = function(pool)
+	local id = table.remove(pool.waiting, 1)
+	if id then make.sched.requeue(id); end
+end
+
+make.jobs.unpool = function(job)
+	local pool = job.pool
+	if not pool then return; end
+	pool.count = pool.count - 1
+	job.pool = nil
+	make.jobs.pool_next(pool)
+end
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.jobserver.setup()
+					make.jobserver.take()
+					make.jobserver.balance()
+	Action:	GNU make jobserver support, so that presto and the sub-builds it
+					runs (make, ninja, cargo...) share one set of job slots instead
+					of each assuming it owns the machine.
+
+					If MAKEFLAGS has a --jobserver-auth, we're running under make,
+					and we're a client: every job beyond our first needs a token 
+					from the parent's pool.  Otherwise, with "-j N", we're the 
+					server: we create a pool of N-1 tokens, and put it in MAKEFLAGS
+					for our children; our own jobs draw from the same pool.  (Set
+					make.jobserver.export = false in a makefile to not do that.)
+					On POSIX, the pool is an inherited pipe by default, which any
+					GNU make understands; make.jobserver.style = "fifo" uses a
+					named FIFO instead, which GNU make 4.4 and ninja understand.
+
+					With "-j auto", the pool is sized for the most slots we'll ever
+					use; presto's own jobs still follow the current slot count.
+-------------------------------------------------------------------------]]--
+make.jobserver.held = 0						-- tokens held by our running jobs
+make.jobserver.export = true
+make.jobserver.style = "pipe"			-- or "fifo" (POSIX only)
+make.jobserver.interval = 0.05		-- seconds between checks, while waiting for a token
+
+make.jobserver.setup = function()
+	local makeflags = make.env.MAKEFLAGS or ""
+	local auth
+	for value in string.gmatch(makeflags, "%-%-jobserver%-auth=(%S+)") do auth = value end
+	if not auth then
+		for value in string.gmatch(makeflags, "%-%-jobserver%-fds=(%S+)") do auth = value end
+	end
+
+	if auth then
+		local ok, err = make.jobserver.attach(auth)
+		if not ok then make.warning(err .."; ignoring the jobserver"); return; end
+		make.jobserver.mode = "client"
+		-- the parent's tokens are the limit, unless we were told otherwise
+		if make.jobs.slots == 1 then
+			make.jobs.slots = tonumber(string.match(makeflags, "%-j(%d+)")) or 1024
+		end
+	elseif make.jobserver.export and make.jobs.slots > 1 then
+		local slots = make.jobs.auto and make.jobs.auto.max or make.jobs.slots
+		local auth, err = make.jobserver.create(slots - 1, make.jobserver.style)
+		if not auth then make.warning(err); return; end
+		make.jobserver.mode = "server"
+		makeflags = makeflags .." -j".. slots .." --jobserver-auth=".. auth
+		make.env.MAKEFLAGS = makeflags
+		make.sys.setenv("MAKEFLAGS", makeflags)
+	end
+end
+
+make.jobserver.take = function()
+	if not make.jobserver.mode or make.jobs.count == 0 then return true; end -- our first job is free
+	if make.jobserver.acquire() then
+		make.jobserver.held = make.jobserver.held + 1
+		return true
+	end
+	make.jobserver.starved = true -- see make.jobs.dispatch
+	return false
+end
+
+make.jobserver.balance = function()
+	while make.jobserver.held > math.max(make.jobs.used() - 1, 0) do
+		make.jobserver.release()
+		make.jobserver.held = make.jobserver.held - 1
+	end
+end
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.jobs.summary()
+	Action:	Prints the N most expensive jobs (by CPU time); "-S N"
+-------------------------------------------------------------------------]]--
+make.jobs.summary = function(n)
+	local jobs = {}
+	for _,job in ipairs(make.jobs.usage) do jobs[#jobs+1] = job end
+	if #jobs == 0 then return; end
+	local cpu = function(job) return job.usage.user + job.usage.system end
+	table.sort(jobs, function(a,b) return cpu(a) > cpu(b) end)
+
+	make.message(string.format("%d most expensive targets (of %d):", math.min(n, #jobs), #jobs))
+	make.message("      cpu     user   system     wall   max rss       read      write  target")
+	local mb = function(bytes) return string.format("%8.1fM", bytes / (1024*1024)) end
+	for i = 1,math.min(n, #jobs) do
+		local u = jobs[i].usage
+		local names = {}
+		for target_name in pairs(jobs[i].targets) do names[#names+1] = target_name end
+		make.message(string.format("%8.2fs %7.2fs %7.2fs %7.2fs %s %s %s  %s",
+			cpu(jobs[i]), u.user, u.system, u.wall, mb(u.maxrss), mb(u.read_bytes), mb(u.write_bytes),
+			table.concat(names, " ")))
+	end
+end
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.jobs.auto
+					make.jobs.adjust()
+	Action:	"-j auto"; adjusts make.jobs.slots to the load on the machine.
+					We start with one job per CPU (or per CPU of our cgroup quota),
+					then once per interval, add a slot if all of them are busy and 
+					the machine has headroom, or cut the slots back if it's under
+					pressure.  Pressure comes from the PSI "some" averages (see 
+					make.sys.pressure), or if those aren't available, the load 
+					average.  Every change is recorded in make.jobs.auto.log (and
+					printed with "-d").
+-------------------------------------------------------------------------]]--
+if make.flags.auto_jobs then
+	make.jobs.auto = {
+		interval = 1,						-- seconds between adjustments
+		cpu_pressure = 20,			-- back off when the PSI "some" percentages
+		memory_pressure = 5,		-- go over these limits
+		io_pressure = 40,
+		backoff = 0.75,					-- multiply the slots by this to back off
+		log = {},								-- the changes we've made
+		last = make.now(),
+	}
+	make.jobs.auto.cpus = make.sys.cpu_quota() or make.sys.cpu_count()
+	make.jobs.auto.max = math.max(2, math.ceil(make.jobs.auto.cpus * 2))
+	make.jobs.slots = math.max(1, math.ceil(make.jobs.auto.cpus))
+end
+
+make.jobs.adjust = function()
+	local auto = make.jobs.auto
+	local now = make.now()
+	if now - auto.last < auto.interval then return false; end
+	auto.last = now
+
+	-- take the machine's temperature
+	local load = make.sys.loadavg()
+	local cpu = make.sys.pressure("cpu")
+	local memory = make.sys.pressure("memory")
+	local io = make.sys.pressure("io")
+	local slots, reason = make.jobs.slots
+	if memory and memory.some > auto.memory_pressure then
+		reason = "memory pressure"
+	elseif io and io.some > auto.io_pressure then
+		reason = "io pressure"
+	elseif cpu and cpu.some > auto.cpu_pressure then
+		reason = "cpu pressure"
+	elseif not cpu and load and load > auto.cpus * 2 then
+		reason = "load"
+	end
+
+	if reason then
+		-- back off (multiplicative decrease)
+		slots = math.max(1, math.floor(slots * auto.backoff))
+	elseif make.jobs.used() >= slots and slots < auto.max and (cpu or not load or load < auto.cpus) then
+		-- ramp up (additive increase)
+		slots = slots + 1
+		reason = "headroom"
+	end
+	if slots == make.jobs.slots then return false; end
+
+	local entry = string.format("%.1fs: -j %d -> %d (%s; load %.2f, psi cpu %.1f, memory %.1f, io %.1f)",
+		now, make.jobs.slots, slots, reason, load or 0,
+		cpu and cpu.some or 0, memory and memory.some or 0, io and io.some or 0)
+	table.insert(auto.log, entry)
+	if make.flags.debug then make.message("auto -j: "..entry); end
+	make.jobs.slots = slots
+	return true
+end
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.jobs.dispatch()
+	Action:	Resume running jobs until a job slot opens up.  Only the jobs
+					whose processes changed state (or that yielded to us directly)
+					are resumed, so a wakeup costs O(ready) rather than O(running).
+-------------------------------------------------------------------------]]--
+make.jobs.dispatch = function()
+	while true do
+		local used = make.jobs.used()
+
+		-- resume every job that is ready to go; each one stays on the list
+		-- until it's resumed, since an error makes make.exit() dispatch the
+		-- remaining jobs from in here
+		local ready = make.jobs.ready
+		for _ = 1,#ready do
+			make.jobs.resume(table.remove(ready, 1))
 		end
 
 		-- if we opened up any job slots, exit and let the main loop fill them back up
-		if job_count ~= make.jobs.count and make.jobs.count < make.jobs.slots then break; end -- open slots
-		if job_count == 0 then break; end -- no more running jobs
+		if used ~= make.jobs.used() and not make.jobs.full() then break; end -- open slots
+		if make.jobs.count == 0 then break; end -- no more running jobs
 
 		-- otherwise, wait for some change in job status (output, proc finished, etc.)
-		make.proc.wait(waiting)
+		if #make.jobs.ready == 0 then
+			local auto = make.jobs.auto
+			local timeout = make.jobserver.starved and make.jobserver.interval or (auto and auto.interval)
+			local woken = {} -- (a job can be waiting on several processes)
+			for _,proc in ipairs(make.proc.wait(make.jobs.blocked, timeout)) do
+				local job = make.jobs.blocked[proc]
+				if job then
+					make.jobs.blocked[proc] = nil
+					if not woken[job] then table.insert(make.jobs.ready, job); end
+					woken[job] = true
+				end
+			end
+			-- "-j auto"; if we were given more slots, go fill them up
+			if auto and make.jobs.adjust() and not make.jobs.full() then break; end
+			-- a job is waiting for a jobserver token; go see if one turned up
+			if make.jobserver.starved then make.jobserver.starved = nil; break; end
+		end
 	end
 end
 
@@ -378,53 +833,350 @@ end
 	Action:	Start a job coroutine
 -------------------------------------------------------------------------]]--
 make.jobs.start = function(target)
+	local pool = make.jobs.pool(target)
+
 	-- increment the job number
 	make.jobs.pos = make.jobs.pos + 1
 
 	-- create & start the coroutine
 	local co = coroutine.create(target.command)
-	make.jobs.current = { id = make.jobs.pos, co = co, targets = {} }
+	make.jobs.current = { id = make.jobs.pos, co = co, targets = {}, started = make.now() }
 	make.jobs.current.targets[target.name] = true
+	target.started = make.jobs.current.started
+	if make.flags.fail_fast then make.jobs.current.mtimes = { [target.name] = make.file.time(target.name) or false }; end
+	if make.flags.output_sync then make.jobs.current.output = make.sync.new(); end
+	if make.flags.pin then make.jobs.place(make.jobs.current, target); end
 	local ok, handle = coroutine.resume(co, target)
+	if make.jobs.current.output and (not ok or coroutine.status(co) == "dead") then
+		make.jobs.current.output:flush()
+	end
+	if not ok or coroutine.status(co) == "dead" then make.jobs.unplace(make.jobs.current); end
 	if not ok then
 		-- coroutine threw an error
 		target.status = make.status.error
 		target.errmsg = handle -- is actually an error message
+		target.finished = make.now()
 	elseif coroutine.status(co) ~= "dead" then
 		-- insert the new coroutine into the list of running jobs
 		make.jobs.current.handle = handle
+		make.jobs.current.memory = make.jobs.memory_cost(target)
+		if pool then
+			make.jobs.current.pool = pool
+			pool.count = pool.count + 1
+		end
 		make.jobs.running[make.jobs.pos] = make.jobs.current
 		make.jobs.count = make.jobs.count + 1
+		make.jobs.memory = make.jobs.memory + make.jobs.current.memory
 		target.status = make.status.running -- job is running
+		if handle == make.jobs.waiting then
+			make.jobs.current.handle = nil -- see make.run_many
+		elseif handle ~= nil then
+			make.jobs.blocked[handle] = make.jobs.current
+		else
+			table.insert(make.jobs.ready, make.jobs.current)
+		end
 	else
 		-- job is not running (simple; already finished)
 		target.status = make.status.updated
+		target.finished = make.now()
+		make.db.learn(target.name, { wall = target.finished - target.started })
 	end
+	if pool and target.status ~= make.status.running then make.jobs.pool_next(pool); end -- (it didn't need the room)
 	make.jobs.current = nil
+	make.jobserver.balance() -- if it didn't need its token after all
 	return target.status
 end
 
+--[[-------------------------------------------------------------------------
+	Name: 	make.workers
+	Action:	Pools of persistent worker processes, for tools that spend most
+					of each run starting up.  A command like
+
+						{"protoc", "--cpp_out=gen", "foo.proto", worker = {"protoc-worker"}}
+
+					is sent as a request to a long-lived "protoc-worker" process
+					instead of starting "protoc".  There's one pool per worker 
+					command; it grows as needed, but never keeps more workers than
+					there are job slots.  A worker that dies is restarted, and the
+					request is retried once.
+
+					The protocol runs over the worker's stdin/stdout; each message
+					is a 4-byte big-endian length followed by the data (see 
+					make.proc.send/receive).  A request is the command's arguments
+					(without the program name), each terminated by a NUL; the 
+					response is the exit code in decimal, a "\n", then the output.
+					The worker's stderr goes straight to presto's stderr.  A worker
+					should exit when its stdin is closed.
+-------------------------------------------------------------------------]]--
+make.workers = { pools = {} }
+
+make.workers.run = function(command, env, printfn)
+	-- find the pool for this kind of worker
+	local key = make.proc.command_line(command.worker)
+	local pool = make.workers.pools[key]
+	if not pool then
+		pool = { idle = {}, count = 0 }
+		make.workers.pools[key] = pool
+	end
+
+	-- build the request
+	local request = {}
+	for i = 2,#command do request[#request+1] = tostring(command[i]) .. "\0" end
+	request = table.concat(request)
+
+	for attempt = 1,2 do
+		-- use an idle worker, or start a new one
+		local worker = table.remove(pool.idle)
+		if not worker then
+			worker = make.proc.spawn(command.worker, env, { stdin = true, stderr = "inherit", framed = true })
+			pool.count = pool.count + 1
+		end
+
+		-- send the request, and wait for the response
+		local sent = make.proc.send(worker, request)
+		local response = make.proc.receive(worker)
+		while response == nil and make.proc.exit_code(worker) == nil do
+			coroutine.yield(worker) -- the dispatcher will "wait" on the worker
+			response = make.proc.receive(worker)
+		end
+
+		if sent and response then
+			-- return the worker to the pool (unless we've got more than we need)
+			if pool.count > make.jobs.slots then
+				make.proc.send(worker) -- close stdin; the worker exits
+				pool.count = pool.count - 1
+			else
+				table.insert(pool.idle, worker)
+			end
+
+			local exit_code, output = response:match("^(%-?%d+)\n(.*)$")
+			if not exit_code then error("[".. key .."] bad worker response",0); end
+			if output ~= "" then
+				if output:sub(-1) ~= "\n" then output = output .. "\n"; end
+				if printfn then
+					for line in output:gmatch("([^\n]*)\n") do printfn(line) end
+				else
+					make.util.print_lines(output)
+				end
+			end
+			return tonumber(exit_code)
+		end
+
+		-- the worker died; drop it, and try again with a new one
+		pool.count = pool.count - 1
+		make.warning("worker [".. key .."] exited with code "..tostring(make.proc.exit_code(worker)))
+	end
+	error("[".. key .."] worker failed",0)
+end
+
 --[[-------------------------------------------------------------------------
 	Name: 	make.run()
-	Action:	Run an external program (within a job coroutine!)
--------------------------------------------------------------------------]]--
-make.run = function(command, env, printfn)
-	-- spawn a new process
-	printfn = printfn or print
-	if make.flags.noisy then printfn(command); end
-	local proc = make.proc.spawn(command, env)
-	proc.print = printfn
-	-- pipe all output until the process exits
+	Action:	Run an external program (within a job coroutine!)  The 
+					options can send its output somewhere other than presto's 
+					stdout; e.g., {stdout = "test.log", stderr = "test.log"}, or
+					{stdout = {"gen.log", tee = true}} (see make.proc.spawn).
+-------------------------------------------------------------------------]]--
+make.run = function(command, env, printfn, options)
+	-- an argv table (e.g., {"cc", "-c", "foo.c"}) is run directly, 
+	-- without a shell
+	local command_line = make.proc.command_line(command)
+	if make.flags.noisy then (printfn or print)(command_line); end
+	local exit_code
+	if type(command) == "table" and command.worker and not options then
+		-- route the request to a persistent worker
+		exit_code = make.workers.run(command, env, printfn)
+	else
+		-- spawn a new process
+		local proc = make.proc.spawn(command, env, make.jobs.spawn_options(options))
+		if printfn then
+			proc.print = printfn
+		else
+			proc.print_lines = make.util.print_lines -- one call per chunk of output
+		end
+		-- pipe all output until the process exits
+		exit_code = make.proc.exit_code(proc)
+		while exit_code == nil do
+			coroutine.yield(proc) -- we yield the proc handle, which the dispatcher will "wait" on
+			make.proc.flushio(proc)
+			exit_code = make.proc.exit_code(proc)
+		end
+		make.jobs.add_usage(make.jobs.current, make.proc.usage(proc))
+	end
+	-- throw error if command failed
+	if exit_code ~= 0 then
+		error("[".. command_line .."] Error "..tostring(exit_code),0)
+	end
+end
+
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.run_many()
+	Action:	Run several external programs at once (within a job coroutine!),
+					and wait for them all to finish.  They share the job slots with
+					everything else: the job's own slot, plus any that are free 
+					(see make.jobs.take_extra), so there's always at least one 
+					running.  Returns an array of exit codes and an array of the
+					collected output (stdout and stderr), in the same order as the
+					commands; a failed command doesn't raise an error, but one that
+					can't be started does (after the rest of the batch has been 
+					killed; see make.jobs.stop).  The options are:
+						env = table					-- environment, as for make.run()
+						max = N							-- run no more than N at once
+						spawn = table				-- options for make.proc.spawn()
+
+						local codes, output = make.run_many({
+							{"rc", "/fo", "en.res", "en.rc"},
+							{"rc", "/fo", "fr.res", "fr.rc"},
+						})
+-------------------------------------------------------------------------]]--
+make.jobs.waiting = {} -- yielded by a job that filed its own processes in make.jobs.blocked
+
+make.run_many = function(commands, options)
+	options = options or {}
+	local job = make.jobs.current
+	if not job then error("make.run_many() must be called from a job",2); end
+	local max = options.max or math.huge
+	local spawn_options = make.jobs.spawn_options(options.spawn)
+	local codes, outputs = {}, {}
+	local running = {} -- proc -> index
+	local active, extra, pos = 0, 0, 1
+
+	while pos <= #commands or active > 0 do
+		-- start as many as we have slots for
+		while pos <= #commands and active < max do
+			if active > 0 then
+				if not make.jobs.take_extra(job) then break; end
+				extra = extra + 1
+			end
+			local command = commands[pos]
+			if make.flags.noisy then print(make.proc.command_line(command)); end
+			local ok, proc = pcall(make.proc.spawn, command, options.env, spawn_options)
+			if not ok then
+				-- stop the rest of the batch, and give back all of its slots
+				local procs = {}
+				for p in pairs(running) do
+					make.jobs.blocked[p] = nil
+					procs[p] = job
+				end
+				make.jobs.stop(procs)
+				for i=1,extra do make.jobs.release_extra() end
+				error(proc,0)
+			end
+			local lines = {}
+			proc.print_lines = function(s) lines[#lines+1] = s end
+			proc.lines = lines
+			running[proc] = pos
+			active = active + 1
+			pos = pos + 1
+		end
+
+		-- wait for any of them to change
+		for proc in pairs(running) do make.jobs.blocked[proc] = job end
+		coroutine.yield(make.jobs.waiting)
+		for proc in pairs(running) do make.jobs.blocked[proc] = nil end
+
+		-- collect the ones that have finished, and give back their slots
+		for proc,i in pairs(running) do
+			make.proc.flushio(proc)
+			local exit_code = make.proc.exit_code(proc)
+			if exit_code then
+				running[proc] = nil
+				active = active - 1
+				codes[i] = exit_code
+				outputs[i] = table.concat(proc.lines)
+				make.jobs.add_usage(job, make.proc.usage(proc))
+			end
+		end
+		while extra > 0 and extra >= active do
+			extra = extra - 1
+			make.jobs.release_extra()
+		end
+	end
+	return codes, outputs
+end
+
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.capture()
+	Action:	Run an external program, and return its stdout as a string (in
+					lines ending in "\n"; see make.proc.flushio).  Its stderr still
+					goes to ours, and it's an error if it fails.  It
+					can be called from a job coroutine, or while the makefiles are
+					loading, which is where configure-style probes usually go:
+
+						local cflags = make.capture("pkg-config --cflags gtk+-3.0", {cache = true})
+
+					The options are:
+						env = table					-- environment, as for make.run()
+						cache = true				-- remember the output (in make.db.captures)
+						vars = {names}			-- environment variables the output depends
+																-- on; default {"PATH"}
+
+					A cached output is used until the command line, one of the 
+					variables, or the program (as found on the PATH) changes; the 
+					program is the first word of a command line.
+-------------------------------------------------------------------------]]--
+make.util.which = function(program, path)
+	if string.find(program, "[/\\]") then return make.file.stamp(program) and program or nil; end
+	local windows = make.os == "windows"
+	for dir in string.gmatch(path or "", windows and "[^;]+" or "[^:]+") do
+		for _,ext in ipairs(windows and { "", ".exe", ".com", ".bat", ".cmd" } or { "" }) do
+			local candidate = dir .. "/" .. program .. ext
+			if make.file.stamp(candidate) then return candidate; end
+		end
+	end
+end
+
+local function env_value(env, name)
+	if env == nil then return make.env[name]; end
+	if type(env) == "table" then return env[name]; end
+	return env:get(name) -- see make.env_block
+end
+
+local function capture_key(command, command_line, options)
+	local program = type(command) == "table" and tostring(command[1])
+			or string.match(command, '^%s*"([^"]+)"') or string.match(command, "^%s*(%S+)") or ""
+	local path = make.util.which(program, env_value(options.env, "PATH"))
+	local parts = { command_line, path or "", path and make.file.stamp(path) or "" }
+	local vars = {}
+	for _,name in ipairs(options.vars or { "PATH" }) do vars[#vars+1] = name end
+	table.sort(vars)
+	for _,name in ipairs(vars) do parts[#parts+1] = name .. "=" .. (env_value(options.env, name) or "") end
+	return make.md5(table.concat(parts, "\0"))
+end
+
+make.capture = function(command, options)
+	options = options or {}
+	local command_line = make.proc.command_line(command)
+	local key = options.cache and capture_key(command, command_line, options)
+	local cached = key and make.db.captures[key]
+	if cached then return cached.output; end
+
+	if make.flags.noisy then print(command_line); end
+	local proc = make.proc.spawn(command, options.env, make.jobs.spawn_options({ stderr = "inherit" }))
+	local output = {}
+	proc.print_lines = function(s) output[#output+1] = s end
 	local exit_code = make.proc.exit_code(proc)
 	while exit_code == nil do
-		coroutine.yield(proc) -- we yield the proc handle, which the dispatcher will "wait" on
+		if make.jobs.current then
+			coroutine.yield(proc) -- as in make.run()
+		else
+			make.proc.wait({ [proc] = true }) -- no scheduler yet; just wait
+		end
 		make.proc.flushio(proc)
 		exit_code = make.proc.exit_code(proc)
 	end
-	-- throw error if command failed
+	make.jobs.add_usage(make.jobs.current, make.proc.usage(proc))
 	if exit_code ~= 0 then
-		error("[".. command .."] Error "..tostring(exit_code),0)
+		error("[".. command_line .."] Error "..tostring(exit_code),0)
 	end
+
+	output = table.concat(output)
+	if key then
+		make.db.captures[key] = { command = command_line, output = output }
+		make.db.dirty = true
+	end
+	return output
 end
 
 
@@ -441,8 +1193,160 @@ if make.flags.debug then
 			oldprint(p1,...)
 		end
 	end
+	make.util.print_lines = function(lines)
+		for line in lines:gmatch("([^\n]*)\n") do print(line) end
+	end
+end
+
+--[[-------------------------------------------------------------------------
+	Name:		print()
+					make.util.print_lines()
+	Action:	With "-O", anything a job prints goes to the job's output buffer,
+					which is written out in one piece when the job finishes.
+-------------------------------------------------------------------------]]--
+if make.flags.output_sync then
+	local oldprint = print
+	print = function(...)
+		local output = make.jobs.current and make.jobs.current.output
+		if output then
+			local n = select("#", ...)
+			local t = {...}
+			for i = 1,n do t[i] = tostring(t[i]) end
+			output:write(table.concat(t, "\t", 1, n) .. "\n")
+		else
+			oldprint(...)
+		end
+	end
+	local old_print_lines = make.util.print_lines
+	make.util.print_lines = function(lines)
+		local output = make.jobs.current and make.jobs.current.output
+		if output then
+			output:write(lines)
+		else
+			old_print_lines(lines)
+		end
+	end
+end
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.sched.expand()
+					make.sched.start_ready()
+	Action:	The scheduler (see make.sched.node, etc.); it knows which 
+					targets each target is waiting for, and which are waiting for it,
+					so a target is started when its last dependency is done, instead
+					of the whole tree being walked again every time a job finishes.
+
+					make.sched.expand() adds a goal, and everything it depends on;
+					make.sched.start_ready() calls bring_up_to_date() on the ready
+					targets, until the job slots are full.  A target that can't be 
+					started yet (see make.jobs.admit) goes back in line, and waits
+					for a job to finish.
+
+					Ready targets are started critical path first: by the longest
+					chain of work from them to the end of the build, going by how
+					long each target took last time (make.db.targets; see 
+					make.jobs.expected).  "-S" compares the critical path that was
+					predicted with the one the build actually had.
+-------------------------------------------------------------------------]]--
+make.sched.targets = {} -- name -> the target object that was scheduled
+
+make.sched.expand = function(goal)
+	for _,id in ipairs(make.sched.add_all(goal.name)) do
+		local name = make.sched.name(id)
+		local t = name == goal.name and goal or target[name]
+		make.sched.targets[name] = t
+		make.sched.cost(id, make.jobs.expected(t))
+	end
+end
+
+make.sched.start_ready = function()
+	while not make.jobs.full() do
+		local id = make.sched.next()
+		if not id then break; end
+		local t = make.sched.targets[make.sched.name(id)]
+		make.jobs.pooled = nil
+		local ok, status = pcall(t.bring_up_to_date, t)
+		local pool = make.jobs.pooled
+		if not ok then
+			t.errmsg = status
+			t.status = make.status.error
+		elseif status == make.status.running and t.status ~= make.status.running and not pool then
+			-- not admitted; it's first in line once a job finishes
+			make.sched.requeue(id)
+			break
+		end
+		if pool then
+			-- its pool is full; it waits in the pool's line, and the rest go ahead
+			table.insert(pool.waiting, id)
+		elseif t.status ~= make.status.running then
+			t.finished = t.finished or make.now()
+			make.sched.done(id)
+		end
+	end
+end
+
+-- the time a target is expected to take: what it took last time, or if
+-- it's never been built, the average
+make.jobs.expected = function(t)
+	if not t.command then return 0; end -- (a source file)
+	local learned = make.db.targets[t.name]
+	if learned and learned.wall then return learned.wall; end
+	if not make.jobs.typical then
+		local total, n = 0, 0
+		for _,entry in pairs(make.db.targets) do
+			if entry.wall then total, n = total + entry.wall, n + 1; end
+		end
+		make.jobs.typical = n > 0 and total / n or 1
+	end
+	return make.jobs.typical
+end
+
+-- "-S"; prints the predicted critical path, and the actual one: from the 
+-- goal that finished last, back through the dependency that finished last
+make.sched.report = function()
+	local predicted = make.sched.predicted
+	if not predicted or #predicted.path == 0 then return; end
+	local last
+	for _,goal in ipairs(make.sched.goals) do
+		if goal.finished and (not last or goal.finished > last.finished) then last = goal; end
+	end
+	local actual, total = {}, 0
+	while last do
+		table.insert(actual, 1, last)
+		total = total + (last.started and last.finished - last.started or 0)
+		local latest
+		for _,dep_name in ipairs(make.graph.deps(last.name)) do
+			local dep = make.sched.targets[dep_name]
+			if dep and dep.finished and (not latest or dep.finished > latest.finished) then latest = dep; end
+		end
+		last = latest
+	end
+
+	local describe = function(names, seconds)
+		local parts = {}
+		for i,name in ipairs(names) do
+			if #names > 12 and i == 7 then parts[#parts+1] = "... (" .. (#names - 12) .. " more)"; end
+			if #names <= 12 or i <= 6 or i > #names - 6 then
+				parts[#parts+1] = string.format("%s (%.2fs)", name, seconds(name))
+			end
+		end
+		return table.concat(parts, " -> ")
+	end
+	local names = {}
+	for i,t in ipairs(actual) do names[i] = t.name end
+	make.message(string.format("critical path: predicted %.2fs, actual %.2fs (the build took %.2fs)",
+		predicted.length, total, make.now() - make.sched.started))
+	make.message("  predicted: " .. describe(predicted.path, function(name)
+		local id = make.sched.node(name)
+		return (make.sched.cost(id))
+	end))
+	make.message("  actual:    " .. describe(names, function(name)
+		local t = make.sched.targets[name]
+		return t.started and t.finished - t.started or 0
+	end))
 end
 
+
 --[[-------------------------------------------------------------------------
 	Name: 	make.update_goals()
 					make.update_goals_p() -- protected version
@@ -451,14 +1355,24 @@ end
 -------------------------------------------------------------------------]]--
 make.goals = make.util.target_list:new{}
 function make.update_goals()
-	make.delete_on_error = {}
+	if not make.pipeline.started then
+		make.delete_on_error = {}
+		make.jobserver.setup()
+	end
 
 	-- Call update_goals_p() to do the actual work, but catch any errors.
 	local ok,msg = pcall(make.update_goals_p)
+	make.jobserver.balance() -- give back any tokens we're still holding
+	if make.flags.summary then
+		make.jobs.summary(make.flags.summary)
+		make.sched.report()
+	end
+	make.db.save()
 	if not ok then
 		-- Failed; let's try to clean up after ourselves.
+		if make.flags.fail_fast then make.jobs.cancel(); end -- e.g., ^C
 		for filename in pairs(make.delete_on_error) do
-			if make.file.exist(filename) then
+			if make.file.exists(filename) then
 				make.error("Unlinking '"..filename.."'")
 				make.file.delete(filename)
 			end
@@ -474,31 +1388,49 @@ function make.update_goals()
 	end
 end
 
+-- raises the error for a dependency cycle below the goals, if there is one
+local function check_cycles(goal_names)
+	local cycle = make.graph.cycle(unpack(goal_names))
+	if cycle then
+		error("Cyclical dependency on target '"..table.concat(cycle, "' . '").."'.  Stop.",0)
+	end
+end
+
 function make.update_goals_p()
+	-- A job that was started while the makefiles loaded has already failed
+	if make.pipeline.error then error(make.pipeline.error,0); end
+
 	-- Make sure there are some goals to update.
 	if not next(make.goals) then
 		if __target.__default == nil then error("No targets.  Stop.",0); end
-		make.goals[target.__default.name] = true
+		make.goals[__target.__default.name] = true
 	end
 
+	-- Check for cycles, in one pass over everything the goals depend on
+	local goal_names = {}
+	for goal_name in pairs(make.goals) do goal_names[#goal_names+1] = goal_name; end
+	check_cycles(goal_names)
+
+	-- Schedule the goals, and everything they depend on.
+	make.sched.started = make.sched.started or make.now()
+	make.sched.goals = {}
+	for goal_name in pairs(make.goals) do
+		make.sched.expand(target[goal_name])
+		table.insert(make.sched.goals, make.sched.targets[goal_name])
+	end
+	local length, path = make.sched.prioritize()
+	make.sched.predicted = { length = length, path = path }
+
 	-- Loop until all the goals are updated.
 	while true do
-		local job_count = make.jobs.count
-		local goal_count = 0
+		make.sched.start_ready()
 
-		-- loop over all our goals
+		-- report the goals that have finished
 		for goal_name in pairs(make.goals) do
-			goal_count = goal_count + 1
-
-			-- bring the current goal up to date
-			local goal = target[goal_name]
-			local ok,goal_status = pcall(goal.bring_up_to_date,goal)
-			if not ok then
-				goal.errmsg = goal_status
-				goal_status = make.status.error
-			end
+			local goal = make.sched.targets[goal_name]
+			local goal_status = goal.status
 
-			if goal_status ~= make.status.running then
+			if goal_status ~= nil and goal_status ~= make.status.running then
 				if goal_status == make.status.error then
 					-- goal finished with an error
 					if not make.flags.question then
@@ -517,18 +1449,17 @@ function make.update_goals_p()
 				-- done with this target; remove it from the list
 				make.goals[goal_name] = nil
 			end
-
-			-- We've filled up all the job slots; need to wait for them to finish.
-			if make.jobs.count >= make.jobs.slots then break; end
 		end
 
-		-- dispatch any running jobs
-		if make.jobs.count > 0 and (make.jobs.count == job_count or make.jobs.count >= make.jobs.slots) then
+		-- stop if we've run out of goals
+		if not next(make.goals) then break; end
+
+		-- wait for the running jobs (until a job slot opens up)
+		if make.jobs.count > 0 then
 			make.jobs.dispatch()
+		elseif make.sched.queued() == 0 then
+			error("Nothing left to build, but the goals aren't done (dependency cycle?).  Stop.",0)
 		end
-
-		-- stop if we've run out of goals
-		if goal_count == 0 then break; end
 	end
 
 	-- if there were any errors, print a final message and exit
@@ -539,6 +1470,298 @@ function make.update_goals_p()
 end
 
 
+--[[-------------------------------------------------------------------------
+	Name: 	make.seal()
+					make.pipeline.pump()
+	Action:	Pipelined builds (opt-in).  Normally nothing is built until all
+					the makefiles have been loaded.  make.seal(dir) promises that 
+					the targets under a directory are complete: nothing more will
+					be defined there, and the targets that are won't get any more 
+					dependencies.  (make.seal() seals everything.)  The names are 
+					compared as they're written, e.g., make.seal("lib/zlib") covers
+					"lib/zlib/inflate.o" and "lib/zlib/inflate.c".
+
+					Once some targets have been sealed, the build starts while the
+					makefiles are still loading.  Each time a directory is sealed,
+					and each time a makefile run with dofile() finishes, presto
+					starts any target that the goals (or the default goal, once
+					there is one) are known to need, if it and everything it 
+					depends on are sealed.  Sealing is a promise that presto takes
+					on trust; a dependency added to a sealed target afterwards may
+					come too late for a build that has already started.
+
+					A target on a dependency cycle is never closed, and neither is
+					anything that depends on one.  Since edges are never taken away,
+					the cycle is an error however the makefiles go on, so the pump 
+					reports it (as update_goals would) and nothing more is started.
+-------------------------------------------------------------------------]]--
+make.pipeline = {
+	sealed = {},		-- directory -> true
+	closed = {},		-- target name -> true, once it and its dependencies are sealed
+}
+
+make.seal = function(dir)
+	if dir == nil or dir == "" or dir == "." then
+		make.pipeline.everything = true
+	else
+		if type(dir) ~= "string" then error("make.seal() needs a directory name",2); end
+		make.pipeline.sealed[(string.gsub(dir, "/+$", ""))] = true
+	end
+	make.pipeline.pump()
+end
+
+-- is the target's directory (or one above it) sealed?
+local function sealed(name)
+	if make.pipeline.everything then return true; end
+	local pos = string.find(name, "/[^/]*$")
+	while pos do
+		name = string.sub(name, 1, pos - 1)
+		if make.pipeline.sealed[name] then return true; end
+		pos = string.find(name, "/[^/]*$")
+	end
+	return false
+end
+
+-- the targets the goals are known to need that are newly closed; each 
+-- comes after the ones it depends on.  Also returns true if it came 
+-- across a cycle.
+local function newly_closed(goals)
+	local closed, state, found, cyclic = make.pipeline.closed, {}, {}, false
+	local stack = {}
+	local push = function(name)
+		state[name] = "open"
+		stack[#stack+1] = { name = name, deps = make.graph.deps(name), i = 0, ok = sealed(name) }
+	end
+	for _,goal in ipairs(goals) do
+		if not closed[goal] and state[goal] == nil then push(goal); end
+		while #stack > 0 do
+			local frame = stack[#stack]
+			frame.i = frame.i + 1
+			local dep = frame.deps[frame.i]
+			if dep then
+				if not closed[dep] then
+					if state[dep] == nil then
+						push(dep)
+					else
+						frame.ok = false -- (not closed, or part of a cycle)
+						cyclic = cyclic or state[dep] == "open"
+					end
+				end
+			else
+				stack[#stack] = nil
+				state[frame.name] = frame.ok
+				if frame.ok then
+					closed[frame.name] = true
+					found[#found+1] = frame.name
+				elseif #stack > 0 then
+					stack[#stack].ok = false
+				end
+			end
+		end
+	end
+	return found, cyclic
+end
+
+local function pump()
+	local goals = {}
+	for goal_name in pairs(make.goals) do goals[#goals+1] = goal_name; end
+	if #goals == 0 and __target.__default then goals[1] = __target.__default.name; end
+
+	-- schedule the new closed targets; each one brings in what it depends on
+	local found, cyclic = newly_closed(goals)
+	if cyclic then check_cycles(goals); end
+	if #found == 0 and make.jobs.count == 0 then return; end
+	if not make.pipeline.started then
+		make.pipeline.started = true
+		make.delete_on_error = {}
+		make.jobserver.setup()
+		make.sched.started = make.now()
+	end
+	for i = #found,1,-1 do
+		local _, state = make.sched.node(found[i])
+		if state == "new" then make.sched.expand(target[found[i]]); end
+	end
+
+	-- start what's ready, and catch up with the running jobs, without waiting
+	make.sched.start_ready()
+	if make.jobs.count > 0 then
+		for _,proc in ipairs(make.proc.wait(make.jobs.blocked, 0)) do
+			local job = make.jobs.blocked[proc]
+			if job then
+				make.jobs.blocked[proc] = nil
+				table.insert(make.jobs.ready, job)
+			end
+		end
+		local ready = make.jobs.ready
+		for _ = 1,#ready do
+			make.jobs.resume(table.remove(ready, 1))
+		end
+		make.sched.start_ready()
+	end
+end
+
+make.pipeline.pump = function()
+	if not (make.pipeline.everything or next(make.pipeline.sealed)) or make.pipeline.error then return; end
+	local ok, msg = pcall(pump)
+	if not ok then make.pipeline.error = msg; end -- (update_goals reports it)
+end
+
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.jobs.topology()
+					make.jobs.placeable()
+					make.jobs.place()
+					make.jobs.unplace()
+	Action:	"-P"; CPU placement.  Each job is pinned to the CPUs of one NUMA
+					node (see make.sys.topology), so that it isn't moved away from
+					its caches, and the jobs are spread across the nodes: a new job
+					goes to the node with the fewest running.
+
+					A target with whole_node = true (e.g., a big link) gets a node
+					to itself.  The least busy node is reserved for it, no new jobs
+					go there, and it starts once the node's jobs have finished.
+					Jobs that find every node taken wait for one to come free.
+-------------------------------------------------------------------------]]--
+make.jobs.topology = function()
+	if not make.jobs.nodes then
+		make.jobs.nodes = {}
+		for i,node in ipairs(make.sys.topology() or {}) do
+			make.jobs.nodes[i] = { node = node.node, cpus = node.cpus, jobs = 0 }
+		end
+	end
+	return make.jobs.nodes
+end
+
+-- the node with the fewest jobs, that no whole_node target has (or is waiting for)
+local function least_busy_node()
+	local best
+	for _,node in ipairs(make.jobs.topology()) do
+		if not node.owner and not node.reserved and (not best or node.jobs < best.jobs) then best = node end
+	end
+	return best
+end
+
+make.jobs.placeable = function(target)
+	if #make.jobs.topology() == 0 then return true; end -- no topology; nothing to pin to
+	if not target.whole_node then return least_busy_node() ~= nil; end
+	-- one whole_node target at a time waits for a node to drain
+	local node = make.jobs.reserved
+	if not node then
+		node = least_busy_node()
+		if not node then return false; end
+		node.reserved = target
+		make.jobs.reserved = node
+	end
+	return node.reserved == target and node.jobs == 0
+end
+
+make.jobs.place = function(job, target)
+	local node
+	if target.whole_node and make.jobs.reserved and make.jobs.reserved.reserved == target then
+		node = make.jobs.reserved
+		node.reserved, make.jobs.reserved = nil, nil
+	else
+		node = least_busy_node()
+	end
+	if not node then return; end -- (the first job always starts; it runs anywhere)
+	if target.whole_node then node.owner = job; end
+	node.jobs = node.jobs + 1
+	job.node = node
+end
+
+make.jobs.unplace = function(job)
+	local node = job.node
+	if not node then return; end
+	node.jobs = node.jobs - 1
+	if node.owner == job then node.owner = nil; end
+	job.node = nil
+end
+
+
+--[[-------------------------------------------------------------------------
+	Name: 	make.jobs.spawn_options()
+					make.jobs.stop()
+					make.jobs.cancel()
+	Action:	"-x"; fail fast.  Every job's processes are started in a process
+					group of their own, so that on the first error, the jobs that
+					are still running can be killed, children and all: SIGTERM, 
+					then SIGKILL for anything still around make.jobs.grace seconds
+					later.  The jobs' coroutines are abandoned, and if a job's 
+					target has been written to since it started, it's added to 
+					make.delete_on_error.
+
+					make.jobs.stop() does the killing for a set of processes (proc 
+					-> the job it belongs to); make.run_many() uses it too.
+
+					(The spawn options also carry the job's CPUs, with "-P".)
+-------------------------------------------------------------------------]]--
+make.jobs.grace = 5
+
+make.jobs.spawn_options = function(options)
+	local job = make.jobs.current
+	local cpus = job and job.node and job.node.cpus
+	if not make.flags.fail_fast and not cpus then return options; end
+	local t = { group = make.flags.fail_fast and true or nil, cpus = cpus }
+	for k,v in pairs(options or {}) do t[k] = v end
+	return t
+end
+
+make.jobs.stop = function(jobs)
+	-- signal the ones that are still running
+	local current = make.jobs.current
+	local procs = {}
+	for proc,job in pairs(jobs) do
+		make.jobs.current = job
+		make.proc.flushio(proc)
+		if not make.proc.exit_code(proc) then
+			make.proc.kill(proc, "TERM")
+			procs[proc] = true
+		end
+	end
+
+	-- wait for them to go (their output still gets printed)
+	local deadline = make.now() + make.jobs.grace
+	while next(procs) do
+		local remaining = deadline - make.now()
+		if remaining <= 0 then
+			for proc in pairs(procs) do make.proc.kill(proc, "KILL") end
+			deadline = math.huge
+			remaining = nil
+		end
+		for _,proc in ipairs(make.proc.wait(procs, remaining)) do
+			make.jobs.current = jobs[proc]
+			make.proc.flushio(proc)
+			if make.proc.exit_code(proc) then procs[proc] = nil; end
+		end
+	end
+	make.jobs.current = current
+end
+
+make.jobs.cancel = function()
+	if make.jobs.count == 0 then return; end
+
+	-- kill everything the jobs are waiting on
+	make.jobs.stop(make.jobs.blocked)
+
+	-- abandon the jobs
+	for _,job in pairs(make.jobs.running) do
+		make.jobs.unplace(job)
+		make.jobs.unpool(job)
+		if job.output then job.output:flush(); end
+		for target_name in pairs(job.targets) do
+			target[target_name].status = make.status.error
+			local t = make.file.time(target_name)
+			if t and t ~= job.mtimes[target_name] and not make.dir.is_dir(target_name) then
+				make.delete_on_error[target_name] = true
+			end
+		end
+	end
+	make.jobs.running, make.jobs.blocked, make.jobs.ready = {}, {}, {}
+	make.jobs.count, make.jobs.extra, make.jobs.memory = 0, 0, 0
+	make.jobserver.balance()
+end
+
+
 --[[-------------------------------------------------------------------------
 	Name: 	make.exit()
 	Action:	This is a helper called by the code when a target/job has an
@@ -548,7 +1771,10 @@ end
 -------------------------------------------------------------------------]]--
 function make.exit(exit_code)
 	if not make.flags.keep_going then
-		if make.jobs.count > 0 then
+		if make.jobs.count > 0 and make.flags.fail_fast then
+			make.message("Killing other jobs...")
+			make.jobs.cancel()
+		elseif make.jobs.count > 0 then
 			make.message("Waiting for other jobs to finish...")
 			while make.jobs.count > 0 do
 				pcall(make.jobs.dispatch) -- use pcall to suck up errors
@@ -645,3 +1871,103 @@ function make.util.merge_tables(...)
 	end
 end
 
+
+--[[-------------------------------------------------------------------------
+	Name:		make.util.serialize
+	Action:	Converts a value (string, number, boolean, or a table of them)
+					into Lua source code; the inverse of loadstring("return "..s).
+-------------------------------------------------------------------------]]--
+local function serialize(value, indent, out)
+	local t = type(value)
+	if t == "string" then
+		out[#out+1] = string.format("%q", value)
+	elseif t == "number" then
+		if value ~= value then out[#out+1] = "0/0"
+		elseif value == math.huge then out[#out+1] = "1/0"
+		elseif value == -math.huge then out[#out+1] = "-1/0"
+		else out[#out+1] = string.format("%.17g", value) end
+	elseif t == "boolean" then
+		out[#out+1] = tostring(value)
+	elseif t == "table" then
+		-- sort the keys, so the output is stable
+		local keys = {}
+		for k in pairs(value) do keys[#keys+1] = k end
+		table.sort(keys, function(a,b) return tostring(a) < tostring(b) end)
+		-- (the pieces are only joined at the end; building each line as a 
+		-- string of its own is quadratic once there are many similar ones)
+		out[#out+1] = "{\n"
+		for _,k in ipairs(keys) do
+			out[#out+1] = indent .. "\t["
+			serialize(k, "", out)
+			out[#out+1] = "] = "
+			serialize(value[k], indent .. "\t", out)
+			out[#out+1] = ",\n"
+		end
+		out[#out+1] = indent .. "}"
+	else
+		error("cannot serialize a " .. t, 3)
+	end
+end
+function make.util.serialize(value, indent)
+	local out = {}
+	serialize(value, indent or "", out)
+	return table.concat(out)
+end
+
+
+--[[-------------------------------------------------------------------------
+	Name:		make.db
+	Action:	Data that persists from one build to the next, in ".presto.db"
+					in the current directory; e.g., make.db.targets holds what 
+					each target cost to build last time, and make.db.captures the
+					cached output of make.capture().  Every table in make.db is 
+					saved at the end of the build (if make.db.dirty is set).
+-------------------------------------------------------------------------]]--
+make.db = { file = ".presto.db", targets = {}, captures = {} }
+
+function make.db.load()
+	local chunk = loadfile(make.db.file)
+	if not chunk then return; end
+	setfenv(chunk, {}) -- it's just data
+	local ok, data = pcall(chunk)
+	if ok and type(data) == "table" then
+		for k,v in pairs(data) do
+			if type(v) == "table" then make.db[k] = v; end
+		end
+	end
+end
+
+function make.db.save()
+	if not make.db.dirty then return; end
+	local data = {}
+	for k,v in pairs(make.db) do
+		if type(v) == "table" then data[k] = v; end
+	end
+
+	-- write a new file, then swap it in
+	local temp = make.db.file .. ".tmp"
+	local file = io.open(temp, "w")
+	if not file then
+		make.warning("unable to write '" .. make.db.file .. "'")
+		return
+	end
+	file:write("-- presto database; generated automatically\nreturn ", make.util.serialize(data), "\n")
+	file:close()
+	os.remove(make.db.file)
+	os.rename(temp, make.db.file)
+	make.db.dirty = false
+end
+
+-- merges what was measured this build into a target's entry; anything not
+-- measured this time (e.g., maxrss of a job that ran in-process) is kept
+function make.db.learn(name, learned)
+	local entry = make.db.targets[name]
+	if not entry then
+		entry = {}
+		make.db.targets[name] = entry
+	end
+	for k,v in pairs(learned) do entry[k] = v; end
+	make.db.dirty = true
+end
+
+make.db.load()
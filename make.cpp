@@ -52,16 +52,25 @@ static void print_usage(void) {
 	"  -f FILE       Read FILE as a makefile.\n"
 	"  -h            Print this message and exit.\n"
 	"  -j [N]        Allow N jobs at once.\n"
+	"  -j auto       Adjust the number of jobs to the load on the machine.\n"
 	"  -k            Keep going when some targets can't be made.\n"
 	"  -l LIBRARY    Require lua library LIBRARY\n"
+	"  -M N          Limit the memory of concurrent jobs to N megabytes.\n"
 	"  -n            Noisy; echo commands as they run.\n"
+	"  -O            Output-sync; print each job's output when it finishes.\n"
+	"  -P            Pin jobs to CPUs, spreading them across NUMA nodes.\n"
 	"  -q            Run no commands; exit status says if up to date.\n"
 	"  -Q            Just run the lua code and exit.\n"
-	"  -v            Print the version number of make and exit.\n");
+	"  -S [N]        Summarize the N most expensive targets at the end.\n"
+	"  -v            Print the version number of make and exit.\n"
+	"  -x            Fail fast; on the first error, kill the jobs still running.\n"
+	"  -Z            Launch processes from a small helper process (POSIX).\n");
 	fflush(stderr);
 }
 
+#ifdef _WIN32
 static void l_message(const char* msg) {
+	make_flush_output(); // let any queued output go first
 	// Set the foreground color to red
 	HANDLE hstdout = GetStdHandle(STD_OUTPUT_HANDLE);
   CONSOLE_SCREEN_BUFFER_INFO sbi = {};
@@ -88,6 +97,31 @@ static void l_message(const char* msg) {
 	fflush(stderr);
   SetConsoleTextAttribute(hstdout, sbi.wAttributes);
 }
+#else
+static void l_message(const char* msg) {
+	make_flush_output(); // let any queued output go first
+	// Use ANSI escapes for the colors, but only if stderr is a terminal
+	bool color = isatty(fileno(stderr)) != 0;
+	fputs(color ? "\033[1;31mpresto: *** \033[0m" : "presto: *** ", stderr);
+
+	// Print the message line-by-line
+	while(msg && *msg) {
+		// Accumulate the next line
+		const char* next_line = msg;
+		while(*next_line && *next_line++ != '\n') {}
+
+		// If it's the start of the stack, change the color to a dark-grey
+		if(color && strncmp("stack traceback:", msg, 16) == 0)
+			fputs("\033[1;30m", stderr);
+
+		// Write the line and advance
+		fwrite(msg, next_line-msg, sizeof(char), stderr);
+		msg = next_line;
+	}
+	fputs(color ? "\033[0m\n" : "\n", stderr);
+	fflush(stderr);
+}
+#endif
 
 
 /*SDOC***********************************************************************
@@ -120,7 +154,9 @@ static int report(lua_State* L, int status) {
 typedef void(*psighndlr)(int);
 psighndlr setsignal(psighndlr sighndlr) {
 	signal(SIGABRT, sighndlr);
+#ifdef SIGBREAK
 	signal(SIGBREAK, sighndlr);	
+#endif
 	signal(SIGTERM, sighndlr);
 	return signal(SIGINT, sighndlr);
 }
@@ -218,6 +254,7 @@ static int dolibrary(lua_State* L, const char* name) {
 /*SDOC***********************************************************************
 
 	Name:			set_flag
+						set_flag_number
 						set_max_jobs
 
 	Action:		Helpers used by the command-line parsing code to set a lua
@@ -235,6 +272,17 @@ static int set_flag(lua_State* L, const char* name, int value) {
 	return 0;
 }
 
+static int set_flag_number(lua_State* L, const char* name, lua_Number value) {
+	lua_getglobal(L, LUA_MAKELIBNAME);
+	lua_getfield(L, -1, "flags");
+	luaL_checktype(L, -1, LUA_TTABLE);
+	lua_pushstring(L, name);
+	lua_pushnumber(L, value);
+	lua_settable(L, -3);
+	lua_pop(L, 2); // pop "make" and "flags"
+	return 0;
+}
+
 static int set_max_jobs(lua_State* L, int max_jobs) {
 	if(!max_jobs) max_jobs = 1024; // some ridiculous number
 	lua_getglobal(L, LUA_MAKELIBNAME);
@@ -288,9 +336,13 @@ static int parse_commandline(lua_State* L, bool executeCode) {
 					case 'd': set_flag(L, "debug", 1); break;
 					case 'k': set_flag(L, "keep_going", 1); break;
 					case 'n': set_flag(L, "noisy", 1); break;
+					case 'O': set_flag(L, "output_sync", 1); break;
+					case 'P': set_flag(L, "pin", 1); break;
 					case 'q': set_flag(L, "question", 1); break;
 					case 'Q': set_flag(L, "quit", 1); s->quit = true; break;
 					case 'v': print_version(); s->status = 1; return 0;
+					case 'x': set_flag(L, "fail_fast", 1); break;
+					case 'Z': set_flag(L, "zygote", 1); break;
 					case 'C': get_arg();	// change directory
 						lua_pushstring(L, arg);
 						make_dir_cd(L);
@@ -313,7 +365,16 @@ static int parse_commandline(lua_State* L, bool executeCode) {
 						}
 						break;
 					case 'j':	get_arg();	// max_jobs
-						set_max_jobs(L, atoi(arg));
+						if(strcmp(arg, "auto") == 0)
+							set_flag(L, "auto_jobs", 1); // see make.jobs.auto in mkinit.lua
+						else
+							set_max_jobs(L, atoi(arg));
+						break;
+					case 'M':	get_arg();	// memory budget
+						set_flag_number(L, "memory", atoi(arg));
+						break;
+					case 'S':	get_arg();	// summary
+						set_flag_number(L, "summary", atoi(arg) > 0 ? atoi(arg) : 10);
 						break;
 					case 'h':
 					default:	// unrecognized switch
@@ -336,7 +397,11 @@ static int parse_commandline(lua_State* L, bool executeCode) {
 			char* buffer = (char*)_alloca(strlen(s->argv[i]));
 			char* key = buffer;
 			char* pos = s->argv[i];
+#ifdef _WIN32
 			while(*pos && *pos != '=') *key++ = toupper(*pos++);
+#else
+			while(*pos && *pos != '=') *key++ = *pos++; // POSIX names are case-sensitive
+#endif
 			*key++ = 0; pos++;
 			lua_pushstring(L,buffer);
 
@@ -367,6 +432,55 @@ static int parse_commandline(lua_State* L, bool executeCode) {
 }
 
 
+/*SDOC***********************************************************************
+
+	Name:			wants_zygote
+
+	Action:		Returns true if "-Z" is on the command-line.  This runs before
+						parse_commandline(), so it only walks the switches the same way
+						(skipping their arguments); it doesn't interpret them.
+
+***********************************************************************EDOC*/
+static bool wants_zygote(struct Smain* s) {
+	for(int i = 1; s->argv[i] != NULL; i++) {
+		if(s->argv[i][0] != '-')
+			continue;
+		if(s->argv[i][1] == '-') {
+			if(s->argv[i][2] == 0)
+				return false; // "--" turns off switch parsing
+			continue;
+		}
+		for(char* sw = &s->argv[i][1]; *sw; sw++) {
+			if(*sw == 'Z')
+				return true;
+			if(strchr("CefljMS", *sw)) {
+				// the rest of this argument (or the next one) is the switch's argument
+				if(!*(sw+1) && s->argv[i+1])
+					i++;
+				break;
+			}
+		}
+	}
+	return false;
+}
+
+
+/*SDOC***********************************************************************
+
+	Name:			file_exists
+
+	Action:		Returns true if the specified file exists.
+
+***********************************************************************EDOC*/
+static bool file_exists(const char* name) {
+#ifdef _WIN32
+	return PathFileExistsA(name) ? true : false;
+#else
+	return access(name, F_OK) == 0;
+#endif
+}
+
+
 /*SDOC***********************************************************************
 
 	Name:			pmain
@@ -380,6 +494,10 @@ static int pmain(lua_State* L) {
 	struct Smain* s = (struct Smain*)lua_touserdata(L, 1);
 	g_L = L;
 
+	// "-Z"; fork the zygote now, before the Lua state has anything in it
+	if(wants_zygote(s) && !make_zygote_start())
+		luaL_error(L, "error starting zygote: %s", strerror(errno));
+
 	// One-time initialization
 	lua_gc(L, LUA_GCSTOP, 0);								// stop garbage collector during init
 	luaL_openlibs(L);												// open std libraries (string, table, etc.)
@@ -420,9 +538,9 @@ static int pmain(lua_State* L) {
 	// in the current directory.
 	if(!s->loaded_file) {
 		// try makefile.lua
-		if(PathFileExistsA("makefile.lua")) {
+		if(file_exists("makefile.lua")) {
 			handle_status(dofile(L, "makefile.lua"));
-		} else if(PathFileExistsA("makefile")) {
+		} else if(file_exists("makefile")) {
 			handle_status(dofile(L, "makefile"));
 		} else {
 			luaL_error(L, "No targets specified and no makefile found.  Stop.");
@@ -8,8 +8,38 @@
 	Description:	Precompiled header file for MSVC
 
 ***********************************************************************EDOC*/
+#ifdef _WIN32
 #include <windows.h>
 #include <shlwapi.h>
+#include <psapi.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <alloca.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+#define _alloca alloca
+extern char** environ;
+#endif
 
 #include <ctype.h>
 #include <stddef.h>
@@ -25,6 +55,12 @@ extern "C" {
 #include "lualib.h"
 }
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <limits>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 // RSA Data Security, Inc. MD5 Message-Digest Algorithm
@@ -32,6 +68,7 @@ extern "C" {
 #include "md5.h"
 }
 
+#ifdef _WIN32
 // CreatePipe-like function that lets one or both handles be overlapped
 extern "C" {
 BOOL APIENTRY MyCreatePipeEx(OUT LPHANDLE lpReadPipe, 
@@ -41,3 +78,4 @@ BOOL APIENTRY MyCreatePipeEx(OUT LPHANDLE lpReadPipe,
 														 DWORD dwReadMode,
 														 DWORD dwWriteMode);
 }
+#endif
@@ -1,9 +1,12 @@
 -- Test all the helper functions
 assert(make.path.get_name(make.path.current_file()) == "tests.lua")
-assert(make.path.to_os("c:/path/to") == "c:\\path\\to")
-assert(make.path.from_os("c:\\path\\to") == "c:/path/to")
-assert(string.lower(make.path.short("c:/program files")) == "c:/progra~1")
-assert(string.lower(make.path.long("c:/progra~1")) == "c:/program files")
+-- (Windows path syntax, and 8.3 names)
+if make.os == "windows" then
+	assert(make.path.to_os("c:/path/to") == "c:\\path\\to")
+	assert(make.path.from_os("c:\\path\\to") == "c:/path/to")
+	assert(string.lower(make.path.short("c:/program files")) == "c:/progra~1")
+	assert(string.lower(make.path.long("c:/progra~1")) == "c:/program files")
+end
 assert(make.path.full("foo.txt") == make.path.combine(make.dir.cd(),"foo.txt"))
 assert(make.path.canonicalize("c:/path/to/../to/../.") == "c:/path")
 assert(make.path.add_slash("c:/path/to") == "c:/path/to/")
@@ -23,10 +26,13 @@ assert(make.path.combine("c:/path/to","foo.cpp") == "c:/path/to/foo.cpp")
 assert(make.path.combine("c:/path","to","foo.cpp") == "c:/path/to/foo.cpp")
 assert(make.path.common("c:/path/to/1.cpp","c:/path/to/2.cpp") == "c:/path/to")
 assert(make.path.common("c:/path/to/1.cpp","c:/path/two/2.cpp") == "c:/path")
-assert(string.lower(make.path.where("notepad.exe")) == "c:/windows/system32/notepad.exe")
-assert(make.path.where("notepad.exe",{"c:/windows","c:/windows/system32"}) == "c:/windows/notepad.exe")
-assert(make.path.where("notepad.exe","c:/windows;c:/windows/system32") == "c:/windows/notepad.exe")
-assert(make.file.exists("c:/windows/notepad.exe"))
+-- (Windows paths and programs)
+if make.os == "windows" then
+	assert(string.lower(make.path.where("notepad.exe")) == "c:/windows/system32/notepad.exe")
+	assert(make.path.where("notepad.exe",{"c:/windows","c:/windows/system32"}) == "c:/windows/notepad.exe")
+	assert(make.path.where("notepad.exe","c:/windows;c:/windows/system32") == "c:/windows/notepad.exe")
+	assert(make.file.exists("c:/windows/notepad.exe"))
+end
 assert(not(make.file.exists("a-file-that-should-not-exist")))
 assert(make.path.remove_ext("c:/path°/to/foo.cpp") == "c:/path°/to/foo") -- Test UTF-8 round-tripping
 -- make.path.combine supports the __tostring metamethod
@@ -51,6 +57,525 @@ assert(timestamp <= timestamp2) -- we need to sleep; otherwise the timestamps ar
 make.file.delete(tempfile)
 assert(not(make.file.exists(tempfile)))
 
+-- make.proc.wait; it takes more processes than WaitForMultipleObjects() 
+-- can (64), and each one's exit code comes back with it
+presto = make.env.PRESTO or "presto"
+waiting, exit_codes = {}, {}
+for i = 1,70 do
+	waiting[i] = make.proc.spawn('"' .. presto .. '" -Q -e "os.exit(' .. (i % 7) .. ')"')
+	exit_codes[waiting[i]] = i % 7
+end
+while #waiting > 0 do
+	make.proc.wait(waiting)
+	for i = #waiting,1,-1 do
+		make.proc.flushio(waiting[i])
+		local code = make.proc.exit_code(waiting[i])
+		if code then
+			assert(code == exit_codes[waiting[i]])
+			table.remove(waiting, i)
+		end
+	end
+end
+
+-- make.proc.wait only reports the processes it was given; what happens
+-- to the others is kept for the next wait
+quick = make.proc.spawn('"' .. presto .. '" -Q -e "os.exit(3)"')
+slow = make.proc.spawn('"' .. presto .. '" -Q -e "local t = make.now() + 0.5 while make.now() < t do end"')
+while make.proc.exit_code(slow) == nil do
+	for _,proc in ipairs(make.proc.wait({ slow })) do assert(proc == slow); end
+	make.proc.flushio(slow)
+end
+ready = make.proc.wait({ [quick] = true }, 0)
+assert(#ready == 1 and ready[1] == quick)
+make.proc.flushio(quick)
+assert(make.proc.exit_code(quick) == 3)
+
+--
+-- Targets and jobs; the jobs run as the "tests" goal, so give them some
+-- slots (e.g., "presto -j4 -f tests.lua")
+--
+tests = phony_target("tests")
+
+-- adds a job to the "tests" goal; each one waits for the one before it,
+-- so that they don't share the job slots
+function job_test(name, command)
+	local t = phony_target(name)
+	t.command = command
+	if last_job_test then t:depends_on{last_job_test}; end
+	last_job_test = name
+	tests:depends_on{name}
+end
+
+-- make.proc.flushio; lines of any length come through whole, whatever
+-- they end with (LF, CRLF or CR, or nothing at all at the very end)
+job_test("output_lines", function(self)
+	local lines = {}
+	make.run('"' .. presto .. [[" -Q -e "io.write(string.rep('x', 50000), '\n', 'a\r\nb\rc\n', 'tail')"]], nil, function(line)
+		lines[#lines+1] = line
+	end)
+	assert(#lines == 5 and lines[1] == string.rep("x", 50000))
+	assert(table.concat(lines, " ", 2) == "a b c tail")
+end)
+
+-- runs a makefile (given as a string) in a presto of its own, from a job;
+-- returns its exit code and its output.  The makefile can use PRESTO, and
+-- pause(s), which runs a process that takes s seconds.
+function sub_build(makefile, ...)
+	local file = make.file.temp()
+	local f = io.open(file, "w")
+	f:write("PRESTO = ", string.format("%q", presto), "\n", [[
+		function pause(s)
+			make.run('"' .. PRESTO .. '" -Q -e "local t = make.now() + ' .. s .. ' while make.now() < t do end"')
+		end
+	]], makefile)
+	f:close()
+	local lines = {}
+	local ok, err = pcall(make.run, '"' .. presto .. '" -f "' .. file .. '" ' .. table.concat({...}, " "), nil, function(line)
+		lines[#lines+1] = line
+	end)
+	make.file.delete(file)
+	return ok and 0 or tonumber(string.match(err, "Error (%-?%d+)$")), table.concat(lines, "\n")
+end
+
+-- the lines of some output that match a pattern, separated by spaces
+function matching_lines(output, pattern)
+	local lines = {}
+	for line in string.gmatch(output, "[^\n]+") do
+		if string.find(line, pattern) then lines[#lines+1] = line; end
+	end
+	return table.concat(lines, " ")
+end
+
+-- "-O"; a job's output comes out in one piece, once the job is done
+job_test("output_sync", function(self)
+	local makefile = [[
+		phony_target("all"):depends_on{"a", "b"}
+		phony_target("a").command = function() print("a1"); pause(0.4); print("a2") end
+		phony_target("b").command = function() pause(0.2); print("b1"); pause(0.4); print("b2") end
+	]]
+	local code, output = sub_build(makefile, "-j2")
+	assert(code == 0 and matching_lines(output, "^[ab]%d$") == "a1 b1 a2 b2", output)
+	code, output = sub_build(makefile, "-j2", "-O")
+	assert(code == 0 and matching_lines(output, "^[ab]%d$") == "a1 a2 b1 b2", output)
+end)
+
+-- make.run; an argv table goes to the program as it is, without a shell
+job_test("argv_command", function(self)
+	local text = [[$HOME "quoted" 'single' \back ; `x` | & > %PATH% *]]
+	local lines = {}
+	make.run({presto, "-Q", "-e", "print(" .. string.format("%q", text) .. ")"}, nil, function(line)
+		lines[#lines+1] = line
+	end)
+	assert(#lines == 1 and lines[1] == text, lines[1])
+	assert(make.proc.command_line({"a b", "c"}) ~= "a b c")
+end)
+
+-- make.proc.send/receive; each message is one frame, whatever is in it
+-- (or however big it is), and comes back whole
+echo_worker = [[
+	while true do
+		local header = io.stdin:read(4)
+		if not header or #header < 4 then break; end
+		local a, b, c, d = string.byte(header, 1, 4)
+		local n = ((a * 256 + b) * 256 + c) * 256 + d
+		local data = n > 0 and io.stdin:read(n) or ""
+		n = #data
+		io.stdout:write(string.char(math.floor(n / 2^24) % 256, math.floor(n / 2^16) % 256, math.floor(n / 2^8) % 256, n % 256))
+		io.stdout:write(string.reverse(data))
+		io.stdout:flush()
+	end
+]]
+job_test("send_receive", function(self)
+	local worker = make.proc.spawn({presto, "-Q", "-e", echo_worker}, nil, { stdin = true, stderr = "inherit", framed = true })
+	local messages = { "", "a\0b\nc\n", string.rep("0123456789", 20000) .. "end" }
+	for _,message in ipairs(messages) do assert(make.proc.send(worker, message)); end
+	for _,message in ipairs(messages) do
+		local response = make.proc.receive(worker)
+		while response == nil and make.proc.exit_code(worker) == nil do
+			coroutine.yield(worker)
+			response = make.proc.receive(worker)
+		end
+		assert(response == string.reverse(message))
+	end
+	make.proc.send(worker) -- closes its stdin
+	while make.proc.exit_code(worker) == nil do
+		coroutine.yield(worker)
+		make.proc.flushio(worker)
+	end
+	assert(make.proc.exit_code(worker) == 0 and make.proc.receive(worker) == nil)
+end)
+
+-- "-M"; a job only starts if its memory (declared, or learned from the
+-- last build) fits in what the running jobs leave of the budget
+job_test("memory_budget", function(self)
+	local makefile = [[
+		local running, most = 0, 0
+		local job = function()
+			running = running + 1
+			most = math.max(most, running)
+			pause(0.3)
+			running = running - 1
+		end
+		local all = phony_target("all")
+		all.command = function() print("most " .. most) end
+		for _,name in ipairs{"declared1", "declared2", "learned1", "learned2"} do
+			phony_target(name).command = job
+			all:depends_on{name}
+		end
+		target["declared1"].mem, target["declared2"].mem = "60M", 60 * 2^20
+		make.db.targets["learned1"] = { maxrss = 60 * 2^20 }
+		make.db.targets["learned2"] = { maxrss = 60 * 2^20 }
+	]]
+	local code, output = sub_build(makefile, "-j4", "-M", "100")
+	assert(code == 0 and matching_lines(output, "^most") == "most 1", output)
+	code, output = sub_build(makefile, "-j4", "-M", "1000")
+	assert(code == 0 and matching_lines(output, "^most") == "most 4", output)
+end)
+
+-- make.db; what's learned about a target is merged into its entry, and
+-- the entries come back from the file as they went in
+saved_db = { file = make.db.file, targets = make.db.targets, dirty = make.db.dirty }
+make.db.file, make.db.targets = make.file.temp(), {}
+make.db.targets["db_test"] = { maxrss = 1024 }
+make.db.learn("db_test", { wall = 1.5 })
+make.db.learn("db_test/\"odd\"\nname", { wall = 0.25, maxrss = 2^40 })
+assert(make.db.dirty)
+make.db.save()
+assert(not make.db.dirty)
+make.db.targets = {}
+make.db.load()
+assert(make.db.targets["db_test"].maxrss == 1024 and make.db.targets["db_test"].wall == 1.5)
+assert(make.db.targets["db_test/\"odd\"\nname"].wall == 0.25 and make.db.targets["db_test/\"odd\"\nname"].maxrss == 2^40)
+make.file.delete(make.db.file)
+make.db.file, make.db.targets, make.db.dirty = saved_db.file, saved_db.targets, saved_db.dirty
+
+-- "-j auto"; it starts with a slot per CPU, adds slots while they're all
+-- busy and the machine has headroom, and cuts them back under pressure
+job_test("auto_jobs", function(self)
+	local makefile = function(slots, pressure) return [[
+		assert(make.jobs.slots == math.max(1, math.ceil(make.jobs.auto.cpus)))
+		make.jobs.slots, make.jobs.auto.max, make.jobs.auto.interval = ]] .. slots .. [[, 3, 0.1
+		make.env.MAKEFLAGS = nil -- (our own slots, not the tests' jobserver's)
+		make.sys.loadavg = function() return 0 end
+		make.sys.pressure = function(kind) return kind == "cpu" and { some = ]] .. pressure .. [[ } or nil end
+		local all = phony_target("all")
+		all.command = function()
+			for _,entry in ipairs(make.jobs.auto.log) do
+				local slots, reason = string.match(entry, "%-> (%d+) %((%a[%a ]*)")
+				print("changed " .. slots .. " " .. reason)
+			end
+		end
+		for i = 1,4 do
+			phony_target("job" .. i).command = function()
+				pause(0.5)
+			end
+			all:depends_on{"job" .. i}
+		end
+	]] end
+	local code, output = sub_build(makefile(1, 0), "-j", "auto")
+	assert(code == 0 and matching_lines(output, "^changed") == "changed 2 headroom changed 3 headroom", output)
+	code, output = sub_build(makefile(3, 50), "-j", "auto")
+	assert(code == 0 and matching_lines(output, "^changed") == "changed 2 cpu pressure changed 1 cpu pressure", output)
+end)
+
+-- the jobserver; a presto run from one of our jobs takes its slots from
+-- ours, whatever its own "-j" says
+job_test("jobserver", function(self)
+	if make.jobserver.mode ~= "server" then return; end -- (e.g., "-j1")
+	local makefile = [[
+		local running, most = 0, 0
+		local all = phony_target("all")
+		all.command = function() print("most " .. most .. " " .. tostring(make.jobserver.mode)) end
+		for i = 1,8 do
+			phony_target("job" .. i).command = function()
+				running = running + 1
+				most = math.max(most, running)
+				pause(0.3)
+				running = running - 1
+			end
+			all:depends_on{"job" .. i}
+		end
+	]]
+	local code, output = sub_build(makefile, "-j8")
+	assert(code == 0 and matching_lines(output, "^most") == "most " .. make.jobs.slots - make.jobserver.held .. " client", output)
+end)
+
+-- "-Z"; the zygote starts the processes, instead of presto itself
+job_test("zygote", function(self)
+	if not make.file.exists("/proc/self/stat") then return; end -- (Linux only)
+	local makefile = [[
+		phony_target("all").command = function()
+			print("presto " .. io.open("/proc/self/stat"):read("*n"))
+			make.run("echo parent $PPID")
+		end
+	]]
+	local code, output = sub_build(makefile)
+	local own, parent = string.match(output, "presto (%d+).*parent (%d+)")
+	assert(code == 0 and own and own == parent, output)
+	code, output = sub_build(makefile, "-Z")
+	own, parent = string.match(output, "presto (%d+).*parent (%d+)")
+	assert(code == 0 and own and parent and own ~= parent, output)
+end)
+
+-- make.run's stdout and stderr can go straight to a file (both to the 
+-- same one, if need be), be added to the end of one, or be copied to one
+job_test("output_files", function(self)
+	local lua = function(code) return {presto, "-Q", "-e", code} end
+	local read = function(file)
+		local f = io.open(file)
+		local text = f:read("*a")
+		f:close()
+		return text
+	end
+	local file, copy = make.file.temp(), make.file.temp()
+	local lines = {}
+	local printfn = function(line) lines[#lines+1] = line end
+	make.run(lua("io.write('out\\n') io.stdout:flush() io.stderr:write('err\\n')"), nil, printfn, { stdout = file, stderr = file })
+	make.run(lua("print('more')"), nil, printfn, { stdout = { file, append = true } })
+	assert(read(file) == "out\nerr\nmore\n" and #lines == 0)
+	make.run(lua("print('copied')"), nil, printfn, { stdout = { copy, tee = true } })
+	assert(read(copy) == "copied\n" and table.concat(lines, " ") == "copied")
+	make.file.delete(file)
+	make.file.delete(copy)
+end)
+
+-- io.write(), print() and a job's processes all go through the same 
+-- queue, so the output comes out in the order it was written
+job_test("output_order", function(self)
+	local makefile = [[
+		io.write("loading\n")
+		phony_target("all").command = function()
+			io.write("one ")
+			print("two")
+			make.run('"' .. PRESTO .. '" -Q -e "print(\'three\')"')
+			io.write("four\n")
+		end
+	]]
+	local code, output = sub_build(makefile)
+	assert(code == 0 and string.find(output, "loading\none two\nthree\nfour\n", 1, true), output)
+end)
+
+-- a process is reaped as soon as it exits, rather than when a timer next
+-- goes off; a hundred quick ones in a row take a lot less than 10ms each
+job_test("reap_latency", function(self)
+	if not make.file.exists("/proc/self/stat") then return; end -- (Linux only; elsewhere it's a timer)
+	local started = make.now()
+	for i = 1,100 do make.run('"' .. presto .. '" -Q -e ""') end
+	assert(make.now() - started < 0.9, make.now() - started)
+end)
+
+-- "-x"; the first failure kills the other jobs, along with everything
+-- they started (which would otherwise keep our output pipe open)
+job_test("fail_fast", function(self)
+	local makefile = [[
+		phony_target("all"):depends_on{"fails", "sleeps"}
+		phony_target("fails").command = function() pause(0.3); error("failed") end
+		phony_target("sleeps").command = function()
+			make.run(make.os == "windows" and "cmd /c ping -n 6 127.0.0.1 >nul" or "sleep 5 & wait")
+		end
+	]]
+	local started = make.now()
+	local code, output = sub_build(makefile, "-j2", "-x")
+	assert(code ~= 0 and matching_lines(output, "failed") ~= "", output)
+	assert(make.now() - started < 4, output)
+end)
+
+-- make.run_many(); the exit codes and output come back in the order of 
+-- the commands, whichever finishes first, with or without a limit
+job_test("run_many_results", function(self)
+	local lua = function(code) return {presto, "-Q", "-e", code} end
+	local commands = {
+		lua("local t = make.now() + 0.3 while make.now() < t do end print('first') os.exit(3)"),
+		lua("print('second') io.stderr:write('to stderr\\n')"),
+		lua("os.exit(0)"),
+	}
+	for _,options in ipairs{ {}, { max = 1 } } do
+		local codes, outputs = make.run_many(commands, options)
+		assert(codes[1] == 3 and codes[2] == 0 and codes[3] == 0)
+		assert(outputs[1] == "first\n" and outputs[2] == "second\nto stderr\n" and outputs[3] == "", outputs[2])
+	end
+end)
+
+-- a command that can't be started stops the rest of its make.run_many() 
+-- batch, and gives back the batch's job slots
+sleep_command = make.os == "windows" and {"ping", "-n", "6", "127.0.0.1"} or {"sleep", "5"}
+job_test("run_many_spawn_error", function(self)
+	local started, extra = make.now(), make.jobs.extra
+	local ok, err = pcall(make.run_many, {
+		sleep_command, sleep_command, {"a-program-that-should-not-exist"}, sleep_command
+	})
+	assert(not ok and err)
+	assert(make.jobs.extra == extra and make.jobserver.held <= make.jobs.used())
+	for _,job in pairs(make.jobs.blocked) do assert(job ~= make.jobs.current) end
+	assert(make.jobs.slots < 3 or make.now() - started < 4) -- the sleeps were killed
+end)
+
+-- the "cpus" spawn option; the process runs only on the CPUs it's given
+job_test("spawn_cpus", function(self)
+	local nodes = make.sys.topology()
+	if not nodes or not make.file.exists("/proc/self/status") then return; end -- (Linux only)
+	local cpus = nodes[#nodes].cpus
+	local lines = {}
+	make.run({presto, "-Q", "-e", "for line in io.lines('/proc/self/status') do print(line) end"}, nil, function(line)
+		lines[#lines+1] = line
+	end, { cpus = { cpus[#cpus] } })
+	assert(matching_lines(table.concat(lines, "\n"), "^Cpus_allowed_list:") == "Cpus_allowed_list:\t" .. cpus[#cpus])
+end)
+
+-- make.env_block; a process gets the block as it is, and a block derived
+-- from it can change (or drop) variables without changing the original
+job_test("env_block", function(self)
+	local base = make.env_block(make.env, { PRESTO_TEST_A = "a", PRESTO_TEST_B = "b" })
+	local derived = base:with{ PRESTO_TEST_A = "changed", PRESTO_TEST_B = false }
+	assert(base:get("PRESTO_TEST_A") == "a" and derived:get("PRESTO_TEST_A") == "changed")
+	assert(derived:get("PRESTO_TEST_B") == nil and derived:get("PATH") == base:get("PATH"))
+	assert(not pcall(function() base.PRESTO_TEST_A = "x" end))
+	local show = function(env)
+		local lines = {}
+		make.run({presto, "-Q", "-e", "print(os.getenv('PRESTO_TEST_A'), os.getenv('PRESTO_TEST_B'))"}, env, function(line)
+			lines[#lines+1] = line
+		end)
+		return lines[1]
+	end
+	assert(show(base) == "a\tb" and show(derived) == "changed\tnil")
+end)
+
+-- make.capture; a cached output is used until the PATH or the program 
+-- itself changes
+job_test("capture_cache", function(self)
+	local temp, count = make.file.temp(), make.file.temp()
+	local tool = temp .. (make.os == "windows" and ".exe" or "")
+	make.file.delete(temp) -- (so the copy gets presto's permissions)
+	make.file.copy(presto, tool)
+	local command = '"' .. tool .. '" -Q -e "io.open([[' .. count .. ']], \'a\'):write(\'x\') print(\'probe\')"'
+	local runs = function(options)
+		assert(make.capture(command, options) == "probe\n")
+		local f = io.open(count)
+		local n = #f:read("*a")
+		f:close()
+		return n
+	end
+	assert(runs{ cache = true } == 1 and runs{ cache = true } == 1 and runs() == 2)
+	local env = make.env_block(make.env, { PATH = make.env.PATH .. (make.os == "windows" and ";" or ":") .. temp })
+	assert(runs{ cache = true, env = env } == 3 and runs{ cache = true, env = env } == 3)
+	make.file.touch(tool)
+	assert(runs{ cache = true } == 4 and runs{ cache = true } == 4)
+	make.file.delete(count)
+	make.file.delete(tool)
+end)
+
+-- make.sched; a target is ready once the last of its dependencies is
+-- done, and one that's put back in line keeps its place
+ready_test = make.sched.node("ready_test")
+ready_test_a, ready_test_b = make.sched.node("ready_test_a"), make.sched.node("ready_test_b")
+make.sched.depend(ready_test, ready_test_a)
+make.sched.depend(ready_test, ready_test_b)
+for _,id in ipairs{ready_test, ready_test_a, ready_test_b} do make.sched.add(id); end
+assert(make.sched.queued() == 2 and select(2, make.sched.name(ready_test)) == "waiting")
+assert(make.sched.next() == ready_test_a)
+make.sched.requeue(ready_test_a)
+assert(make.sched.next() == ready_test_a)
+make.sched.done(ready_test_a)
+assert(make.sched.next() == ready_test_b and make.sched.next() == nil)
+make.sched.done(ready_test_b)
+assert(select(2, make.sched.name(ready_test)) == "ready" and make.sched.next() == ready_test)
+make.sched.reset()
+
+-- make.sched.prioritize; the ready targets come out longest path first, so
+-- a target with more work waiting on it goes ahead of one that only costs
+-- more
+critical_costs = { critical_test = 0, critical_test_a = 1, critical_test_b = 3, critical_test_c = 2, critical_test_d = 2 }
+critical_deps = { critical_test = {"critical_test_a", "critical_test_b", "critical_test_c"}, critical_test_c = {"critical_test_d"} }
+for name,cost in pairs(critical_costs) do
+	local id = make.sched.node(name)
+	for _,dep in ipairs(critical_deps[name] or {}) do make.sched.depend(id, make.sched.node(dep)); end
+	make.sched.cost(id, cost)
+end
+for name in pairs(critical_costs) do make.sched.add(make.sched.node(name)); end
+critical_length, critical_path = make.sched.prioritize()
+assert(critical_length == 4 and table.concat(critical_path, " ") == "critical_test_d critical_test_c critical_test")
+assert(make.sched.name(make.sched.next()) == "critical_test_d")
+assert(make.sched.name(make.sched.next()) == "critical_test_b")
+assert(make.sched.name(make.sched.next()) == "critical_test_a")
+make.sched.reset()
+
+-- a target's deps come from the graph; adding to them adds to the graph
+deps_test = phony_target("deps_test")
+deps_test:depends_on{"deps_test_a"}
+deps_test.deps["deps_test_b"] = true
+assert(deps_test.deps.deps_test_a and deps_test.deps.deps_test_b)
+assert(make.graph.deps("deps_test")[2] == "deps_test_b")
+assert(not pcall(function() deps_test.deps[1] = true end))
+
+-- make.graph.cycle; a cycle comes back as the path around it, starting
+-- and ending with the same name, and there's none below an acyclic target
+make.graph.depend("cycle_test_a", "cycle_test_b")
+make.graph.depend("cycle_test_b", "cycle_test_c")
+make.graph.depend("cycle_test_c", "cycle_test_a")
+make.graph.depend("cycle_test", "cycle_test_a")
+assert(table.concat(make.graph.cycle("cycle_test"), " ") == "cycle_test_a cycle_test_b cycle_test_c cycle_test_a")
+make.graph.depend("acyclic_test", "acyclic_test_b")
+make.graph.depend("acyclic_test", "acyclic_test_a")
+assert(make.graph.cycle("acyclic_test") == nil)
+
+-- make.pool(); no more than a pool's depth of its jobs run at once, and
+-- the jobs in no pool go ahead of the ones waiting in line
+job_test("pool_limits", function(self)
+	local makefile = [[
+		local running, most = { two = 0, none = 0, all = 0 }, { two = 0, none = 0, all = 0 }
+		local job = function(pool)
+			return function()
+				for _,k in ipairs{pool, "all"} do
+					running[k] = running[k] + 1
+					most[k] = math.max(most[k], running[k])
+				end
+				pause(0.3)
+				for _,k in ipairs{pool, "all"} do running[k] = running[k] - 1; end
+			end
+		end
+		local all = phony_target("all")
+		all.command = function() print("most " .. most.two .. " " .. most.all) end
+		make.pool("two", 2)
+		for i = 1,5 do
+			local t = phony_target("two" .. i)
+			t.pool = "two"
+			t.command = job("two")
+			all:depends_on{t.name}
+		end
+		phony_target("none").command = job("none")
+		all:depends_on{"none"}
+	]]
+	local code, output = sub_build(makefile, "-j4")
+	assert(code == 0 and matching_lines(output, "^most") == "most 2 3", output)
+end)
+
+-- make.seal(); sealed targets start building while the makefile is still
+-- loading, and the build still finishes as usual
+job_test("seal", function(self)
+	local makefile = function(seal) return [[
+		phony_target("all"):depends_on{"early"}
+		phony_target("early").command = function() print("early started"); pause(0.2); print("early done") end
+	]] .. seal .. [[
+		print("loaded")
+	]] end
+	local code, output = sub_build(makefile("make.seal()"), "-j2")
+	assert(code == 0 and matching_lines(output, "^[el][ao]") == "early started loaded early done", output)
+	code, output = sub_build(makefile(""), "-j2")
+	assert(code == 0 and matching_lines(output, "^[el][ao]") == "loaded early started early done", output)
+end)
+
+-- make.capture() while the makefile is loading doesn't take the events
+-- of the sealed targets' processes (or the build would never finish)
+job_test("seal_capture", function(self)
+	local code, output = sub_build([[
+		phony_target("all"):depends_on{"early"}
+		phony_target("early").command = function() make.run('"' .. PRESTO .. '" -Q -e "print(1)"'); print("early done") end
+		make.seal()
+		print("captured " .. make.capture('"' .. PRESTO .. '" -Q -e "local t = make.now() + 0.5 while make.now() < t do end io.write(2)"'))
+	]], "-j2")
+	assert(code == 0 and string.find(output, "captured 2") and string.find(output, "early done"), output)
+end)
+
 --
 -- Stuff that hasn't been tested yet:
 --
@@ -65,10 +590,6 @@ make.dir.temp
 make.dir.cd
 make.dir.md
 make.dir.rd
-make.proc.spawn
-make.proc.flushio
-make.proc.wait
-make.proc.exit_code
 make.now
 make.md5
 ]]--